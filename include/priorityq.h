@@ -32,9 +32,24 @@ extern "C" {
 
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
+/* Header-only build
+ * Define PRIORITYQ_HEADER_ONLY, with src/ also on the include path, to
+ * compile the implementation into each file that includes this header
+ * instead of linking the library. Every function is then static inline,
+ * so calls can inline and constant priorities fold. C only.
+ * An install puts the files from src/ beside this header.
+ */
+#ifdef PRIORITYQ_HEADER_ONLY
+#   define PQ_API static inline
+#else
+#   define PQ_API
+#endif
+
+
 /* Internal node */
 struct priorityq_node_s
 {
@@ -49,84 +64,648 @@ typedef struct priority_s
 {
     struct priorityq_node_s node;
     void *data;
-    uint8_t info[4]; // Internal data and flags.
+    uint8_t info[6]; // Internal data and flags.
 } priority_t;
 
-void
+PQ_API void
 priority_init(priority_t *);
-void
+PQ_API void
 priority_destroy(priority_t *);
-void
+PQ_API void
 priority_set(priority_t *, void *, uint8_t);
-uint8_t
+PQ_API uint8_t
 priority_value(priority_t *); // Well, I didn't want to call it priority_priority...
-void *
+PQ_API void *
 priority_data(priority_t *);
-bool
+PQ_API bool
 priority_is_active(priority_t *);
+PQ_API void
+priority_cancel(priority_t *);
+PQ_API bool
+priority_is_cancelled(priority_t *);
 
 
 /* Priority Manager */
 #define PQ_CEILING  (128)
 #define PQ_BINS (8)
+
+/* What an enqueue does when the queue is at capacity. */
+enum PQ_OVERFLOW_ENUM
+{
+    // Turn the new item away.
+    PQ_OVERFLOW_REJECT = 0,
+    // Evict the least urgent item, which may be the new one.
+    PQ_OVERFLOW_EVICT  = 1,
+};
+
+/* Aging presets
+ * Rates are in quarters of the default pace, so PQ_RATE_DEFAULT is 1x.
+ * Aging scales how many items are re-binned per dequeue and so how fast
+ * waiting items rise; promotion scales how many immediates move to done
+ * before a pause.
+ */
+#define PQ_RATE_DEFAULT (4)
+
+enum PQ_AGING_ENUM
+{
+    // The default pace of both.
+    PQ_AGING_BALANCED  = 0,
+    // Half the re-binning per dequeue, immediates drained eagerly; closer
+    // to strict priority.
+    PQ_AGING_THROUGHPUT = 1,
+    // Twice the aging, immediates held back for aged items.
+    PQ_AGING_FAIRNESS  = 2,
+};
+
+/* Cache line size used for alignment. */
+#ifndef PQ_CACHE_LINE
+#define PQ_CACHE_LINE (64)
+#endif
+
+#ifndef PQ_CACHE_ALIGNED
+#   ifdef __GNUC__
+#       define PQ_CACHE_ALIGNED __attribute__((aligned(PQ_CACHE_LINE)))
+#   else
+#       define PQ_CACHE_ALIGNED
+#   endif
+#endif
+
+/* Define PQ_ALIGN_QUEUES for the library and its users to align each
+ * priorityq_t, and so every struct holding one, to a cache line. Queues on
+ * the heap must then come from priorityq_alloc or aligned_alloc, since
+ * malloc only guarantees max_align_t.
+ */
+#ifdef PQ_ALIGN_QUEUES
+#   define PQ_QUEUE_ALIGNED PQ_CACHE_ALIGNED
+#else
+#   define PQ_QUEUE_ALIGNED
+#endif
+
+// Cache line aligned memory, e.g. for queues on the heap; sizes are rounded up.
+PQ_API void *
+priorityq_alloc(size_t);
+PQ_API void
+priorityq_free(void *);
+
+/* Statistics
+ * Define PQ_STATS for the library and its users to keep these.
+ * Every counter is updated in constant time on the paths it measures.
+ */
+#define PQ_STATS_HISTOGRAM (8)
 typedef struct
+{
+    uint64_t counter_advances;
+    // Items moved out of processing, in total and the most in one step.
+    uint64_t rebinned;
+    uint32_t rebinned_max;
+    // Steps taken by priorityq_dequeue calls; bucket i counts calls that
+    // took [2^i, 2^(i+1)) steps, the last bucket also counts anything more.
+    uint32_t dequeue_steps_max;
+    uint64_t dequeue_steps[PQ_STATS_HISTOGRAM];
+    // Enqueues of items already in the queue, by outcome.
+    uint64_t reprioritized;
+    uint64_t reprioritize_ignored;
+} priorityq_stats_t;
+
+// The fields every dequeue touches fit in the first cache line; with
+// PQ_ALIGN_QUEUES the bins only touched when advancing start on the next.
+typedef struct PQ_QUEUE_ALIGNED
 {
     // The priority counter is a rotating value using masking to simulate overflow.
     uint8_t pc;
+    // Bit i is set when bins[i] is non-empty.
+    uint8_t bin_mask;
+    // One of PQ_OVERFLOW_ENUM.
+    uint8_t overflow;
+    // The aging and immediate promotion rates, see PQ_RATE_DEFAULT.
+    uint8_t aging;
+    uint8_t promotion;
     uint32_t counter_imed;
     uint32_t size;
     uint32_t size_done;
     uint32_t size_imed;
     uint32_t size_q;
+    // Maximum organizing steps per dequeue; zero for no limit.
+    uint32_t step_limit;
     // Process these first, urgent items go here.
     struct priorityq_node_s done;
     // Process these next.
     struct priorityq_node_s immediate;
     // Work on moving priorities up.
-    struct priorityq_node_s processing;
+    PQ_QUEUE_ALIGNED struct priorityq_node_s processing;
     struct priorityq_node_s bins[PQ_BINS];
+    // The items of size_q in processing and in each bin; they change with
+    // the lists, so they are kept beside them.
+    uint32_t size_proc;
+    uint32_t size_bins[PQ_BINS];
+    // Bit i flips whenever bins[i] moves to processing.
+    uint8_t bin_phase;
+    // Cancelled items met while organizing, waiting to be reclaimed.
+    struct priorityq_node_s cancelled;
+    // Maximum number of items; zero for no limit.
+    uint32_t capacity;
+#ifdef PQ_STATS
+    priorityq_stats_t stats;
+#endif
 } priorityq_t;
 
-void
+PQ_API void
 priorityq_init(priorityq_t *);
-void
+PQ_API void
+priorityq_init_bounded(priorityq_t *, uint32_t);
+PQ_API void
+priorityq_set_capacity(priorityq_t *, uint32_t, int);
+PQ_API void
+priorityq_set_rates(priorityq_t *, uint8_t, uint8_t);
+PQ_API void
+priorityq_set_aging(priorityq_t *, int);
+PQ_API void
 priorityq_destroy(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_size(priorityq_t *);
 
-void
+PQ_API priority_t *
 priorityq_enqueue(priorityq_t *, priority_t *);
-priority_t *
+// Leaves the queue as priorityq_enqueue on each item in turn would,
+// reprioritized items included.
+PQ_API uint32_t
+priorityq_enqueue_batch(priorityq_t *, priority_t **, uint32_t);
+PQ_API priority_t *
 priorityq_dequeue(priorityq_t *);
-void
+// Takes whole runs off the done queue in the order priorityq_dequeue
+// would, but organizes once per run rather than per item.
+PQ_API uint32_t
+priorityq_dequeue_batch(priorityq_t *, priority_t **, uint32_t);
+PQ_API priority_t *
+priorityq_peek(priorityq_t *);
+PQ_API bool
+priorityq_advance(priorityq_t *, uint32_t);
+PQ_API void
 priorityq_remove(priorityq_t *, priority_t *);
+PQ_API uint32_t
+priorityq_evict(priorityq_t *, uint32_t, priority_t **);
+PQ_API priority_t *
+priorityq_update(priorityq_t *, priority_t *, uint8_t);
+PQ_API void
+priorityq_merge(priorityq_t *, priorityq_t *);
+// Constant time, O(bins): the items move to the caller's list and are
+// reset one at a time as priorityq_list_pop takes them.
+PQ_API void
+priorityq_drain(priorityq_t *, struct priorityq_node_s *);
+// Linear time, O(n): every item is reset in place and forgotten.
+PQ_API void
+priorityq_clear(priorityq_t *);
+PQ_API void
+priorityq_reclaim(priorityq_t *, struct priorityq_node_s *);
+
+/* Depths
+ * How the items are spread over the lists, kept as they move, so a copy
+ * takes O(bins) without walking anything.
+ */
+typedef struct
+{
+    uint32_t done;
+    uint32_t immediate;
+    uint32_t processing;
+    uint32_t bins[PQ_BINS];
+} priorityq_depths_t;
+
+PQ_API void
+priorityq_depths(priorityq_t *, priorityq_depths_t *);
+
+/* Snapshots
+ * A flat record of the queue for a warm restart by the same build.
+ * Items are identified by a caller-chosen id, e.g. their index in an array.
+ */
+typedef uint32_t (*priorityq_id_fn)(priority_t *, void *);
+
+PQ_API size_t
+priorityq_snapshot_size(priorityq_t *);
+PQ_API size_t
+priorityq_snapshot(priorityq_t *, void *, priorityq_id_fn, void *);
+PQ_API bool
+priorityq_restore(priorityq_t *, const void *, size_t, priority_t **, uint32_t);
+#ifdef PQ_STATS
+PQ_API void
+priorityq_stats(priorityq_t *, priorityq_stats_t *);
+#endif
+
+
+/* Lists of drained priorities */
+PQ_API void
+priorityq_list_init(struct priorityq_node_s *);
+PQ_API priority_t *
+priorityq_list_pop(struct priorityq_node_s *);
+
+
+/* Wide Priority Managers
+ * The same queue with a counter and relative priorities of the given width
+ * and one bin per bit, e.g. priorityq16_t takes priorities below 32768.
+ * Only the core interface is provided.
+ */
+#define PQ_WIDE_CEILING(bits) ((uint32_t)1 << ((bits) - 1))
+
+#define PQ_WIDE_DECLARE(bits) \
+typedef struct priority##bits##_s \
+{ \
+    struct priorityq_node_s node; \
+    void *data; \
+    uint##bits##_t info[4]; \
+} priority##bits##_t; \
+\
+typedef struct \
+{ \
+    uint##bits##_t pc; \
+    uint##bits##_t bin_mask; \
+    uint32_t counter_imed; \
+    uint32_t size; \
+    uint32_t size_done; \
+    uint32_t size_imed; \
+    uint32_t size_q; \
+    struct priorityq_node_s done; \
+    struct priorityq_node_s immediate; \
+    struct priorityq_node_s processing; \
+    struct priorityq_node_s bins[bits]; \
+} priorityq##bits##_t; \
+\
+PQ_API void priority##bits##_init(priority##bits##_t *); \
+PQ_API void priority##bits##_destroy(priority##bits##_t *); \
+PQ_API void priority##bits##_set(priority##bits##_t *, void *, uint##bits##_t); \
+PQ_API uint##bits##_t priority##bits##_value(priority##bits##_t *); \
+PQ_API void *priority##bits##_data(priority##bits##_t *); \
+PQ_API bool priority##bits##_is_active(priority##bits##_t *); \
+\
+PQ_API void priorityq##bits##_init(priorityq##bits##_t *); \
+PQ_API void priorityq##bits##_destroy(priorityq##bits##_t *); \
+PQ_API uint32_t priorityq##bits##_size(priorityq##bits##_t *); \
+PQ_API void priorityq##bits##_enqueue(priorityq##bits##_t *, priority##bits##_t *); \
+PQ_API priority##bits##_t *priorityq##bits##_dequeue(priorityq##bits##_t *); \
+PQ_API priority##bits##_t *priorityq##bits##_peek(priorityq##bits##_t *); \
+PQ_API void priorityq##bits##_remove(priorityq##bits##_t *, priority##bits##_t *)
+
+#define PQ16_CEILING PQ_WIDE_CEILING(16)
+#define PQ16_BINS (16)
+#define PRIORITY16_URGENT ((uint16_t)PQ16_CEILING)
+PQ_WIDE_DECLARE(16);
+
+#define PQ32_CEILING PQ_WIDE_CEILING(32)
+#define PQ32_BINS (32)
+#define PRIORITY32_URGENT ((uint32_t)PQ32_CEILING)
+PQ_WIDE_DECLARE(32);
+
+
+/* Slab Allocator
+ * Hands out priorities from cache line aligned slabs and recycles them
+ * through a free list. Not thread-safe, keep one per thread.
+ */
+typedef struct
+{
+    // Recycled priorities, linked through the node's prev pointer.
+    struct priorityq_node_s *free;
+    // Allocated slabs, each starts with a pointer to the previous slab.
+    void *slabs;
+    uint32_t per_slab;
+    uint32_t used;
+} priorityq_slab_t;
+
+PQ_API void
+priorityq_slab_init(priorityq_slab_t *, uint32_t);
+PQ_API void
+priorityq_slab_destroy(priorityq_slab_t *);
+PQ_API uint32_t
+priorityq_slab_used(priorityq_slab_t *);
+PQ_API priority_t *
+priorityq_slab_alloc(priorityq_slab_t *);
+PQ_API void
+priorityq_slab_free(priorityq_slab_t *, priority_t *);
+
+
+/* Compact Priority Manager
+ * Nodes live in a caller-provided arena and link by 32-bit index.
+ * Items are identified by their index in the arena; there is no data
+ * pointer, keep per-item data in parallel arrays or recover it by index.
+ */
+#define PQ_COMPACT_LISTS (3 + PQ_BINS)
+#define PQ_COMPACT_NONE (UINT32_MAX)
+// The number of nodes an arena must hold for the given number of items.
+#define PQ_COMPACT_ARENA(capacity) ((capacity) + PQ_COMPACT_LISTS)
+
+typedef struct
+{
+    uint32_t prev;
+    uint32_t next;
+    uint8_t info[4]; // Internal data and flags.
+} priority_compact_t;
+
+typedef struct
+{
+    uint8_t pc;
+    uint8_t bin_mask;
+    uint32_t counter_imed;
+    uint32_t size;
+    uint32_t size_done;
+    uint32_t size_imed;
+    uint32_t size_q;
+    uint32_t capacity;
+    // The arena; links are stored as index + 1 so that zero means unlinked.
+    priority_compact_t *base;
+} priorityq_compact_t;
+
+PQ_API void
+priority_compact_set(priority_compact_t *, uint8_t);
+PQ_API uint8_t
+priority_compact_value(priority_compact_t *);
+PQ_API bool
+priority_compact_is_active(priority_compact_t *);
+
+PQ_API void
+priorityq_compact_init(priorityq_compact_t *, priority_compact_t *, uint32_t);
+PQ_API void
+priorityq_compact_destroy(priorityq_compact_t *);
+PQ_API uint32_t
+priorityq_compact_size(priorityq_compact_t *);
+PQ_API priority_compact_t *
+priorityq_compact_node(priorityq_compact_t *, uint32_t);
+
+PQ_API void
+priorityq_compact_enqueue(priorityq_compact_t *, uint32_t);
+PQ_API uint32_t
+priorityq_compact_dequeue(priorityq_compact_t *);
+PQ_API void
+priorityq_compact_remove(priorityq_compact_t *, uint32_t);
+
+
+/* Segmented Priority Manager
+ * Items live in a caller-provided arena and are identified by index, as
+ * with the compact manager, but each list is a chain of chunks holding
+ * indices so that re-binning reads contiguous memory instead of chasing
+ * links through the nodes. Chunks are allocated as lists grow and are
+ * recycled; removing an item leaves a tombstone in its chunk.
+ */
+#define PQ_SEG_CHUNK (64)
+#define PQ_SEG_LISTS (3 + PQ_BINS)
+#define PQ_SEG_NONE (UINT32_MAX)
+
+typedef struct priorityq_seg_chunk_s
+{
+    struct priorityq_seg_chunk_s *next;
+    uint32_t gen; // Generation of the list when the chunk joined it.
+    uint16_t begin;
+    uint16_t end;
+    uint8_t list;
+    // Relative priority of each entry, kept apart for the bin computation.
+    uint8_t rp[PQ_SEG_CHUNK];
+    // Item indices; PQ_SEG_NONE marks a tombstone.
+    uint32_t items[PQ_SEG_CHUNK];
+} priorityq_seg_chunk_t;
+
+typedef struct
+{
+    priorityq_seg_chunk_t *chunk; // NULL when not in the queue.
+    uint8_t slot;
+    uint8_t info[4]; // Internal data and flags.
+} priority_seg_t;
+
+typedef struct
+{
+    priorityq_seg_chunk_t *head;
+    priorityq_seg_chunk_t *tail;
+    uint32_t gen;
+    uint32_t live; // Entries that aren't tombstones.
+} priorityq_seg_list_t;
+
+typedef struct
+{
+    uint8_t pc;
+    uint8_t bin_mask;
+    uint32_t counter_imed;
+    uint32_t size;
+    uint32_t size_q;
+    uint32_t capacity;
+    priority_seg_t *base;
+    priorityq_seg_list_t lists[PQ_SEG_LISTS];
+    priorityq_seg_chunk_t *spare; // Emptied chunks kept for reuse.
+} priorityq_seg_t;
+
+PQ_API void
+priority_seg_set(priority_seg_t *, uint8_t);
+PQ_API uint8_t
+priority_seg_value(priority_seg_t *);
+PQ_API bool
+priority_seg_is_active(priority_seg_t *);
+
+PQ_API void
+priorityq_seg_init(priorityq_seg_t *, priority_seg_t *, uint32_t);
+PQ_API void
+priorityq_seg_destroy(priorityq_seg_t *);
+PQ_API uint32_t
+priorityq_seg_size(priorityq_seg_t *);
+PQ_API priority_seg_t *
+priorityq_seg_node(priorityq_seg_t *, uint32_t);
+
+PQ_API bool
+priorityq_seg_enqueue(priorityq_seg_t *, uint32_t);
+PQ_API uint32_t
+priorityq_seg_dequeue(priorityq_seg_t *);
+PQ_API void
+priorityq_seg_remove(priorityq_seg_t *, uint32_t);
+
+
+/* Concurrent Intake (multiple producers, single consumer) */
+typedef struct
+{
+    // Only the consumer thread may touch the queue directly.
+    priorityq_t q;
+    // Lock-free stack of priorities pushed by producers.
+    struct priorityq_node_s *intake;
+    // Nonzero while the consumer sleeps in priorityq_mpsc_dequeue_wait.
+    uint32_t waiting;
+    // Written when the intake becomes non-empty, once set up; -1 until then.
+    int notify_fd;
+    // Items the queue's capacity turned away or evicted while collecting.
+    struct priorityq_node_s displaced;
+} priorityq_mpsc_t;
+
+PQ_API void
+priorityq_mpsc_init(priorityq_mpsc_t *);
+PQ_API void
+priorityq_mpsc_destroy(priorityq_mpsc_t *);
+PQ_API priorityq_t *
+priorityq_mpsc_queue(priorityq_mpsc_t *);
+
+PQ_API void
+priorityq_mpsc_enqueue(priorityq_mpsc_t *, priority_t *);
+PQ_API void
+priorityq_mpsc_collect(priorityq_mpsc_t *);
+PQ_API void
+priorityq_mpsc_displaced(priorityq_mpsc_t *, struct priorityq_node_s *);
+PQ_API priority_t *
+priorityq_mpsc_dequeue(priorityq_mpsc_t *);
+PQ_API uint32_t
+priorityq_mpsc_dequeue_batch(priorityq_mpsc_t *, priority_t **, uint32_t);
+
+/* Blocking waits (Linux only, in priorityq_wait.c)
+ * PQ_WAIT defaults to 1 on Linux and 0 elsewhere. The header-only build
+ * leaves it 0, since the waits need _GNU_SOURCE before the caller's first
+ * system header; define both there to get them.
+ */
+#ifndef PQ_WAIT
+#   if defined(__linux__) && !defined(PRIORITYQ_HEADER_ONLY)
+#       define PQ_WAIT 1
+#   else
+#       define PQ_WAIT 0
+#   endif
+#endif
+#if PQ_WAIT
+PQ_API priority_t *
+priorityq_mpsc_dequeue_wait(priorityq_mpsc_t *, int64_t);
+PQ_API int
+priorityq_mpsc_notify_fd(priorityq_mpsc_t *);
+#endif
+
+
+/* Sharded Pool (one shard per worker with work stealing) */
+// Shards are cache line aligned, allocate arrays of them accordingly.
+typedef struct PQ_CACHE_ALIGNED
+{
+    priorityq_t q;
+    uint32_t lock;
+} priorityq_shard_t;
+
+typedef struct
+{
+    priorityq_shard_t *shards;
+    uint32_t count;
+} priorityq_pool_t;
+
+PQ_API void
+priorityq_pool_init(priorityq_pool_t *, priorityq_shard_t *, uint32_t);
+PQ_API void
+priorityq_pool_destroy(priorityq_pool_t *);
+PQ_API uint32_t
+priorityq_pool_size(priorityq_pool_t *);
+
+PQ_API priority_t *
+priorityq_pool_enqueue(priorityq_pool_t *, uint32_t, priority_t *);
+PQ_API priority_t *
+priorityq_pool_dequeue(priorityq_pool_t *, uint32_t);
+
+
+/* Hierarchical Scheduler (one queue per tenant with weighted fairness) */
+typedef struct
+{
+    // The tenant's place in the scheduler, active while it has items.
+    priority_t p;
+    priorityq_t q;
+} priorityq_tenant_t;
+
+typedef struct
+{
+    // The tenants themselves are the items of this queue.
+    priorityq_t q;
+} priorityq_sched_t;
+
+PQ_API void
+priorityq_tenant_init(priorityq_tenant_t *, uint8_t);
+PQ_API void
+priorityq_tenant_destroy(priorityq_tenant_t *);
+PQ_API priorityq_t *
+priorityq_tenant_queue(priorityq_tenant_t *);
+
+PQ_API void
+priorityq_sched_init(priorityq_sched_t *);
+PQ_API void
+priorityq_sched_destroy(priorityq_sched_t *);
+PQ_API uint32_t
+priorityq_sched_tenants(priorityq_sched_t *);
+
+PQ_API priority_t *
+priorityq_sched_enqueue(priorityq_sched_t *, priorityq_tenant_t *, priority_t *);
+PQ_API priority_t *
+priorityq_sched_dequeue(priorityq_sched_t *);
+
+
+/* Timed Priority Manager (a hitime-style timer in front of a queue)
+ * Items wait in the timer until their start time and then enter the queue
+ * at their priority, or as urgent if their deadline has passed by then.
+ * Waiting and queued items share the same node, so an item is in one or
+ * the other and is never copied. Times are in any unit of a monotonic
+ * clock the caller picks.
+ */
+#define PQ_TIMER_BINS (64)
+#define PQ_TIMER_NEVER (UINT64_MAX)
+
+typedef struct
+{
+    priority_t p;
+    uint64_t start; // Not before this time.
+    uint64_t deadline; // Urgent if still waiting by this time.
+    uint8_t priority; // Its own, restored on every release.
+} priority_timed_t;
+
+typedef struct
+{
+    priorityq_t q;
+    uint64_t now;
+    uint64_t bin_mask;
+    uint32_t size_waiting;
+    // Bin i holds items whose start first differs from now at bit i.
+    struct priorityq_node_s bins[PQ_TIMER_BINS];
+} priorityq_timer_t;
+
+PQ_API void
+priority_timed_init(priority_timed_t *);
+PQ_API void
+priority_timed_set(priority_timed_t *, void *, uint8_t, uint64_t, uint64_t);
+
+PQ_API void
+priorityq_timer_init(priorityq_timer_t *, uint64_t);
+PQ_API void
+priorityq_timer_destroy(priorityq_timer_t *);
+PQ_API priorityq_t *
+priorityq_timer_queue(priorityq_timer_t *);
+PQ_API uint32_t
+priorityq_timer_waiting(priorityq_timer_t *);
+PQ_API uint64_t
+priorityq_timer_next(priorityq_timer_t *);
+
+PQ_API priority_t *
+priorityq_timer_schedule(priorityq_timer_t *, priority_timed_t *);
+PQ_API uint32_t
+priorityq_timer_advance(priorityq_timer_t *, uint64_t, struct priorityq_node_s *);
+PQ_API priority_timed_t *
+priorityq_timer_dequeue(priorityq_timer_t *);
+PQ_API void
+priorityq_timer_remove(priorityq_timer_t *, priority_timed_t *);
 
 
 /* Exports for testing. */
-uint8_t
+PQ_API uint8_t
 priorityq_priority_counter(priorityq_t *);
-uint32_t
+PQ_API uint8_t
+priorityq_bin_mask(priorityq_t *);
+PQ_API uint32_t
 priorityq_count_bin(priorityq_t *, uint32_t);
-uint32_t
+PQ_API uint32_t
 priorityq_count_all(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_count_immediate(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_count_done(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_count_q(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_size_immediate(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_size_done(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_size_q(priorityq_t *);
-uint32_t
+PQ_API uint32_t
 priorityq_upper_bit(uint8_t n);
 #ifdef DEBUG_OUTPUT_FUNCTIONS
-void
+PQ_API void
 priorityq_dump_stats(priorityq_t *);
-void
+PQ_API void
 priority_dump_stats(priority_t *p);
 #endif
 
@@ -148,6 +727,14 @@ priority_dump_stats(priority_t *p);
 #   endif
 #endif
 
+#ifndef PREFETCH
+#   ifdef __GNUC__
+#       define PREFETCH(addr, rw) __builtin_prefetch((addr), (rw), 3)
+#   else
+#       define PREFETCH(addr, rw) ((void)(addr))
+#   endif
+#endif
+
 #ifndef INLINE
 #   ifdef __GNUC__
 #       define INLINE __attribute__((always_inline)) inline
@@ -168,5 +755,12 @@ priority_dump_stats(priority_t *p);
 #ifdef __cplusplus
 }
 #endif
+
+#ifdef PRIORITYQ_HEADER_ONLY
+#include "priorityq.c"
+#if PQ_WAIT
+#include "priorityq_wait.c"
+#endif
+#endif
 #endif /* PRIORITYQ_H_ */
 
@@ -0,0 +1,255 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file priorityq.hpp
+ * @author Craig Jacobson
+ * @brief Typed intrusive C++ interface over the C queues (C++17).
+ *
+ * The hook is a priority_t, priority16_t or priority32_t member of T and
+ * picks the queue's width, and so its bin count:
+ *
+ *     struct job { priority_t hook{}; int id; };
+ *     sfpq::queue<job, &job::hook> q;
+ *     q.push(j, 3);
+ *     job *next = q.pop();
+ *
+ * Items are recovered from their hook by its offset, so the hook's data
+ * pointer is never used and no cast is needed. There are no virtuals and
+ * nothing is allocated; the rest of the C interface is reachable through
+ * native().
+ */
+#ifndef PRIORITYQ_HPP_
+#define PRIORITYQ_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "priorityq.h"
+
+
+namespace sfpq
+{
+
+/* Widths
+ * One specialization per queue the C core provides.
+ */
+template <typename Hook>
+struct width;
+
+template <>
+struct width<priority_t>
+{
+    typedef uint8_t value_type;
+    typedef priorityq_t queue_type;
+    static constexpr unsigned bins = PQ_BINS;
+    static constexpr uint32_t ceiling = PQ_CEILING;
+    static constexpr value_type urgent = PRIORITY_URGENT;
+
+    static void set(priority_t *h, value_type v) { priority_set(h, nullptr, v); }
+    static value_type value(priority_t *h) { return priority_value(h); }
+    static bool is_active(priority_t *h) { return priority_is_active(h); }
+    static void init(queue_type *q) { priorityq_init(q); }
+    static void destroy(queue_type *q) { priorityq_destroy(q); }
+    static uint32_t size(queue_type *q) { return priorityq_size(q); }
+    static priority_t *enqueue(queue_type *q, priority_t *h) { return priorityq_enqueue(q, h); }
+    static priority_t *dequeue(queue_type *q) { return priorityq_dequeue(q); }
+    static priority_t *peek(queue_type *q) { return priorityq_peek(q); }
+    static void remove(queue_type *q, priority_t *h) { priorityq_remove(q, h); }
+};
+
+#define PQ_WIDTH_SPECIALIZE(bits) \
+template <> \
+struct width<priority##bits##_t> \
+{ \
+    typedef uint##bits##_t value_type; \
+    typedef priorityq##bits##_t queue_type; \
+    static constexpr unsigned bins = PQ##bits##_BINS; \
+    static constexpr uint32_t ceiling = PQ##bits##_CEILING; \
+    static constexpr value_type urgent = PRIORITY##bits##_URGENT; \
+\
+    static void set(priority##bits##_t *h, value_type v) { priority##bits##_set(h, nullptr, v); } \
+    static value_type value(priority##bits##_t *h) { return priority##bits##_value(h); } \
+    static bool is_active(priority##bits##_t *h) { return priority##bits##_is_active(h); } \
+    static void init(queue_type *q) { priorityq##bits##_init(q); } \
+    static void destroy(queue_type *q) { priorityq##bits##_destroy(q); } \
+    static uint32_t size(queue_type *q) { return priorityq##bits##_size(q); } \
+    /* Wide queues have no capacity, so nothing is displaced. */ \
+    static priority##bits##_t *enqueue(queue_type *q, priority##bits##_t *h) \
+    { \
+        priorityq##bits##_enqueue(q, h); \
+        return nullptr; \
+    } \
+    static priority##bits##_t *dequeue(queue_type *q) { return priorityq##bits##_dequeue(q); } \
+    static priority##bits##_t *peek(queue_type *q) { return priorityq##bits##_peek(q); } \
+    static void remove(queue_type *q, priority##bits##_t *h) { priorityq##bits##_remove(q, h); } \
+}
+
+PQ_WIDTH_SPECIALIZE(16);
+PQ_WIDTH_SPECIALIZE(32);
+
+#undef PQ_WIDTH_SPECIALIZE
+
+template <typename M>
+struct member;
+
+template <typename T, typename Hook>
+struct member<Hook T::*>
+{
+    typedef T owner_type;
+    typedef Hook hook_type;
+};
+
+
+/* Queue
+ * Hooks MUST be value-initialized, or set up with their init function,
+ * before first use; the same referential stability rules as the C
+ * interface apply to the items.
+ */
+template <typename T, auto Hook>
+class queue
+{
+public:
+    typedef typename member<decltype(Hook)>::hook_type hook_type;
+    typedef width<hook_type> width_type;
+    typedef typename width_type::value_type value_type;
+    typedef typename width_type::queue_type queue_type;
+
+    static_assert(std::is_same<typename member<decltype(Hook)>::owner_type, T>::value,
+                  "The hook must be a member of T.");
+
+    static constexpr unsigned bins = width_type::bins;
+    static constexpr uint32_t ceiling = width_type::ceiling;
+    static constexpr value_type urgent = width_type::urgent;
+
+    queue() { width_type::init(&q_); }
+    ~queue() { width_type::destroy(&q_); }
+
+    // The lists point back at the queue, so it stays put.
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    /**
+     * @brief Add the item with the given priority, or reprioritize it.
+     * @param priority - Below ceiling, or urgent.
+     * @return The item turned away or evicted by a capacity set through
+     *         native(), see priorityq_enqueue; nullptr if none.
+     */
+    T *
+    push(T &item, value_type priority)
+    {
+        hook_type *h = &(item.*Hook);
+        width_type::set(h, priority);
+        return to_owner(width_type::enqueue(&q_, h));
+    }
+
+    /**
+     * @return The next expired item; nullptr if none.
+     */
+    T *
+    pop()
+    {
+        return to_owner(width_type::dequeue(&q_));
+    }
+
+    /**
+     * @return The item pop would return next; nullptr if none.
+     */
+    T *
+    peek()
+    {
+        return to_owner(width_type::peek(&q_));
+    }
+
+    void
+    erase(T &item)
+    {
+        width_type::remove(&q_, &(item.*Hook));
+    }
+
+    uint32_t
+    size()
+    {
+        return width_type::size(&q_);
+    }
+
+    bool
+    empty()
+    {
+        return 0 == width_type::size(&q_);
+    }
+
+    static bool
+    contains(T &item)
+    {
+        return width_type::is_active(&(item.*Hook));
+    }
+
+    static value_type
+    priority(T &item)
+    {
+        return width_type::value(&(item.*Hook));
+    }
+
+    /**
+     * @return The underlying C queue for the rest of the interface.
+     */
+    queue_type *
+    native()
+    {
+        return &q_;
+    }
+
+private:
+    /**
+     * @return The offset of the hook in T, taken on real storage.
+     *
+     * The storage is never constructed or read, only addressed, so T
+     * needn't be default constructible. It folds to a constant.
+     */
+    static std::size_t
+    hook_offset()
+    {
+        alignas(T) static unsigned char storage[sizeof(T)];
+        T *owner = reinterpret_cast<T *>(storage);
+        return static_cast<std::size_t>(reinterpret_cast<unsigned char *>(&(owner->*Hook)) - storage);
+    }
+
+    static T *
+    to_owner(hook_type *h)
+    {
+        if (!h)
+        {
+            return nullptr;
+        }
+        // Container-of for a pointer to member.
+        return reinterpret_cast<T *>(reinterpret_cast<char *>(h) - hook_offset());
+    }
+
+    queue_type q_;
+};
+
+} // namespace sfpq
+
+
+#endif /* PRIORITYQ_HPP_ */
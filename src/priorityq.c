@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 /*******************************************************************************
@@ -48,6 +49,36 @@ get_high_index32(uint32_t n)
     return 31 - __builtin_clz(n);
 }
 
+/**
+ * @warn Do NOT input zero.
+ * @return The index of the lowest set bit.
+ */
+INLINE static int
+get_low_index32(uint32_t n)
+{
+    return __builtin_ctz(n);
+}
+
+/**
+ * @warn Do NOT input zero.
+ * @return The index of the highest set bit.
+ */
+INLINE static int
+get_high_index64(uint64_t n)
+{
+    return 63 - __builtin_clzll(n);
+}
+
+/**
+ * @warn Do NOT input zero.
+ * @return The index of the lowest set bit.
+ */
+INLINE static int
+get_low_index64(uint64_t n)
+{
+    return __builtin_ctzll(n);
+}
+
 
 /*******************************************************************************
  * Pointer Conversion Functions
@@ -179,6 +210,29 @@ list_append(struct priorityq_node_s *l1, struct priorityq_node_s *l2)
     }
 }
 
+/**
+ * @brief Move the first k items of l2 to the end of l1.
+ * @warn l2 MUST hold at least k items and k MUST NOT be zero.
+ */
+INLINE static void
+list_move_front(struct priorityq_node_s *l1, struct priorityq_node_s *l2, uint32_t k)
+{
+    struct priorityq_node_s *first = l2->next;
+    struct priorityq_node_s *last = first;
+    while (--k)
+    {
+        last = last->next;
+    }
+
+    l2->next = last->next;
+    last->next->prev = l2;
+
+    first->prev = l1->prev;
+    l1->prev->next = first;
+    last->next = l1;
+    l1->prev = last;
+}
+
 INLINE static int
 list_count(struct priorityq_node_s *l)
 {
@@ -209,66 +263,161 @@ list_count(struct priorityq_node_s *l)
 #define PRIORITY_LOC (2)
 // The urgent field.
 #define PRIORITY_URG (3)
+// The bin an item was placed in and that bin's phase.
+#define PRIORITY_BIN (4)
+// Set by priority_cancel, possibly from another thread.
+#define PRIORITY_CANCEL (5)
 
-void
+PQ_API void
 priority_init(priority_t *p)
 {
     (*p) = (const priority_t){ 0 };
 }
 
-void
+PQ_API void
 priority_destroy(priority_t *p)
 {
     (*p) = (const priority_t){ 0 };
 }
 
-void
-priority_set(priority_t *p, void *data, uint8_t priority)
+INLINE static void
+info_set(uint8_t *info, uint8_t priority)
 {
-    p->data = data;
     if (LIKELY(PRIORITY_URGENT != priority))
     {
-        p->info[PRIORITY_ABS] = priority;
-        p->info[PRIORITY_URG] = 0;
+        info[PRIORITY_ABS] = priority;
+        info[PRIORITY_URG] = 0;
     }
     else
     {
-        p->info[PRIORITY_ABS] = 0;
-        p->info[PRIORITY_URG] = 1;
+        info[PRIORITY_ABS] = 0;
+        info[PRIORITY_URG] = 1;
     }
 }
 
-uint8_t
+PQ_API void
+priority_set(priority_t *p, void *data, uint8_t priority)
+{
+    p->data = data;
+    info_set(p->info, priority);
+}
+
+PQ_API uint8_t
 priority_value(priority_t *p)
 {
     return p->info[PRIORITY_ABS];
 }
 
-void *
+PQ_API void *
 priority_data(priority_t *p)
 {
     return p->data;
 }
 
-bool
+PQ_API bool
 priority_is_active(priority_t *p)
 {
     return node_in_list(to_node(p));
 }
 
+/**
+ * @brief Mark the priority cancelled in constant time, from any thread.
+ *
+ * The queue's owner skips the item when organizing or dequeuing meets it
+ * and parks it for priorityq_reclaim; until then it still counts toward
+ * the size and its memory must stay valid.
+ * A cancel racing a dequeue of the same item may lose; the item then comes
+ * out anyway and priority_is_cancelled tells the consumer.
+ * Reprioritizing keeps the mark; only adding the item afresh, once it is
+ * out of the queue or buried, clears it.
+ */
+PQ_API void
+priority_cancel(priority_t *p)
+{
+    __atomic_store_n(&p->info[PRIORITY_CANCEL], 1, __ATOMIC_RELEASE);
+}
+
+PQ_API bool
+priority_is_cancelled(priority_t *p)
+{
+    return __atomic_load_n(&p->info[PRIORITY_CANCEL], __ATOMIC_ACQUIRE);
+}
+
 
 /*******************************************************************************
  * Priority Queue Functions (Internal)
 *******************************************************************************/
 
+// Re-binning prefetches ahead once this many items are in the queue.
+// Smaller queues stay in cache and don't benefit.
+#ifndef PQ_PREFETCH_MIN
+#define PQ_PREFETCH_MIN (1 << 14)
+#endif
+
+#ifdef PQ_STATS
+#define PQ_STAT(x) do { x; } while (0)
+#else
+#define PQ_STAT(x) ((void)0)
+#endif
+
 enum PRIORITY_LOC_ENUM
 {
     PRIORITY_LOC_NONE = 0,
     PRIORITY_LOC_DONE = 1,
     PRIORITY_LOC_IMED = 2,
     PRIORITY_LOC_Q    = 3,
+    PRIORITY_LOC_CANCELLED = 4,
+    PRIORITY_LOC_TIMER = 5, // Waiting in a priorityq_timer_t.
 };
 
+/**
+ * @brief Only the queue's owner reads the mark, so no ordering is needed.
+ */
+INLINE static bool
+priorityq_cancelled(priority_t *p)
+{
+    return UNLIKELY(__atomic_load_n(&p->info[PRIORITY_CANCEL], __ATOMIC_RELAXED));
+}
+
+/**
+ * The node MUST already be unlinked and uncounted!!!
+ * @brief Park a cancelled node until it is reclaimed.
+ */
+INLINE static void
+priorityq_bury(priorityq_t *q, struct priorityq_node_s *n)
+{
+    to_priority(n)->info[PRIORITY_LOC] = PRIORITY_LOC_CANCELLED;
+    list_nq(&q->cancelled, n);
+}
+
+/**
+ * @brief Take a buried node off the cancelled list, so it can be added
+ *        again as a new item; it was already uncounted when buried.
+ */
+INLINE static void
+priorityq_unbury(priority_t *p)
+{
+    if (UNLIKELY(PRIORITY_LOC_CANCELLED == p->info[PRIORITY_LOC]))
+    {
+        node_unlink(to_node(p));
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+    }
+}
+
+/**
+ * @brief Prepare a priority the caller is adding: a buried one is taken
+ *        back, and one not in the queue starts afresh without its cancel.
+ */
+INLINE static void
+priorityq_fresh(priority_t *p)
+{
+    priorityq_unbury(p);
+    if (!node_in_list(to_node(p)))
+    {
+        __atomic_store_n(&p->info[PRIORITY_CANCEL], 0, __ATOMIC_RELAXED);
+    }
+}
+
 /**
  * The priority MUST be in a queue in this data structure!!!
  */
@@ -290,175 +439,223 @@ priorityq_decrement_queue(priorityq_t *q, priority_t *p)
     }
 }
 
+// The counter and bin arithmetic, priorityq_bin_index and
+// priorityq_counter_step, shared with every other queue.
+#define PQB_BITS 8
+#define PQB_FN(name) priorityq_##name
+#include "priorityq_bits.h"
+
+/**
+ * @brief Count a priority placed in a bin.
+ *
+ * The bin's phase is stamped on the priority. A bin moves to processing as
+ * a whole and processing is drained before the next move, so a priority
+ * whose stamp no longer matches its bin's phase is in processing.
+ */
 INLINE static void
-priorityq_nq_only(priorityq_t *q, priority_t *p)
+priorityq_bin_enter(priorityq_t *q, priority_t *p, int index)
 {
-    // This block adds overflow detection to better distribute priorities.
-    // Without this the priorities crossing the overflow boundary all
-    // get placed in the last bucket.
-    // While that behavior doesn't hurst overall complexity, it can cause
-    // a bit of a pause when advancing the queue and the urgent and immediate
-    // queues are empty.
-    // WARNING: This only really works in conjunction with the changes
-    // in priorityq_advance_priority_counter!!!
-    //
-    // pc = priority counter
-    uint8_t pc = q->pc;
-    // rp = relative priority of p
-    uint8_t rp = p->info[PRIORITY_REL];
-    // nrp = rp less one
-    uint8_t nrp = rp - 1;
-    // The condition is that the upper bit of pc is a '1' and rp is a '0'.
-    // Also, rp CANNOT be zero.
-    // This doesn't work because rp can be zero: !((~PQ_MASK) & (pc & ~rp))
-    int index;
-    if (nrp >= pc)
-    {
-        // Not an overflow situation.
-        // Original code (fall back to just this if this doesn't work).
-        //
-        // HOW THIS WORKS:
-        // Since a priority is greater than the priority counter
-        // we have a know fact that must be true:
-        // the priority's leading differing bit is a '1', and the counter's
-        // in the same position is a '0'.
-        // When the counter flips that bit, we do so precisely.
-        // This means that eventually that bit is the same:
-        // pc = nnnn 1zzz
-        // rp = nnnn 1mmm
-        // So the n's are identical and the bits to the right in the counter
-        // are guaranteed to be zero.
-        // This means that we can just count the '1' bits to the right of
-        // a differing bit of the relative priority to know how many different
-        // bins it will be sorted into over the course of it's life.
-        // If z = m, then we're to be prioritized and sent out of the queue.
-        // If z != m, then the next bin is the next differing bit.
-        // Because of the progression of the counter, we know that it is
-        // less than or equal to any active priority.
-        // This is how we progress priorities up through the queues.
-        index = get_high_index32(rp ^ pc);
+    p->info[PRIORITY_BIN] = (uint8_t)(index | (((q->bin_phase >> index) & 1) << 7));
+    ++q->size_bins[index];
+}
+
+/**
+ * @brief Uncount a priority leaving a bin or processing.
+ */
+INLINE static void
+priorityq_bin_leave(priorityq_t *q, priority_t *p)
+{
+    int index = p->info[PRIORITY_BIN] & (PQ_BINS - 1);
+    if ((p->info[PRIORITY_BIN] >> 7) == ((q->bin_phase >> index) & 1))
+    {
+        --q->size_bins[index];
     }
     else
     {
-        // We are wrapping around! This is the overflow situation.
-        //
-        // HOW THIS WORKS:
-        // Preconditions: pc > rp, rp != 0
-        // pc = 1nnn zmmm
-        // rp = 0xxx yyyy
-        // Let z be the FIRST zero somewhere after the leading '1' (or no zeros).
-        // n are the bits to the left of z.
-        // m are bits we don't care about.
-        // y are bits we don't care about to be masked out by zmmm.
-        // By repeated ANDing and bit shifting we turn everything to zeros
-        // after the FIRST zero z.
-        // This gives ones left of z and zeros to the right:
-        // pc = 1111 z000
-        // The bin to place p into is then the highest bit in the x's in rp
-        // that overlaps the ones in pc.
-        // This ONLY WORKS because we don't trigger bins corresponding to bits
-        // flipping from '1' to '0', just bits flipping from '0' to '1'.
-        // With the exception of the leading bit so we can take advantage of
-        // overflow to keep this queue going indefinitely.
-        //
-        // apc = AND'ed priority counter
-        uint8_t apc = pc & (pc >> 1);
-        apc &= apc >> 2;
-        apc &= apc >> 4;
-        index = get_high_index32(rp & pc);
+        --q->size_proc;
     }
-    list_nq(q->bins + index, to_node(p));
 }
 
+/**
+ * @brief Account for a bin moving to processing.
+ */
 INLINE static void
-priorityq_advance_priority_counter(priorityq_t *q)
+priorityq_bin_trigger(priorityq_t *q, int index)
 {
-    uint8_t pc = q->pc;
+    q->size_proc += q->size_bins[index];
+    q->size_bins[index] = 0;
+    q->bin_phase ^= (uint8_t)(1 << index);
+}
 
-    int index = 0;
-    uint8_t msb = 1;
-    while ((index < (PQ_BINS - 1)) && !(list_has((q->bins) + index) && (~pc & msb)))
+#ifdef PQ_STATS
+INLINE static void
+priorityq_stats_rebin(priorityq_t *q, uint32_t moved)
+{
+    q->stats.rebinned += moved;
+    if (moved > q->stats.rebinned_max)
     {
-        ++index;
-        msb <<= 1;
+        q->stats.rebinned_max = moved;
     }
+}
 
-    uint8_t newpc = (pc | (msb - 1)) + 1;
-
-    // No matter how we advance, this bin is getting triggered.
-    // DO NOT move directly to the immediate queue.
-    list_append(&q->processing, q->bins + index);
-    ++index;
-
-    // WARNING: The following line of code are the changes referenced in
-    // priorityq_nq!!!!
-    // Since relative priorities are always greater than the priority counter,
-    // the leading bit of ANY relative priority is set to 1 and the counter to 0.
-    // The EXCEPTION is when we have wrap around, the leading bit can be a 1
-    // in the counter and a zero in anything else.
-    // Given eight bits: zxxx xxxx, we can ignore 1 -> 0 transitions in x's
-    // as the counter's progression will NEVER trigger a bin; the z bit is the
-    // exception.
-    // Previous code (also works, just trying to reduce pointer checks):
-    // uint8_t bits = (newpc ^ q->pc) >> 1;
-    //
-    // index tells us the first bin to check, so we should start there.
-    //index = 1;
-    uint8_t bits = ((~PQ_MASK & (pc ^ newpc)) | (PQ_MASK & (~pc & newpc)));
-    bits >>= index;
-    while (bits)
-    {
-        if (1 & bits)
-        {
-            list_append(&q->processing, q->bins + index);
-        }
-        ++index;
-        bits >>= 1;
+INLINE static void
+priorityq_stats_dequeue(priorityq_t *q, uint32_t steps)
+{
+    int bucket = get_high_index32(steps);
+    if (bucket >= PQ_STATS_HISTOGRAM)
+    {
+        bucket = PQ_STATS_HISTOGRAM - 1;
+    }
+    ++q->stats.dequeue_steps[bucket];
+    if (steps > q->stats.dequeue_steps_max)
+    {
+        q->stats.dequeue_steps_max = steps;
     }
+}
+#endif
 
-    q->pc = newpc;
+INLINE static void
+priorityq_nq_only(priorityq_t *q, priority_t *p)
+{
+    int index = priorityq_bin_index(q->pc, p->info[PRIORITY_REL]);
+    list_nq(q->bins + index, to_node(p));
+    q->bin_mask |= (uint8_t)(1 << index);
+    priorityq_bin_enter(q, p, index);
 }
 
+/**
+ * @brief Unlink a priority in the processing queue or a bin.
+ *        Clears the bin's bit in the mask if the bin is left empty.
+ */
 INLINE static void
-priorityq_advance_immediates(priorityq_t *q)
+priorityq_unlink_q(priorityq_t *q, struct priorityq_node_s *n)
 {
-    if (q->size_imed)
+    node_unlink_only(n);
+    priorityq_bin_leave(q, to_priority(n));
+
+    // The list is empty when the neighbors are the same node, its head.
+    struct priorityq_node_s *l = n->prev;
+    if (l == n->next)
     {
-        if (q->counter_imed)
+        uintptr_t offset = (uintptr_t)l - (uintptr_t)q->bins;
+        if (offset < sizeof(q->bins))
         {
-            list_nq(&q->done, list_dq_quick(&q->immediate));
-            --q->size_imed;
-            ++q->size_done;
-            if (q->size_done < q->size_imed)
-            {
-                switch (q->size_imed & 1)
-                {
-                    case 0:
-                        // Sometimes we add a second item.
-                        // But make up for it by dividing by 2.
-                        list_nq(&q->done, list_dq_quick(&q->immediate));
-                        --q->size_imed;
-                        ++q->size_done;
-                        q->counter_imed >>= 1;
-                        break;
-                    case 1:
-                        // Sometimes we just add one item.
-                        --q->counter_imed;
-                        break;
-                }
-            }
-            else
-            {
-                // Sometimes we significantly reduce the counter.
-                q->counter_imed >>= 2;
-            }
+            q->bin_mask &= (uint8_t)~(1 << (offset / sizeof(*l)));
+        }
+    }
+}
+
+
+/**
+ * @param counter_imed - The immediate counter, updated in place.
+ * @return The number of immediates to move to the done queue.
+ */
+INLINE static uint32_t
+priorityq_immediate_step(uint32_t *counter_imed, uint32_t size_imed, uint32_t size_done, uint32_t promotion)
+{
+    if (!size_imed)
+    {
+        return 0;
+    }
+
+    if (!*counter_imed)
+    {
+        // Sometimes we do no work in moving immediates to done.
+        *counter_imed = ((get_high_index32(size_imed) + 1) * promotion + 3) >> 2;
+        return 0;
+    }
+
+    // Decide on a second item as if the first was already moved.
+    --size_imed;
+    ++size_done;
+    if (size_done < size_imed)
+    {
+        if (size_imed & 1)
+        {
+            // Sometimes we just add one item.
+            --*counter_imed;
+            return 1;
         }
         else
         {
-            // Sometimes we do no work in moving immediates to done.
-            q->counter_imed = get_high_index32(q->size_imed) + 1;
+            // Sometimes we add a second item.
+            // But make up for it by dividing by 2.
+            *counter_imed >>= 1;
+            return 2;
         }
     }
+    else
+    {
+        // Sometimes we significantly reduce the counter.
+        *counter_imed >>= 2;
+        return 1;
+    }
+}
+
+INLINE static void
+priorityq_advance_priority_counter(priorityq_t *q)
+{
+    uint8_t mask = q->bin_mask;
+    uint8_t newpc;
+    uint8_t bits = priorityq_counter_step(q->pc, mask, &newpc);
+
+    // Only non-empty bins need visiting, lowest first to keep order.
+    // DO NOT move directly to the immediate queue.
+    uint8_t triggered = bits & mask;
+    while (triggered)
+    {
+        int index = get_low_index32(triggered);
+        list_append(&q->processing, q->bins + index);
+        priorityq_bin_trigger(q, index);
+        triggered &= triggered - 1;
+    }
+    PQ_STAT(++q->stats.counter_advances);
+
+    q->bin_mask = mask & ~bits;
+    q->pc = newpc;
+}
+
+/**
+ * The immediate queue MUST NOT be empty!!!
+ */
+INLINE static void
+priorityq_promote_immediate(priorityq_t *q)
+{
+    struct priorityq_node_s *n = list_dq_quick(&q->immediate);
+    to_priority(n)->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+    list_nq(&q->done, n);
+    --q->size_imed;
+    ++q->size_done;
+}
+
+INLINE static void
+priorityq_advance_immediates(priorityq_t *q)
+{
+    uint32_t count = priorityq_immediate_step(&q->counter_imed, q->size_imed, q->size_done, q->promotion);
+    while (count--)
+    {
+        priorityq_promote_immediate(q);
+    }
+}
+
+/**
+ * The processing queue MUST NOT be empty!!!
+ * @brief Start loading what re-binning the head of processing will touch.
+ *
+ * The head itself is warm from unlinking its predecessor.
+ * Its successor and the tail of its destination bin are likely cold.
+ */
+INLINE static void
+priorityq_prefetch_processing(priorityq_t *q)
+{
+    struct priorityq_node_s *n = q->processing.next;
+    PREFETCH(n->next, 0);
+
+    uint8_t rp = to_priority(n)->info[PRIORITY_REL];
+    if (LIKELY(rp != q->pc))
+    {
+        PREFETCH(q->bins[priorityq_bin_index(q->pc, rp)].prev, 1);
+    }
 }
 
 INLINE static void
@@ -469,11 +666,26 @@ priorityq_advance_priority_queue(priorityq_t *q)
         if (list_has(&q->processing))
         {
             // Advance priority queue.
-            uint32_t limit_q = get_high_index32(q->size_q) + 1;
+            uint32_t limit_q = ((get_high_index32(q->size_q) + 1) * q->aging + 3) >> 2;
+#ifdef PQ_STATS
+            uint32_t limit = limit_q;
+#endif
+            bool prefetch = q->size_q >= PQ_PREFETCH_MIN;
             do
             {
                 priority_t *p = to_priority(list_dq_quick(&q->processing));
-                if (LIKELY(p->info[PRIORITY_REL] != q->pc))
+                --q->size_proc;
+                if (prefetch && list_has(&q->processing))
+                {
+                    priorityq_prefetch_processing(q);
+                }
+                if (priorityq_cancelled(p))
+                {
+                    --q->size_q;
+                    --q->size;
+                    priorityq_bury(q, to_node(p));
+                }
+                else if (LIKELY(p->info[PRIORITY_REL] != q->pc))
                 {
                     priorityq_nq_only(q, p);
                 }
@@ -485,6 +697,7 @@ priorityq_advance_priority_queue(priorityq_t *q)
                     list_nq(&q->immediate, to_node(p));
                 }
             } while (--limit_q && list_has(&q->processing));
+            PQ_STAT(priorityq_stats_rebin(q, limit - limit_q));
         }
         else
         {
@@ -495,53 +708,263 @@ priorityq_advance_priority_queue(priorityq_t *q)
 }
 
 
-/*******************************************************************************
- * Priority Queue Functions
-*******************************************************************************/
-
-void
-priorityq_init(priorityq_t *q)
+/**
+ * @brief A single step of organizing the queue, done once per dequeue.
+ */
+INLINE static void
+priorityq_advance_step(priorityq_t *q)
 {
-    (*q) = (const priorityq_t){ 0 };
-    list_clear(&q->done);
-    list_clear(&q->immediate);
-    list_clear(&q->processing);
-    lists_clear(q->bins, PQ_BINS);
+    priorityq_advance_immediates(q);
+    priorityq_advance_priority_queue(q);
 }
 
-void
-priorityq_destroy(priorityq_t *q)
+/**
+ * The done queue MUST be empty and the queue MUST NOT be!!!
+ * @brief Move the item closest to expiring into the done queue.
+ *
+ * Used when the step limit runs out.
+ * That is the head of immediate, else of processing, else of the lowest bin.
+ */
+INLINE static void
+priorityq_fallback(priorityq_t *q)
 {
-    (*q) = (const priorityq_t){ 0 };
+    if (q->size_imed)
+    {
+        priorityq_promote_immediate(q);
+        return;
+    }
+
+    struct priorityq_node_s *n;
+    if (list_has(&q->processing))
+    {
+        n = q->processing.next;
+    }
+    else
+    {
+        n = q->bins[get_low_index32(q->bin_mask)].next;
+    }
+    priorityq_unlink_q(q, n);
+    to_priority(n)->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+    list_nq(&q->done, n);
+    --q->size_q;
+    ++q->size_done;
 }
 
 /**
- * @return The number of priorities in the data structure.
+ * @brief Remove the item farthest from expiring, done items excepted.
+ * @return The removed priority; NULL if only done items remain.
+ *
+ * That is the tail of the highest non-empty bin, else of processing, else
+ * of immediate. Within a bin items are in arrival order, so the choice is
+ * only as precise as the bin.
  */
-uint32_t
-priorityq_size(priorityq_t *q)
+INLINE static priority_t *
+priorityq_evict_one(priorityq_t *q)
 {
-    return q->size;
+    struct priorityq_node_s *n;
+    if (q->bin_mask)
+    {
+        n = q->bins[get_high_index32(q->bin_mask)].prev;
+        priorityq_unlink_q(q, n);
+        --q->size_q;
+    }
+    else if (list_has(&q->processing))
+    {
+        n = q->processing.prev;
+        priorityq_unlink_q(q, n);
+        --q->size_q;
+    }
+    else if (q->size_imed)
+    {
+        n = q->immediate.prev;
+        node_unlink_only(n);
+        --q->size_imed;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    node_clear(n);
+    --q->size;
+    priority_t *p = to_priority(n);
+    p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+    return p;
 }
 
 /**
- * @brief Add the priority to the manager.
- *        Respects reprioritization upwards, but NOT downwards.
- * @warn Remember to maintain referential stability! 'priority_t' is a node internally!
- *       If you're using stack values, they cannot go out of scope.
- *       Move values to the heap prior to calling, not after.
- * @param p - The priority to add.
+ * @brief Organize until an item is ready, within the step limit.
+ * @param taken - The steps the caller has already taken.
+ * @return The number of steps taken, the caller's included.
  *
- * If the priority appears to be a part of a list already, reprioritize.
- * If the priority is urgent, add to final queue.
- * If the priority is zero, add to immediate queue.
- * Otherwise, add priority to the internal data structure for future processing.
+ * Cancelled items are buried on the way, at the head of the done queue or
+ * while organizing, which may leave the queue empty.
  */
-void
-priorityq_enqueue(priorityq_t *q, priority_t *p)
+INLINE static uint32_t
+priorityq_ready(priorityq_t *q, uint32_t taken)
 {
-    if (UNLIKELY(p->info[PRIORITY_LOC] == PRIORITY_LOC_DONE)) { return; }
-
+    uint32_t limit = q->step_limit;
+    for (;;)
+    {
+        while (!q->size_done)
+        {
+            if (UNLIKELY(!q->size))
+            {
+                return taken;
+            }
+            if (UNLIKELY(limit && taken >= limit))
+            {
+                // Any further item falls back at once.
+                priorityq_fallback(q);
+                break;
+            }
+            priorityq_advance_step(q);
+            ++taken;
+        }
+
+        struct priorityq_node_s *n = q->done.next;
+        if (!priorityq_cancelled(to_priority(n)))
+        {
+            break;
+        }
+        node_unlink_only(n);
+        --q->size_done;
+        --q->size;
+        priorityq_bury(q, n);
+        if (!q->size)
+        {
+            break;
+        }
+    }
+    return taken;
+}
+
+
+/*******************************************************************************
+ * Priority Queue Functions
+*******************************************************************************/
+
+PQ_API void
+priorityq_init(priorityq_t *q)
+{
+    (*q) = (const priorityq_t){ 0 };
+    list_clear(&q->done);
+    list_clear(&q->immediate);
+    list_clear(&q->processing);
+    lists_clear(q->bins, PQ_BINS);
+    list_clear(&q->cancelled);
+    q->aging = PQ_RATE_DEFAULT;
+    q->promotion = PQ_RATE_DEFAULT;
+}
+
+/**
+ * @brief Initialize a queue whose dequeues do bounded work.
+ * @param steps - The maximum organizing steps per call; zero for no limit.
+ *
+ * A dequeue or peek that runs out of steps takes the item closest to
+ * expiring instead, so it may come out a little ahead of its turn.
+ * Each step moves at most log2(size) + 1 items, scaled by the aging rate.
+ */
+PQ_API void
+priorityq_init_bounded(priorityq_t *q, uint32_t steps)
+{
+    priorityq_init(q);
+    q->step_limit = steps;
+}
+
+/**
+ * @brief Limit the number of items in the queue.
+ * @param capacity - The maximum number of items; zero for no limit.
+ * @param overflow - One of PQ_OVERFLOW_ENUM.
+ *
+ * Only new items count against the limit; reprioritizing never overflows.
+ * Urgent and expired items are never evicted, so enough of them can take
+ * the queue over capacity. Merges ignore the limit.
+ */
+PQ_API void
+priorityq_set_capacity(priorityq_t *q, uint32_t capacity, int overflow)
+{
+    q->capacity = capacity;
+    q->overflow = (uint8_t)overflow;
+}
+
+/**
+ * @brief Set how fast waiting items age and immediates are promoted.
+ * @param aging - Re-binning per dequeue in quarters of the default;
+ *                zero picks PQ_RATE_DEFAULT.
+ * @param promotion - Immediates moved to done before a pause, in quarters
+ *                    of the default; zero picks PQ_RATE_DEFAULT.
+ *
+ * Any rate stays starvation-free, every step still makes progress; lower
+ * aging lets high priorities get further ahead, higher aging brings
+ * waiting items up sooner at the cost of more work per dequeue.
+ * May be changed at any time.
+ */
+PQ_API void
+priorityq_set_rates(priorityq_t *q, uint8_t aging, uint8_t promotion)
+{
+    q->aging = aging ? aging : PQ_RATE_DEFAULT;
+    q->promotion = promotion ? promotion : PQ_RATE_DEFAULT;
+}
+
+/**
+ * @param preset - One of PQ_AGING_ENUM.
+ */
+PQ_API void
+priorityq_set_aging(priorityq_t *q, int preset)
+{
+    if (PQ_AGING_THROUGHPUT == preset)
+    {
+        priorityq_set_rates(q, PQ_RATE_DEFAULT / 2, PQ_RATE_DEFAULT * 2);
+    }
+    else if (PQ_AGING_FAIRNESS == preset)
+    {
+        priorityq_set_rates(q, PQ_RATE_DEFAULT * 2, PQ_RATE_DEFAULT / 2);
+    }
+    else
+    {
+        priorityq_set_rates(q, PQ_RATE_DEFAULT, PQ_RATE_DEFAULT);
+    }
+}
+
+PQ_API void
+priorityq_destroy(priorityq_t *q)
+{
+    (*q) = (const priorityq_t){ 0 };
+}
+
+/**
+ * @return The number of priorities in the data structure.
+ */
+PQ_API uint32_t
+priorityq_size(priorityq_t *q)
+{
+    return q->size;
+}
+
+/**
+ * @brief Add the priority to the manager, ignoring any capacity.
+ *        Respects reprioritization upwards, but NOT downwards.
+ * @warn Remember to maintain referential stability! 'priority_t' is a node internally!
+ *       If you're using stack values, they cannot go out of scope.
+ *       Move values to the heap prior to calling, not after.
+ * @param p - The priority to add.
+ *
+ * If the priority appears to be a part of a list already, reprioritize.
+ * If the priority is urgent, add to final queue.
+ * If the priority is zero, add to immediate queue.
+ * Otherwise, add priority to the internal data structure for future processing.
+ */
+INLINE static void
+priorityq_insert(priorityq_t *q, priority_t *p)
+{
+    if (UNLIKELY(p->info[PRIORITY_LOC] == PRIORITY_LOC_DONE))
+    {
+        PQ_STAT(++q->stats.reprioritize_ignored);
+        return;
+    }
+    priorityq_unbury(p);
+
     // Checking in queue should be logical equiv to LOC != NONE.
     if (UNLIKELY(node_in_list(to_node(p))))
     {
@@ -550,19 +973,21 @@ priorityq_enqueue(priorityq_t *q, priority_t *p)
         if (p->info[PRIORITY_URG])
         {
             // If the new priority is urgent, put into done q.
-            node_unlink_only(to_node(p));
-            list_nq(&q->done, to_node(p));
             // Can only be in immediate or regular queue
             if (PRIORITY_LOC_IMED == p->info[PRIORITY_LOC])
             {
+                node_unlink_only(to_node(p));
                 --q->size_imed;
             }
             else
             {
+                priorityq_unlink_q(q, to_node(p));
                 --q->size_q;
             }
+            list_nq(&q->done, to_node(p));
             ++q->size_done;
             p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+            PQ_STAT(++q->stats.reprioritized);
             return;
         }
         else if (p->info[PRIORITY_LOC] == PRIORITY_LOC_IMED ||
@@ -576,14 +1001,16 @@ priorityq_enqueue(priorityq_t *q, priority_t *p)
             // we can get into a state where we don't make progress.
             // While that should be considered user error, it is something a
             // starvation-free q should consider.
+            PQ_STAT(++q->stats.reprioritize_ignored);
             return;
         }
         else
         {
-            node_unlink_only(to_node(p));
+            priorityq_unlink_q(q, to_node(p));
             // Can only be in regular queue.
             --q->size_q;
             --q->size;
+            PQ_STAT(++q->stats.reprioritized);
         }
     }
 
@@ -611,21 +1038,200 @@ priorityq_enqueue(priorityq_t *q, priority_t *p)
     ++q->size;
 }
 
+/**
+ * @brief Add the priority as priorityq_enqueue does, keeping its cancel
+ *        mark; for items handed over inside the library.
+ */
+INLINE static priority_t *
+priorityq_admit(priorityq_t *q, priority_t *p)
+{
+    priorityq_unbury(p);
+    if (UNLIKELY(q->capacity && q->size >= q->capacity && !node_in_list(to_node(p))))
+    {
+        if (PQ_OVERFLOW_REJECT == q->overflow)
+        {
+            return p;
+        }
+        priorityq_insert(q, p);
+        return priorityq_evict_one(q);
+    }
+
+    priorityq_insert(q, p);
+    return NULL;
+}
+
+/**
+ * @brief Add the priority, honoring the capacity if one is set.
+ * @see priorityq_insert
+ * @return The priority turned away or evicted to make room; NULL if none.
+ *
+ * When rejected, the new priority itself is returned and left out of the
+ * queue. When evicting, the least urgent item is removed after the new one
+ * is added, so the new one is returned if it is the least urgent of all.
+ * A buried cancelled item is taken back as a new one.
+ */
+PQ_API priority_t *
+priorityq_enqueue(priorityq_t *q, priority_t *p)
+{
+    priorityq_fresh(p);
+    return priorityq_admit(q, p);
+}
+
+/**
+ * @brief New items of a batch enqueue, grouped by destination.
+ */
+typedef struct
+{
+    struct priorityq_node_s done;
+    struct priorityq_node_s immediate;
+    struct priorityq_node_s bins[PQ_BINS];
+    uint32_t size_done;
+    uint32_t size_imed;
+    uint32_t size_q;
+} priorityq_batch_t;
+
+INLINE static void
+priorityq_batch_clear(priorityq_batch_t *b)
+{
+    list_clear(&b->done);
+    list_clear(&b->immediate);
+    lists_clear(b->bins, PQ_BINS);
+    b->size_done = 0;
+    b->size_imed = 0;
+    b->size_q = 0;
+}
+
+/**
+ * @brief Splice each group onto the end of its list, leaving b empty.
+ *        The bins' counts were already taken as the items were grouped.
+ */
+INLINE static void
+priorityq_batch_splice(priorityq_t *q, priorityq_batch_t *b)
+{
+    list_append(&q->done, &b->done);
+    list_append(&q->immediate, &b->immediate);
+    int index;
+    for (index = 0; index < PQ_BINS; ++index)
+    {
+        if (list_has(b->bins + index))
+        {
+            list_append(q->bins + index, b->bins + index);
+            q->bin_mask |= (uint8_t)(1 << index);
+        }
+    }
+
+    q->size_done += b->size_done;
+    q->size_imed += b->size_imed;
+    q->size_q += b->size_q;
+    q->size += b->size_done + b->size_imed + b->size_q;
+    b->size_done = 0;
+    b->size_imed = 0;
+    b->size_q = 0;
+}
+
+/**
+ * @brief Add many priorities to the manager at once.
+ * @warn The same referential stability rules as priorityq_enqueue apply.
+ *       Each priority should appear at most once in the array.
+ * @param ps - The priorities to add.
+ * @param n - The number of priorities in ps.
+ *
+ * New priorities are grouped by destination locally and each group is
+ * spliced onto its list in one step. Priorities already in the queue are
+ * reprioritized by priorityq_enqueue, after splicing the groups so far,
+ * so every list ends up as calling priorityq_enqueue for each in turn.
+ * @return The number of priorities displaced by the capacity; zero if none.
+ *
+ * With a capacity set the priorities are added one at a time, and those
+ * turned away or evicted are written over the front of ps.
+ */
+PQ_API uint32_t
+priorityq_enqueue_batch(priorityq_t *q, priority_t **ps, uint32_t n)
+{
+    uint32_t i;
+    if (UNLIKELY(q->capacity))
+    {
+        uint32_t displaced = 0;
+        for (i = 0; i < n; ++i)
+        {
+            priority_t *p = priorityq_enqueue(q, ps[i]);
+            if (p)
+            {
+                ps[displaced++] = p;
+            }
+        }
+        return displaced;
+    }
+
+    priorityq_batch_t b;
+    uint8_t pc = q->pc;
+    priorityq_batch_clear(&b);
+
+    for (i = 0; i < n; ++i)
+    {
+        priority_t *p = ps[i];
+        priorityq_fresh(p);
+
+        if (UNLIKELY(node_in_list(to_node(p))))
+        {
+            // Whatever came before goes in first, as with single calls.
+            priorityq_batch_splice(q, &b);
+            priorityq_insert(q, p);
+            continue;
+        }
+
+        uint8_t abs = p->info[PRIORITY_ABS];
+        if (LIKELY(abs))
+        {
+            uint8_t rp = abs + pc;
+            int index = priorityq_bin_index(pc, rp);
+            p->info[PRIORITY_REL] = rp;
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_Q;
+            ++b.size_q;
+            list_nq(b.bins + index, to_node(p));
+            priorityq_bin_enter(q, p, index);
+        }
+        else if (p->info[PRIORITY_URG])
+        {
+            p->info[PRIORITY_REL] = pc;
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+            ++b.size_done;
+            list_nq(&b.done, to_node(p));
+        }
+        else
+        {
+            p->info[PRIORITY_REL] = pc;
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+            ++b.size_imed;
+            list_nq(&b.immediate, to_node(p));
+        }
+    }
+
+    priorityq_batch_splice(q, &b);
+    return 0;
+}
+
 /**
  * @return The next expired priority; NULL if none.
  */
-priority_t *
+PQ_API priority_t *
 priorityq_dequeue(priorityq_t *q)
 {
     if (LIKELY(q->size))
     {
-        struct priorityq_node_s *n;
-        do
+        // Always take a step so every call makes progress.
+        priorityq_advance_step(q);
+#ifdef PQ_STATS
+        priorityq_stats_dequeue(q, priorityq_ready(q, 1));
+#else
+        priorityq_ready(q, 1);
+#endif
+        if (UNLIKELY(!q->size))
         {
-            priorityq_advance_immediates(q);
-            priorityq_advance_priority_queue(q);
-            n = list_dq(&q->done);
-        } while (!n);
+            return NULL;
+        }
+        struct priorityq_node_s *n = list_dq_quick(&q->done);
+        node_clear(n);
         --q->size_done;
         --q->size;
         priority_t *p = to_priority(n);
@@ -638,31 +1244,2585 @@ priorityq_dequeue(priorityq_t *q)
     }
 }
 
+/**
+ * @brief Dequeue up to max expired priorities in one call.
+ * @param out - Receives the dequeued priorities; must hold max entries.
+ * @param max - The maximum number of priorities to dequeue.
+ * @return The number of priorities written to out; zero if none.
+ *
+ * Whole runs are taken off the front of the done queue, so items come out in
+ * the same relative order as with priorityq_dequeue.
+ * The queue is advanced once per run instead of once per item;
+ * every call still makes progress on the queue.
+ * With a step limit, each item costs at most that many steps.
+ */
+PQ_API uint32_t
+priorityq_dequeue_batch(priorityq_t *q, priority_t **out, uint32_t max)
+{
+    uint32_t count = 0;
+    // Taken since the last run came out.
+    uint32_t steps = 0;
+
+    while (count < max && q->size)
+    {
+        priorityq_advance_step(q);
+        ++steps;
+        if (UNLIKELY(!q->size))
+        {
+            // Everything left was cancelled.
+            break;
+        }
+        if (q->size_done)
+        {
+            steps = 0;
+        }
+        else if (UNLIKELY(q->step_limit && steps >= q->step_limit))
+        {
+            priorityq_fallback(q);
+            steps = 0;
+        }
+
+        uint32_t run = max - count;
+        if (run > q->size_done)
+        {
+            run = q->size_done;
+        }
+
+        if (run)
+        {
+            struct priorityq_node_s *n = q->done.next;
+            uint32_t i;
+            for (i = 0; i < run; ++i)
+            {
+                struct priorityq_node_s *next = n->next;
+                priority_t *p = to_priority(n);
+                if (priorityq_cancelled(p))
+                {
+                    priorityq_bury(q, n);
+                }
+                else
+                {
+                    node_clear(n);
+                    p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+                    out[count++] = p;
+                }
+                n = next;
+            }
+
+            // Splice the whole run out of the done queue at once.
+            q->done.next = n;
+            n->prev = &q->done;
+            q->size_done -= run;
+            q->size -= run;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @return The priority priorityq_dequeue would return next; NULL if none.
+ *
+ * The queue may be organized to find it, but nothing is removed.
+ * Later enqueues, urgent or not, don't change the answer.
+ */
+PQ_API priority_t *
+priorityq_peek(priorityq_t *q)
+{
+    if (LIKELY(q->size))
+    {
+        priorityq_ready(q, 0);
+        if (LIKELY(q->size))
+        {
+            return to_priority(q->done.next);
+        }
+        return NULL;
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+/**
+ * @brief Do the organizing work of dequeue ahead of time, e.g. when idle.
+ * @param budget - The maximum number of steps to take.
+ * @return True if an item is ready, so the next dequeue takes one step.
+ *
+ * Stops early once an item is ready.
+ */
+PQ_API bool
+priorityq_advance(priorityq_t *q, uint32_t budget)
+{
+    while (budget && q->size && !q->size_done)
+    {
+        priorityq_advance_step(q);
+        --budget;
+    }
+    return !!q->size_done;
+}
+
 /**
  * @param p - The priority to remove from the queue.
  * @brief Stop the priority by removing it from the queue.
  */
-void
+PQ_API void
 priorityq_remove(priorityq_t *q, priority_t *p)
 {
     if (LIKELY(node_in_list(to_node(p))))
     {
-        node_unlink(to_node(p));
+        if (UNLIKELY(PRIORITY_LOC_CANCELLED == p->info[PRIORITY_LOC]))
+        {
+            // Already buried and uncounted.
+            node_unlink_only(to_node(p));
+            node_clear(to_node(p));
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+            return;
+        }
+        if (PRIORITY_LOC_Q == p->info[PRIORITY_LOC])
+        {
+            priorityq_unlink_q(q, to_node(p));
+        }
+        else
+        {
+            node_unlink_only(to_node(p));
+        }
+        node_clear(to_node(p));
         priorityq_decrement_queue(q, p);
         --q->size;
         p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
     }
 }
 
+/**
+ * @brief Shed up to max of the least urgent items in O(max) time.
+ * @param out - Receives the evicted priorities; room for max.
+ * @return The number of priorities evicted.
+ *
+ * Items are taken from the farthest-out bin first, then processing, then
+ * the immediate queue. Urgent and expired items are never evicted.
+ */
+PQ_API uint32_t
+priorityq_evict(priorityq_t *q, uint32_t max, priority_t **out)
+{
+    uint32_t n;
+    for (n = 0; n < max; ++n)
+    {
+        priority_t *p = priorityq_evict_one(q);
+        if (!p)
+        {
+            break;
+        }
+        out[n] = p;
+    }
+    return n;
+}
 
-/*******************************************************************************
- * Priority Queue Functions (Testing)
-*******************************************************************************/
-
-uint8_t
-priorityq_priority_counter(priorityq_t *q)
+/**
+ * @brief Change the priority of an item, up or down, in constant time.
+ * @param priority - The new priority; PRIORITY_URGENT is allowed.
+ *
+ * The time an item has already waited is credited against the new
+ * priority. It is placed as if it had been given the new priority when it
+ * first entered, so a demotion never sets it back by more than the
+ * difference and repeated updates can't starve it.
+ * Items that are not in the queue are enqueued, buried cancelled ones
+ * included as new items. Items already in the done queue are ready and stay
+ * where they are. Items waiting in a timer stay there and take the new
+ * priority when released.
+ * @return What priorityq_enqueue returns for new items; otherwise NULL.
+ */
+PQ_API priority_t *
+priorityq_update(priorityq_t *q, priority_t *p, uint8_t priority)
 {
-    return q->pc;
+    int loc = p->info[PRIORITY_LOC];
+    if (UNLIKELY(PRIORITY_LOC_TIMER == loc))
+    {
+        // Only the timer parks items, so p heads a priority_timed_t.
+        ((priority_timed_t *)p)->priority = priority;
+        info_set(p->info, priority);
+        return NULL;
+    }
+    if (UNLIKELY(PRIORITY_LOC_NONE == loc || PRIORITY_LOC_CANCELLED == loc))
+    {
+        priority_set(p, p->data, priority);
+        return priorityq_enqueue(q, p);
+    }
+
+    // How far the item has come, and has left to go.
+    uint8_t remaining = PRIORITY_LOC_Q == loc ? (uint8_t)(p->info[PRIORITY_REL] - q->pc) : 0;
+    uint8_t age = p->info[PRIORITY_ABS] - remaining;
+    info_set(p->info, priority);
+
+    if (PRIORITY_LOC_DONE == loc)
+    {
+        return NULL;
+    }
+
+    struct priorityq_node_s *n = to_node(p);
+    if (p->info[PRIORITY_URG])
+    {
+        if (PRIORITY_LOC_IMED == loc)
+        {
+            node_unlink_only(n);
+            --q->size_imed;
+        }
+        else
+        {
+            priorityq_unlink_q(q, n);
+            --q->size_q;
+        }
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        list_nq(&q->done, n);
+        ++q->size_done;
+        PQ_STAT(++q->stats.reprioritized);
+        return NULL;
+    }
+
+    uint8_t left = priority > age ? priority - age : 0;
+    if (left == remaining)
+    {
+        // Same place, only the recorded priority changes.
+        return NULL;
+    }
+
+    if (PRIORITY_LOC_IMED == loc)
+    {
+        node_unlink_only(n);
+        --q->size_imed;
+    }
+    else
+    {
+        priorityq_unlink_q(q, n);
+        --q->size_q;
+    }
+
+    p->info[PRIORITY_REL] = q->pc + left;
+    if (left)
+    {
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_Q;
+        ++q->size_q;
+        priorityq_nq_only(q, p);
+    }
+    else
+    {
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+        ++q->size_imed;
+        list_nq(&q->immediate, n);
+    }
+    PQ_STAT(++q->stats.reprioritized);
+    return NULL;
+}
+
+/**
+ * @brief Forget every item, leaving the queue empty.
+ *        The counter and step limit are kept.
+ */
+INLINE static void
+priorityq_empty(priorityq_t *q)
+{
+    list_clear(&q->done);
+    list_clear(&q->immediate);
+    list_clear(&q->processing);
+    lists_clear(q->bins, PQ_BINS);
+    list_clear(&q->cancelled);
+    q->bin_mask = 0;
+    q->counter_imed = 0;
+    q->size = 0;
+    q->size_done = 0;
+    q->size_imed = 0;
+    q->size_q = 0;
+    q->size_proc = 0;
+    memset(q->size_bins, 0, sizeof(q->size_bins));
+}
+
+/**
+ * @brief Re-bin a list of src's queued items into dst.
+ * @param pc - The priority counter of src.
+ *
+ * Each item keeps the distance it had left to travel in src.
+ */
+INLINE static void
+priorityq_merge_list(priorityq_t *dst, uint8_t pc, struct priorityq_node_s *l)
+{
+    while (list_has(l))
+    {
+        priority_t *p = to_priority(list_dq_quick(l));
+        uint8_t remaining = p->info[PRIORITY_REL] - pc;
+        p->info[PRIORITY_REL] = dst->pc + remaining;
+        if (LIKELY(remaining))
+        {
+            ++dst->size_q;
+            priorityq_nq_only(dst, p);
+        }
+        else
+        {
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+            ++dst->size_imed;
+            list_nq(&dst->immediate, to_node(p));
+        }
+    }
+}
+
+/**
+ * @brief Move every item of src into dst, leaving src empty.
+ *
+ * The done and immediate queues are spliced onto the ends of dst's, so
+ * their order is kept.
+ * When the priority counters agree, processing and the bins are spliced
+ * whole in O(bins); otherwise their items are re-binned into dst with the
+ * distance they had left to travel.
+ */
+PQ_API void
+priorityq_merge(priorityq_t *dst, priorityq_t *src)
+{
+    if (UNLIKELY(dst == src))
+    {
+        return;
+    }
+
+    list_append(&dst->done, &src->done);
+    list_append(&dst->immediate, &src->immediate);
+    dst->size_done += src->size_done;
+    dst->size_imed += src->size_imed;
+
+    // Bins that can be spliced whole. A spliced bin must also keep the
+    // phase its items were stamped with, and items in processing are told
+    // apart by a stale phase, so processing needs every phase to agree.
+    uint8_t splice = dst->pc == src->pc ? 0xff : 0;
+    splice &= (uint8_t)~(dst->bin_phase ^ src->bin_phase);
+    if (0xff == splice)
+    {
+        list_append(&dst->processing, &src->processing);
+        dst->size_proc += src->size_proc;
+        dst->size_q += src->size_proc;
+    }
+    else
+    {
+        priorityq_merge_list(dst, src->pc, &src->processing);
+    }
+
+    uint8_t mask = src->bin_mask;
+    while (mask)
+    {
+        int index = get_low_index32(mask);
+        if (splice & (1 << index))
+        {
+            list_append(dst->bins + index, src->bins + index);
+            dst->bin_mask |= (uint8_t)(1 << index);
+            dst->size_bins[index] += src->size_bins[index];
+            dst->size_q += src->size_bins[index];
+        }
+        else
+        {
+            priorityq_merge_list(dst, src->pc, src->bins + index);
+        }
+        mask &= mask - 1;
+    }
+
+    list_append(&dst->cancelled, &src->cancelled);
+    dst->size += src->size;
+    priorityq_empty(src);
+}
+
+/**
+ * @brief Move every item to the end of a caller-owned list in O(bins).
+ * @param out - A list head set up with priorityq_list_init.
+ *
+ * Items are left in roughly the order they would have been dequeued:
+ * done, immediate, processing, then the bins from lowest to highest.
+ * Cancelled items not yet reclaimed come last.
+ * They still appear linked until taken with priorityq_list_pop,
+ * which resets them one at a time.
+ */
+PQ_API void
+priorityq_drain(priorityq_t *q, struct priorityq_node_s *out)
+{
+    list_append(out, &q->done);
+    list_append(out, &q->immediate);
+    list_append(out, &q->processing);
+    int i;
+    for (i = 0; i < PQ_BINS; ++i)
+    {
+        list_append(out, q->bins + i);
+    }
+    list_append(out, &q->cancelled);
+    priorityq_empty(q);
+}
+
+/**
+ * @brief Reset every item of the list so it can be enqueued again.
+ *        The head is left as it was.
+ */
+INLINE static void
+priorityq_forget_list(struct priorityq_node_s *l)
+{
+    struct priorityq_node_s *n = l->next;
+    while (n != l)
+    {
+        struct priorityq_node_s *next = n->next;
+        node_clear(n);
+        to_priority(n)->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        n = next;
+    }
+}
+
+/**
+ * @brief Empty the queue in O(n), resetting each item so it can be
+ *        enqueued again, cancelled ones included.
+ *
+ * Unlike drain, the items are not handed back. For a constant time
+ * empty, drain and pop the items as they are needed.
+ */
+PQ_API void
+priorityq_clear(priorityq_t *q)
+{
+    priorityq_forget_list(&q->done);
+    priorityq_forget_list(&q->immediate);
+    priorityq_forget_list(&q->processing);
+    int i;
+    for (i = 0; i < PQ_BINS; ++i)
+    {
+        priorityq_forget_list(q->bins + i);
+    }
+    priorityq_forget_list(&q->cancelled);
+    priorityq_empty(q);
+}
+
+/**
+ * @brief Move the cancelled items met so far to a caller-owned list in O(1).
+ * @param out - A list head set up with priorityq_list_init.
+ *
+ * Take them with priorityq_list_pop; only then may their memory be reused.
+ * Cancelled items the queue hasn't met yet are still counted by
+ * priorityq_size and come out of a later reclaim.
+ */
+PQ_API void
+priorityq_reclaim(priorityq_t *q, struct priorityq_node_s *out)
+{
+    list_append(out, &q->cancelled);
+}
+
+#define PQ_SNAPSHOT_MAGIC (0x51504653)
+// List ids: done, immediate, processing, then the bins.
+#define PQ_SNAPSHOT_LISTS (3 + PQ_BINS)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t records;
+    uint32_t counter_imed;
+    uint32_t step_limit;
+    uint32_t capacity;
+    uint8_t pc;
+    uint8_t overflow;
+    uint8_t bin_phase;
+    uint8_t aging;
+    uint8_t promotion;
+    uint8_t reserved[3];
+} priorityq_snapshot_header_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint8_t info[sizeof(((priority_t *)0)->info)];
+    uint8_t list;
+} priorityq_snapshot_record_t;
+
+INLINE static struct priorityq_node_s *
+priorityq_snapshot_list(priorityq_t *q, int id)
+{
+    if (0 == id)
+    {
+        return &q->done;
+    }
+    else if (1 == id)
+    {
+        return &q->immediate;
+    }
+    else if (2 == id)
+    {
+        return &q->processing;
+    }
+    else
+    {
+        return q->bins + (id - 3);
+    }
+}
+
+/**
+ * @return The location an item on the list with the given id records.
+ */
+INLINE static uint8_t
+priorityq_snapshot_loc(int id)
+{
+    if (0 == id)
+    {
+        return PRIORITY_LOC_DONE;
+    }
+    else if (1 == id)
+    {
+        return PRIORITY_LOC_IMED;
+    }
+    else
+    {
+        return PRIORITY_LOC_Q;
+    }
+}
+
+/**
+ * @brief Check every record before any node is touched: each id is in
+ *        range and used once, and each location agrees with its list.
+ */
+INLINE static bool
+priorityq_snapshot_valid(const priorityq_snapshot_record_t *r, uint32_t records, uint32_t count)
+{
+    uint64_t *seen = (uint64_t *)calloc(count / 64 + 1, sizeof(uint64_t));
+    if (!seen)
+    {
+        return false;
+    }
+
+    uint32_t i;
+    for (i = 0; i < records; ++i, ++r)
+    {
+        if (r->id >= count || r->list >= PQ_SNAPSHOT_LISTS ||
+            priorityq_snapshot_loc(r->list) != r->info[PRIORITY_LOC])
+        {
+            break;
+        }
+        uint64_t bit = (uint64_t)1 << (r->id % 64);
+        if (seen[r->id / 64] & bit)
+        {
+            break;
+        }
+        seen[r->id / 64] |= bit;
+    }
+
+    free(seen);
+    return i == records;
+}
+
+/**
+ * @return The number of bytes priorityq_snapshot will write.
+ */
+PQ_API size_t
+priorityq_snapshot_size(priorityq_t *q)
+{
+    return sizeof(priorityq_snapshot_header_t) +
+           (size_t)q->size * sizeof(priorityq_snapshot_record_t);
+}
+
+/**
+ * @brief Write the queue's state to a flat buffer in O(n); q is unchanged.
+ * @param buf - Room for priorityq_snapshot_size bytes, suitably aligned
+ *              for uint32_t, e.g. from malloc or mmap.
+ * @param id - Gives each item's id; ids MUST be unique.
+ * @param ctx - Passed to id.
+ * @return The number of bytes written.
+ *
+ * Every list is recorded in order, with each item's id and internal bytes.
+ * Cancelled items waiting to be reclaimed are not part of the queue and
+ * are left out; statistics other than occupancy aren't kept.
+ */
+PQ_API size_t
+priorityq_snapshot(priorityq_t *q, void *buf, priorityq_id_fn id, void *ctx)
+{
+    priorityq_snapshot_header_t *h = (priorityq_snapshot_header_t *)buf;
+    priorityq_snapshot_record_t *r = (priorityq_snapshot_record_t *)(h + 1);
+
+    (*h) = (const priorityq_snapshot_header_t){ 0 };
+    h->magic = PQ_SNAPSHOT_MAGIC;
+    h->records = q->size;
+    h->counter_imed = q->counter_imed;
+    h->step_limit = q->step_limit;
+    h->capacity = q->capacity;
+    h->pc = q->pc;
+    h->overflow = q->overflow;
+    h->aging = q->aging;
+    h->promotion = q->promotion;
+    h->bin_phase = q->bin_phase;
+
+    int list;
+    for (list = 0; list < PQ_SNAPSHOT_LISTS; ++list)
+    {
+        struct priorityq_node_s *l = priorityq_snapshot_list(q, list);
+        struct priorityq_node_s *n;
+        for (n = l->next; n != l; n = n->next)
+        {
+            priority_t *p = to_priority(n);
+            r->id = id(p, ctx);
+            memcpy(r->info, p->info, sizeof(r->info));
+            r->list = (uint8_t)list;
+            ++r;
+        }
+    }
+
+    return (uintptr_t)r - (uintptr_t)buf;
+}
+
+/**
+ * @brief Rebuild a queue from a snapshot in one linear pass.
+ * @param buf - A buffer written by priorityq_snapshot, e.g. mmap'd.
+ * @param size - The size of buf in bytes.
+ * @param nodes - The items by id; each one's data is kept and the rest
+ *                overwritten, they MUST NOT be in any queue.
+ * @param count - The number of entries in nodes.
+ * @return False if the buffer isn't a valid snapshot for nodes; q is then
+ *         left empty and no node is touched.
+ *
+ * The queue is initialized first and then dequeues in the same order as
+ * the one snapshotted, with the same aging.
+ */
+PQ_API bool
+priorityq_restore(priorityq_t *q, const void *buf, size_t size, priority_t **nodes, uint32_t count)
+{
+    const priorityq_snapshot_header_t *h = (const priorityq_snapshot_header_t *)buf;
+    const priorityq_snapshot_record_t *r = (const priorityq_snapshot_record_t *)(h + 1);
+
+    priorityq_init(q);
+    if (size < sizeof(*h) || PQ_SNAPSHOT_MAGIC != h->magic ||
+        (size - sizeof(*h)) / sizeof(*r) < h->records ||
+        !priorityq_snapshot_valid(r, h->records, count))
+    {
+        return false;
+    }
+
+    uint32_t i;
+    for (i = 0; i < h->records; ++i, ++r)
+    {
+        priority_t *p = nodes[r->id];
+        memcpy(p->info, r->info, sizeof(r->info));
+        list_nq(priorityq_snapshot_list(q, r->list), to_node(p));
+        if (0 == r->list)
+        {
+            ++q->size_done;
+        }
+        else if (1 == r->list)
+        {
+            ++q->size_imed;
+        }
+        else
+        {
+            ++q->size_q;
+            if (2 == r->list)
+            {
+                ++q->size_proc;
+            }
+            else
+            {
+                ++q->size_bins[r->list - 3];
+            }
+        }
+    }
+
+    int index;
+    for (index = 0; index < PQ_BINS; ++index)
+    {
+        if (list_has(q->bins + index))
+        {
+            q->bin_mask |= (uint8_t)(1 << index);
+        }
+    }
+    q->size = h->records;
+    q->counter_imed = h->counter_imed;
+    q->step_limit = h->step_limit;
+    q->capacity = h->capacity;
+    q->pc = h->pc;
+    q->overflow = h->overflow;
+    priorityq_set_rates(q, h->aging, h->promotion);
+    q->bin_phase = h->bin_phase;
+
+    return true;
+}
+
+/**
+ * @brief Copy the number of items in each list, in O(bins).
+ * @param out - Receives the depths.
+ */
+PQ_API void
+priorityq_depths(priorityq_t *q, priorityq_depths_t *out)
+{
+    out->done = q->size_done;
+    out->immediate = q->size_imed;
+    out->processing = q->size_proc;
+    memcpy(out->bins, q->size_bins, sizeof(out->bins));
+}
+
+#ifdef PQ_STATS
+/**
+ * @brief Copy the statistics, in constant time.
+ * @param out - Receives the snapshot.
+ */
+PQ_API void
+priorityq_stats(priorityq_t *q, priorityq_stats_t *out)
+{
+    (*out) = q->stats;
+}
+#endif
+
+
+/*******************************************************************************
+ * Drained List Functions
+*******************************************************************************/
+
+PQ_API void
+priorityq_list_init(struct priorityq_node_s *l)
+{
+    list_clear(l);
+}
+
+/**
+ * @return The first priority in the list, reset so it can be enqueued
+ *         again; NULL if the list is empty.
+ */
+PQ_API priority_t *
+priorityq_list_pop(struct priorityq_node_s *l)
+{
+    struct priorityq_node_s *n = list_dq(l);
+    if (n)
+    {
+        priority_t *p = to_priority(n);
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        return p;
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Aligned Allocation Functions
+*******************************************************************************/
+
+#if PQ_CACHE_LINE >= 64
+_Static_assert(offsetof(priorityq_t, immediate) + sizeof(struct priorityq_node_s) <= PQ_CACHE_LINE,
+               "The fields every dequeue touches must fit in one cache line.");
+#endif
+
+/**
+ * @return Memory aligned to PQ_CACHE_LINE; NULL on failure.
+ *         Release it with priorityq_free.
+ */
+PQ_API void *
+priorityq_alloc(size_t size)
+{
+    size = (size + PQ_CACHE_LINE - 1) / PQ_CACHE_LINE * PQ_CACHE_LINE;
+    return aligned_alloc(PQ_CACHE_LINE, size ? size : PQ_CACHE_LINE);
+}
+
+PQ_API void
+priorityq_free(void *mem)
+{
+    free(mem);
+}
+
+
+/*******************************************************************************
+ * Slab Allocator Functions
+*******************************************************************************/
+
+// The slab header is padded so priorities start on a cache line.
+#define PQ_SLAB_HEADER (PQ_CACHE_LINE)
+
+/**
+ * @param per_slab - Minimum priorities per slab, rounded up to fill
+ *                   whole cache lines; zero picks a default.
+ */
+PQ_API void
+priorityq_slab_init(priorityq_slab_t *slab, uint32_t per_slab)
+{
+    const uint32_t per_line = PQ_CACHE_LINE / sizeof(priority_t)
+                              ? PQ_CACHE_LINE / sizeof(priority_t) : 1;
+
+    if (!per_slab)
+    {
+        per_slab = 4096 / sizeof(priority_t);
+    }
+    per_slab = (per_slab + per_line - 1) / per_line * per_line;
+
+    (*slab) = (const priorityq_slab_t){ 0 };
+    slab->per_slab = per_slab;
+}
+
+/**
+ * @brief Release every slab.
+ * @warn All priorities handed out become invalid, even if not freed.
+ */
+PQ_API void
+priorityq_slab_destroy(priorityq_slab_t *slab)
+{
+    void *mem = slab->slabs;
+    while (mem)
+    {
+        void *prev = *(void **)mem;
+        free(mem);
+        mem = prev;
+    }
+    (*slab) = (const priorityq_slab_t){ 0 };
+}
+
+/**
+ * @return The number of priorities handed out and not yet freed.
+ */
+PQ_API uint32_t
+priorityq_slab_used(priorityq_slab_t *slab)
+{
+    return slab->used;
+}
+
+INLINE static bool
+priorityq_slab_grow(priorityq_slab_t *slab)
+{
+    size_t size = PQ_SLAB_HEADER + slab->per_slab * sizeof(priority_t);
+    size = (size + PQ_CACHE_LINE - 1) / PQ_CACHE_LINE * PQ_CACHE_LINE;
+
+    void *mem = aligned_alloc(PQ_CACHE_LINE, size);
+    if (UNLIKELY(!mem))
+    {
+        return false;
+    }
+
+    *(void **)mem = slab->slabs;
+    slab->slabs = mem;
+
+    // Push in reverse so consecutive allocations are adjacent in memory.
+    priority_t *ps = (priority_t *)((char *)mem + PQ_SLAB_HEADER);
+    uint32_t i = slab->per_slab;
+    while (i--)
+    {
+        to_node(ps + i)->prev = slab->free;
+        slab->free = to_node(ps + i);
+    }
+
+    return true;
+}
+
+/**
+ * @return An initialized priority; NULL if out of memory.
+ */
+PQ_API priority_t *
+priorityq_slab_alloc(priorityq_slab_t *slab)
+{
+    if (UNLIKELY(!slab->free) && !priorityq_slab_grow(slab))
+    {
+        return NULL;
+    }
+
+    struct priorityq_node_s *n = slab->free;
+    slab->free = n->prev;
+    ++slab->used;
+
+    priority_t *p = to_priority(n);
+    priority_init(p);
+    return p;
+}
+
+/**
+ * @brief Give a priority back to the slab it came from.
+ * @warn The priority MUST NOT be in a queue; dequeue or remove it first.
+ *
+ * Freed priorities are handed out again first, while still in cache.
+ */
+PQ_API void
+priorityq_slab_free(priorityq_slab_t *slab, priority_t *p)
+{
+    struct priorityq_node_s *n = to_node(p);
+    n->next = NULL;
+    n->prev = slab->free;
+    slab->free = n;
+    --slab->used;
+}
+
+
+/*******************************************************************************
+ * Compact Priority Queue Functions
+ *
+ * The same algorithm as above over 32-bit links into an arena.
+ * The list heads occupy the last PQ_COMPACT_LISTS nodes of the arena,
+ * so resolving any link is a single index off the base.
+*******************************************************************************/
+
+enum PQ_COMPACT_LIST_ENUM
+{
+    PQ_COMPACT_DONE = 0,
+    PQ_COMPACT_IMED = 1,
+    PQ_COMPACT_PROC = 2,
+    PQ_COMPACT_BINS = 3,
+};
+
+INLINE static uint32_t
+compact_link(uint32_t index)
+{
+    return index + 1;
+}
+
+INLINE static uint32_t
+compact_index(uint32_t link)
+{
+    return link - 1;
+}
+
+/**
+ * The link MUST NOT be zero!!!
+ */
+INLINE static priority_compact_t *
+compact_at(priorityq_compact_t *q, uint32_t link)
+{
+    return q->base + compact_index(link);
+}
+
+INLINE static uint32_t
+compact_head(priorityq_compact_t *q, uint32_t list)
+{
+    return q->capacity + 1 + list;
+}
+
+INLINE static void
+compact_unlink_only(priorityq_compact_t *q, uint32_t n)
+{
+    priority_compact_t *node = compact_at(q, n);
+    compact_at(q, node->next)->prev = node->prev;
+    compact_at(q, node->prev)->next = node->next;
+}
+
+INLINE static void
+compact_nq(priorityq_compact_t *q, uint32_t l, uint32_t n)
+{
+    priority_compact_t *head = compact_at(q, l);
+    priority_compact_t *node = compact_at(q, n);
+    node->next = l;
+    node->prev = head->prev;
+    compact_at(q, head->prev)->next = n;
+    head->prev = n;
+}
+
+/**
+ * You MUST be sure the list isn't empty!!!
+ */
+INLINE static uint32_t
+compact_dq_quick(priorityq_compact_t *q, uint32_t l)
+{
+    uint32_t n = compact_at(q, l)->next;
+    compact_unlink_only(q, n);
+    return n;
+}
+
+INLINE static bool
+compact_has(priorityq_compact_t *q, uint32_t l)
+{
+    return l != compact_at(q, l)->next;
+}
+
+INLINE static void
+compact_clear(priorityq_compact_t *q, uint32_t l)
+{
+    compact_at(q, l)->next = l;
+    compact_at(q, l)->prev = l;
+}
+
+/**
+ * @brief Append items from l2 to l1.
+ */
+INLINE static void
+compact_append(priorityq_compact_t *q, uint32_t l1, uint32_t l2)
+{
+    if (compact_has(q, l2))
+    {
+        priority_compact_t *h1 = compact_at(q, l1);
+        priority_compact_t *h2 = compact_at(q, l2);
+        compact_at(q, h2->next)->prev = h1->prev;
+        compact_at(q, h2->prev)->next = l1;
+        compact_at(q, h1->prev)->next = h2->next;
+        h1->prev = h2->prev;
+        compact_clear(q, l2);
+    }
+}
+
+INLINE static void
+compact_decrement_queue(priorityq_compact_t *q, priority_compact_t *p)
+{
+    int loc = p->info[PRIORITY_LOC];
+    if (PRIORITY_LOC_DONE == loc)
+    {
+        --q->size_done;
+    }
+    else if (PRIORITY_LOC_IMED == loc)
+    {
+        --q->size_imed;
+    }
+    else // PRIORITY_LOC_Q == loc
+    {
+        --q->size_q;
+    }
+}
+
+INLINE static void
+compact_nq_only(priorityq_compact_t *q, uint32_t n)
+{
+    int index = priorityq_bin_index(q->pc, compact_at(q, n)->info[PRIORITY_REL]);
+    compact_nq(q, compact_head(q, PQ_COMPACT_BINS + index), n);
+    q->bin_mask |= (uint8_t)(1 << index);
+}
+
+/**
+ * @brief Unlink a priority in the processing queue or a bin.
+ *        Clears the bin's bit in the mask if the bin is left empty.
+ */
+INLINE static void
+compact_unlink_q(priorityq_compact_t *q, uint32_t n)
+{
+    compact_unlink_only(q, n);
+
+    priority_compact_t *node = compact_at(q, n);
+    if (node->prev == node->next)
+    {
+        uint32_t index = node->prev - compact_head(q, PQ_COMPACT_BINS);
+        if (index < PQ_BINS)
+        {
+            q->bin_mask &= (uint8_t)~(1 << index);
+        }
+    }
+}
+
+INLINE static void
+compact_advance_priority_counter(priorityq_compact_t *q)
+{
+    uint8_t mask = q->bin_mask;
+    uint8_t newpc;
+    uint8_t bits = priorityq_counter_step(q->pc, mask, &newpc);
+
+    uint8_t triggered = bits & mask;
+    while (triggered)
+    {
+        uint32_t index = get_low_index32(triggered);
+        compact_append(q, compact_head(q, PQ_COMPACT_PROC),
+                       compact_head(q, PQ_COMPACT_BINS + index));
+        triggered &= triggered - 1;
+    }
+
+    q->bin_mask = mask & ~bits;
+    q->pc = newpc;
+}
+
+INLINE static void
+compact_advance_immediates(priorityq_compact_t *q)
+{
+    uint32_t count = priorityq_immediate_step(&q->counter_imed, q->size_imed, q->size_done, PQ_RATE_DEFAULT);
+    while (count--)
+    {
+        uint32_t n = compact_dq_quick(q, compact_head(q, PQ_COMPACT_IMED));
+        compact_at(q, n)->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        compact_nq(q, compact_head(q, PQ_COMPACT_DONE), n);
+        --q->size_imed;
+        ++q->size_done;
+    }
+}
+
+/**
+ * The processing queue MUST NOT be empty!!!
+ * @brief See priorityq_prefetch_processing.
+ */
+INLINE static void
+compact_prefetch_processing(priorityq_compact_t *q)
+{
+    priority_compact_t *n = compact_at(q, compact_at(q, compact_head(q, PQ_COMPACT_PROC))->next);
+    PREFETCH(compact_at(q, n->next), 0);
+
+    uint8_t rp = n->info[PRIORITY_REL];
+    if (LIKELY(rp != q->pc))
+    {
+        uint32_t bin = compact_head(q, PQ_COMPACT_BINS + priorityq_bin_index(q->pc, rp));
+        PREFETCH(compact_at(q, compact_at(q, bin)->prev), 1);
+    }
+}
+
+INLINE static void
+compact_advance_priority_queue(priorityq_compact_t *q)
+{
+    if (q->size_q)
+    {
+        uint32_t processing = compact_head(q, PQ_COMPACT_PROC);
+        if (compact_has(q, processing))
+        {
+            uint32_t limit_q = get_high_index32(q->size_q) + 1;
+            bool prefetch = q->size_q >= PQ_PREFETCH_MIN;
+            do
+            {
+                uint32_t n = compact_dq_quick(q, processing);
+                priority_compact_t *p = compact_at(q, n);
+                if (prefetch && compact_has(q, processing))
+                {
+                    compact_prefetch_processing(q);
+                }
+                if (LIKELY(p->info[PRIORITY_REL] != q->pc))
+                {
+                    compact_nq_only(q, n);
+                }
+                else
+                {
+                    p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+                    --q->size_q;
+                    ++q->size_imed;
+                    compact_nq(q, compact_head(q, PQ_COMPACT_IMED), n);
+                }
+            } while (--limit_q && compact_has(q, processing));
+        }
+        else
+        {
+            compact_advance_priority_counter(q);
+        }
+    }
+}
+
+PQ_API void
+priority_compact_set(priority_compact_t *p, uint8_t priority)
+{
+    info_set(p->info, priority);
+}
+
+PQ_API uint8_t
+priority_compact_value(priority_compact_t *p)
+{
+    return p->info[PRIORITY_ABS];
+}
+
+PQ_API bool
+priority_compact_is_active(priority_compact_t *p)
+{
+    return !!p->next;
+}
+
+/**
+ * @param arena - Storage for PQ_COMPACT_ARENA(capacity) nodes.
+ * @param capacity - The number of items; indices run from zero to capacity - 1.
+ *
+ * Every item node is reset, the arena doesn't need to be initialized.
+ */
+PQ_API void
+priorityq_compact_init(priorityq_compact_t *q, priority_compact_t *arena, uint32_t capacity)
+{
+    (*q) = (const priorityq_compact_t){ 0 };
+    q->capacity = capacity;
+    q->base = arena;
+    memset(arena, 0, capacity * sizeof(*arena));
+
+    uint32_t i;
+    for (i = 0; i < PQ_COMPACT_LISTS; ++i)
+    {
+        compact_clear(q, compact_head(q, i));
+    }
+}
+
+PQ_API void
+priorityq_compact_destroy(priorityq_compact_t *q)
+{
+    (*q) = (const priorityq_compact_t){ 0 };
+}
+
+PQ_API uint32_t
+priorityq_compact_size(priorityq_compact_t *q)
+{
+    return q->size;
+}
+
+/**
+ * @return The node of the item at index.
+ */
+PQ_API priority_compact_t *
+priorityq_compact_node(priorityq_compact_t *q, uint32_t index)
+{
+    return compact_at(q, compact_link(index));
+}
+
+/**
+ * @brief Add the item at index to the manager.
+ *        Set its priority with priority_compact_set first.
+ *        Follows the same rules as priorityq_enqueue.
+ */
+PQ_API void
+priorityq_compact_enqueue(priorityq_compact_t *q, uint32_t index)
+{
+    uint32_t n = compact_link(index);
+    priority_compact_t *p = compact_at(q, n);
+
+    if (UNLIKELY(p->info[PRIORITY_LOC] == PRIORITY_LOC_DONE)) { return; }
+
+    if (UNLIKELY(p->next))
+    {
+        if (p->info[PRIORITY_URG])
+        {
+            if (PRIORITY_LOC_IMED == p->info[PRIORITY_LOC])
+            {
+                compact_unlink_only(q, n);
+                --q->size_imed;
+            }
+            else
+            {
+                compact_unlink_q(q, n);
+                --q->size_q;
+            }
+            compact_nq(q, compact_head(q, PQ_COMPACT_DONE), n);
+            ++q->size_done;
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+            return;
+        }
+        else if (p->info[PRIORITY_LOC] == PRIORITY_LOC_IMED ||
+                 p->info[PRIORITY_ABS] >= (p->info[PRIORITY_REL] - (uint8_t)q->pc))
+        {
+            return;
+        }
+        else
+        {
+            compact_unlink_q(q, n);
+            --q->size_q;
+            --q->size;
+        }
+    }
+
+    if (LIKELY(p->info[PRIORITY_ABS]))
+    {
+        p->info[PRIORITY_REL] = p->info[PRIORITY_ABS] + q->pc;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_Q;
+        ++q->size_q;
+        compact_nq_only(q, n);
+    }
+    else if (p->info[PRIORITY_URG])
+    {
+        p->info[PRIORITY_REL] = q->pc;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        ++q->size_done;
+        compact_nq(q, compact_head(q, PQ_COMPACT_DONE), n);
+    }
+    else
+    {
+        p->info[PRIORITY_REL] = q->pc;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+        ++q->size_imed;
+        compact_nq(q, compact_head(q, PQ_COMPACT_IMED), n);
+    }
+    ++q->size;
+}
+
+/**
+ * @return The index of the next expired item; PQ_COMPACT_NONE if none.
+ */
+PQ_API uint32_t
+priorityq_compact_dequeue(priorityq_compact_t *q)
+{
+    if (LIKELY(q->size))
+    {
+        uint32_t done = compact_head(q, PQ_COMPACT_DONE);
+        do
+        {
+            compact_advance_immediates(q);
+            compact_advance_priority_queue(q);
+        } while (!compact_has(q, done));
+
+        uint32_t n = compact_dq_quick(q, done);
+        priority_compact_t *p = compact_at(q, n);
+        p->prev = 0;
+        p->next = 0;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        --q->size_done;
+        --q->size;
+        return compact_index(n);
+    }
+    else
+    {
+        return PQ_COMPACT_NONE;
+    }
+}
+
+/**
+ * @brief Stop the item at index by removing it from the queue.
+ */
+PQ_API void
+priorityq_compact_remove(priorityq_compact_t *q, uint32_t index)
+{
+    uint32_t n = compact_link(index);
+    priority_compact_t *p = compact_at(q, n);
+
+    if (LIKELY(p->next))
+    {
+        if (PRIORITY_LOC_Q == p->info[PRIORITY_LOC])
+        {
+            compact_unlink_q(q, n);
+        }
+        else
+        {
+            compact_unlink_only(q, n);
+        }
+        p->prev = 0;
+        p->next = 0;
+        compact_decrement_queue(q, p);
+        --q->size;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+    }
+}
+
+
+/*******************************************************************************
+ * Segmented Priority Queue Functions
+ *
+ * The same algorithm as above with each list stored as a chain of chunks.
+ * A node knows its chunk and slot, so removal writes a tombstone there.
+ * Bins keep the generation they were at when each chunk joined them;
+ * appending a bin to processing bumps its generation, which is how a node
+ * in processing is told apart from one in its old bin without walking the
+ * chunks. A list's chunks are recycled as soon as it has no live entries.
+*******************************************************************************/
+
+enum PQ_SEG_LIST_ENUM
+{
+    PQ_SEG_DONE = 0,
+    PQ_SEG_IMED = 1,
+    PQ_SEG_PROC = 2,
+    PQ_SEG_BINS = 3,
+};
+
+INLINE static priority_seg_t *
+seg_at(priorityq_seg_t *q, uint32_t index)
+{
+    return q->base + index;
+}
+
+/**
+ * @return The list the chunk is currently in.
+ */
+INLINE static uint32_t
+seg_list_of(priorityq_seg_t *q, priorityq_seg_chunk_t *c)
+{
+    uint32_t l = c->list;
+    if (l >= PQ_SEG_BINS && c->gen != q->lists[l].gen)
+    {
+        return PQ_SEG_PROC;
+    }
+    return l;
+}
+
+INLINE static void
+seg_recycle(priorityq_seg_t *q, priorityq_seg_chunk_t *first, priorityq_seg_chunk_t *last)
+{
+    last->next = q->spare;
+    q->spare = first;
+}
+
+/**
+ * @brief Recycle all chunks of a list that holds only tombstones.
+ */
+INLINE static void
+seg_drop(priorityq_seg_t *q, uint32_t l)
+{
+    priorityq_seg_list_t *list = q->lists + l;
+    if (list->head)
+    {
+        seg_recycle(q, list->head, list->tail);
+        list->head = NULL;
+        list->tail = NULL;
+    }
+}
+
+/**
+ * @brief Make sure the list has a free entry at its end.
+ * @return False if a chunk couldn't be allocated.
+ */
+INLINE static bool
+seg_room(priorityq_seg_t *q, uint32_t l)
+{
+    priorityq_seg_list_t *list = q->lists + l;
+    if (LIKELY(list->tail && list->tail->end < PQ_SEG_CHUNK))
+    {
+        return true;
+    }
+
+    priorityq_seg_chunk_t *c = q->spare;
+    if (c)
+    {
+        q->spare = c->next;
+    }
+    else if (!(c = (priorityq_seg_chunk_t *)malloc(sizeof(*c))))
+    {
+        return false;
+    }
+    c->next = NULL;
+    c->gen = list->gen;
+    c->begin = 0;
+    c->end = 0;
+    c->list = (uint8_t)l;
+
+    if (list->tail)
+    {
+        list->tail->next = c;
+    }
+    else
+    {
+        list->head = c;
+    }
+    list->tail = c;
+    return true;
+}
+
+/**
+ * You MUST call seg_room first!!!
+ */
+INLINE static void
+seg_push(priorityq_seg_t *q, uint32_t l, uint32_t index)
+{
+    priorityq_seg_list_t *list = q->lists + l;
+    priorityq_seg_chunk_t *c = list->tail;
+    priority_seg_t *p = seg_at(q, index);
+    uint32_t k = c->end++;
+    c->items[k] = index;
+    c->rp[k] = p->info[PRIORITY_REL];
+    p->chunk = c;
+    p->slot = (uint8_t)k;
+    ++list->live;
+}
+
+/**
+ * You MUST be sure the list has live entries!!!
+ * @return The index of the first live entry, which is taken off the list.
+ */
+INLINE static uint32_t
+seg_pop(priorityq_seg_t *q, uint32_t l)
+{
+    priorityq_seg_list_t *list = q->lists + l;
+    priorityq_seg_chunk_t *c = list->head;
+    uint32_t index;
+    for (;;)
+    {
+        while (c->begin < c->end)
+        {
+            index = c->items[c->begin++];
+            if (PQ_SEG_NONE != index)
+            {
+                goto found;
+            }
+        }
+        list->head = c->next;
+        seg_recycle(q, c, c);
+        c = list->head;
+    }
+
+found:
+    if (!--list->live)
+    {
+        seg_drop(q, l);
+    }
+    seg_at(q, index)->chunk = NULL;
+    return index;
+}
+
+/**
+ * @brief Leave a tombstone in the node's slot.
+ *        Clears the bin's bit in the mask if the bin is left empty.
+ * @return The list the node was in.
+ */
+INLINE static uint32_t
+seg_unlink(priorityq_seg_t *q, priority_seg_t *p)
+{
+    priorityq_seg_chunk_t *c = p->chunk;
+    uint32_t l = seg_list_of(q, c);
+    c->items[p->slot] = PQ_SEG_NONE;
+    p->chunk = NULL;
+    if (!--q->lists[l].live)
+    {
+        seg_drop(q, l);
+        if (l >= PQ_SEG_BINS)
+        {
+            q->bin_mask &= (uint8_t)~(1 << (l - PQ_SEG_BINS));
+        }
+    }
+    return l;
+}
+
+/**
+ * @brief Append the entries of l2 to l1.
+ */
+INLINE static void
+seg_append(priorityq_seg_t *q, uint32_t l1, uint32_t l2)
+{
+    priorityq_seg_list_t *dst = q->lists + l1;
+    priorityq_seg_list_t *src = q->lists + l2;
+    if (src->head)
+    {
+        if (dst->tail)
+        {
+            dst->tail->next = src->head;
+        }
+        else
+        {
+            dst->head = src->head;
+        }
+        dst->tail = src->tail;
+        dst->live += src->live;
+        src->head = NULL;
+        src->tail = NULL;
+        src->live = 0;
+    }
+    ++src->gen;
+}
+
+INLINE static void
+seg_advance_priority_counter(priorityq_seg_t *q)
+{
+    uint8_t mask = q->bin_mask;
+    uint8_t newpc;
+    uint8_t bits = priorityq_counter_step(q->pc, mask, &newpc);
+
+    uint8_t triggered = bits & mask;
+    while (triggered)
+    {
+        uint32_t index = get_low_index32(triggered);
+        seg_append(q, PQ_SEG_PROC, PQ_SEG_BINS + index);
+        triggered &= triggered - 1;
+    }
+
+    q->bin_mask = mask & ~bits;
+    q->pc = newpc;
+}
+
+/**
+ * @return False if a chunk couldn't be allocated.
+ */
+INLINE static bool
+seg_advance_immediates(priorityq_seg_t *q)
+{
+    uint32_t count = priorityq_immediate_step(&q->counter_imed, q->lists[PQ_SEG_IMED].live,
+                                              q->lists[PQ_SEG_DONE].live, PQ_RATE_DEFAULT);
+    while (count--)
+    {
+        if (UNLIKELY(!seg_room(q, PQ_SEG_DONE)))
+        {
+            return false;
+        }
+        uint32_t index = seg_pop(q, PQ_SEG_IMED);
+        seg_at(q, index)->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        seg_push(q, PQ_SEG_DONE, index);
+    }
+    return true;
+}
+
+/**
+ * @return False if a chunk couldn't be allocated.
+ */
+INLINE static bool
+seg_advance_priority_queue(priorityq_seg_t *q)
+{
+    if (q->size_q)
+    {
+        priorityq_seg_list_t *processing = q->lists + PQ_SEG_PROC;
+        if (processing->live)
+        {
+            uint32_t limit_q = get_high_index32(q->size_q) + 1;
+            uint8_t bins[PQ_SEG_CHUNK];
+            do
+            {
+                priorityq_seg_chunk_t *c = processing->head;
+                uint32_t end = c->begin + limit_q < c->end ? c->begin + limit_q : c->end;
+                uint32_t k;
+
+                // Bins for the run are found in one pass over the chunk's
+                // relative priorities, apart from the moves that follow.
+                for (k = c->begin; k < end; ++k)
+                {
+                    uint8_t rp = c->rp[k];
+                    bins[k] = rp == q->pc ? PQ_BINS : (uint8_t)priorityq_bin_index(q->pc, rp);
+                }
+
+                for (k = c->begin; k < end; ++k)
+                {
+                    uint32_t index = c->items[k];
+                    if (PQ_SEG_NONE == index)
+                    {
+                        continue;
+                    }
+
+                    uint32_t l = PQ_BINS == bins[k] ? PQ_SEG_IMED : PQ_SEG_BINS + bins[k];
+                    if (UNLIKELY(!seg_room(q, l)))
+                    {
+                        c->begin = (uint16_t)k;
+                        return false;
+                    }
+                    if (PQ_SEG_IMED == l)
+                    {
+                        seg_at(q, index)->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+                        --q->size_q;
+                    }
+                    else
+                    {
+                        q->bin_mask |= (uint8_t)(1 << bins[k]);
+                    }
+                    seg_push(q, l, index);
+                    --processing->live;
+                    --limit_q;
+                }
+                c->begin = (uint16_t)end;
+
+                if (!processing->live)
+                {
+                    seg_drop(q, PQ_SEG_PROC);
+                    break;
+                }
+                if (c->begin == c->end)
+                {
+                    processing->head = c->next;
+                    seg_recycle(q, c, c);
+                }
+            } while (limit_q);
+        }
+        else
+        {
+            seg_advance_priority_counter(q);
+        }
+    }
+    return true;
+}
+
+PQ_API void
+priority_seg_set(priority_seg_t *p, uint8_t priority)
+{
+    info_set(p->info, priority);
+}
+
+PQ_API uint8_t
+priority_seg_value(priority_seg_t *p)
+{
+    return p->info[PRIORITY_ABS];
+}
+
+PQ_API bool
+priority_seg_is_active(priority_seg_t *p)
+{
+    return !!p->chunk;
+}
+
+/**
+ * @param arena - Storage for capacity nodes.
+ * @param capacity - The number of items; indices run from zero to capacity - 1.
+ *
+ * Every item node is reset, the arena doesn't need to be initialized.
+ */
+PQ_API void
+priorityq_seg_init(priorityq_seg_t *q, priority_seg_t *arena, uint32_t capacity)
+{
+    (*q) = (const priorityq_seg_t){ 0 };
+    q->capacity = capacity;
+    q->base = arena;
+    memset(arena, 0, capacity * sizeof(*arena));
+}
+
+/**
+ * @brief Free the chunks. Nodes still in the queue are left as they are.
+ */
+PQ_API void
+priorityq_seg_destroy(priorityq_seg_t *q)
+{
+    uint32_t i;
+    for (i = 0; i < PQ_SEG_LISTS; ++i)
+    {
+        seg_drop(q, i);
+    }
+    while (q->spare)
+    {
+        priorityq_seg_chunk_t *c = q->spare;
+        q->spare = c->next;
+        free(c);
+    }
+    (*q) = (const priorityq_seg_t){ 0 };
+}
+
+PQ_API uint32_t
+priorityq_seg_size(priorityq_seg_t *q)
+{
+    return q->size;
+}
+
+/**
+ * @return The node of the item at index.
+ */
+PQ_API priority_seg_t *
+priorityq_seg_node(priorityq_seg_t *q, uint32_t index)
+{
+    return seg_at(q, index);
+}
+
+/**
+ * @brief Add the item at index to the manager.
+ *        Set its priority with priority_seg_set first.
+ *        Follows the same rules as priorityq_enqueue.
+ * @return False if a chunk couldn't be allocated; the item is then
+ *         not in the queue.
+ */
+PQ_API bool
+priorityq_seg_enqueue(priorityq_seg_t *q, uint32_t index)
+{
+    priority_seg_t *p = seg_at(q, index);
+
+    if (UNLIKELY(p->info[PRIORITY_LOC] == PRIORITY_LOC_DONE)) { return true; }
+
+    if (UNLIKELY(p->chunk))
+    {
+        if (!p->info[PRIORITY_URG] &&
+            (p->info[PRIORITY_LOC] == PRIORITY_LOC_IMED ||
+             p->info[PRIORITY_ABS] >= (p->info[PRIORITY_REL] - (uint8_t)q->pc)))
+        {
+            return true;
+        }
+        if (PRIORITY_LOC_Q == p->info[PRIORITY_LOC])
+        {
+            --q->size_q;
+        }
+        seg_unlink(q, p);
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        --q->size;
+    }
+
+    uint32_t l;
+    if (LIKELY(p->info[PRIORITY_ABS]))
+    {
+        p->info[PRIORITY_REL] = p->info[PRIORITY_ABS] + q->pc;
+        l = PQ_SEG_BINS + priorityq_bin_index(q->pc, p->info[PRIORITY_REL]);
+    }
+    else
+    {
+        p->info[PRIORITY_REL] = q->pc;
+        l = p->info[PRIORITY_URG] ? PQ_SEG_DONE : PQ_SEG_IMED;
+    }
+
+    if (UNLIKELY(!seg_room(q, l)))
+    {
+        return false;
+    }
+
+    if (l >= PQ_SEG_BINS)
+    {
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_Q;
+        q->bin_mask |= (uint8_t)(1 << (l - PQ_SEG_BINS));
+        ++q->size_q;
+    }
+    else
+    {
+        p->info[PRIORITY_LOC] = PQ_SEG_DONE == l ? PRIORITY_LOC_DONE : PRIORITY_LOC_IMED;
+    }
+    seg_push(q, l, index);
+    ++q->size;
+    return true;
+}
+
+/**
+ * @return The index of the next expired item; PQ_SEG_NONE if none,
+ *         or if a chunk couldn't be allocated to advance the queue.
+ */
+PQ_API uint32_t
+priorityq_seg_dequeue(priorityq_seg_t *q)
+{
+    if (LIKELY(q->size))
+    {
+        do
+        {
+            if (UNLIKELY(!seg_advance_immediates(q) || !seg_advance_priority_queue(q)))
+            {
+                return PQ_SEG_NONE;
+            }
+        } while (!q->lists[PQ_SEG_DONE].live);
+
+        uint32_t index = seg_pop(q, PQ_SEG_DONE);
+        seg_at(q, index)->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        --q->size;
+        return index;
+    }
+    else
+    {
+        return PQ_SEG_NONE;
+    }
+}
+
+/**
+ * @brief Stop the item at index by removing it from the queue.
+ */
+PQ_API void
+priorityq_seg_remove(priorityq_seg_t *q, uint32_t index)
+{
+    priority_seg_t *p = seg_at(q, index);
+
+    if (LIKELY(p->chunk))
+    {
+        if (PRIORITY_LOC_Q == p->info[PRIORITY_LOC])
+        {
+            --q->size_q;
+        }
+        seg_unlink(q, p);
+        --q->size;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+    }
+}
+
+
+/*******************************************************************************
+ * Wide Priority Queue Functions
+ *
+ * Generated from the template, one instance per declared width.
+*******************************************************************************/
+
+#define PQW_BITS 16
+#include "priorityq_wide.h"
+
+#define PQW_BITS 32
+#include "priorityq_wide.h"
+
+
+/*******************************************************************************
+ * Concurrent Intake Functions
+*******************************************************************************/
+
+#if PQ_WAIT
+// The system calls, defined in priorityq_wait.c.
+PQ_API void
+priorityq_futex_wake(uint32_t *);
+PQ_API void
+priorityq_fd_signal(int);
+PQ_API void
+priorityq_fd_close(int);
+#endif
+
+PQ_API void
+priorityq_mpsc_init(priorityq_mpsc_t *m)
+{
+    priorityq_init(&m->q);
+    m->intake = NULL;
+    m->waiting = 0;
+    m->notify_fd = -1;
+    list_clear(&m->displaced);
+}
+
+PQ_API void
+priorityq_mpsc_destroy(priorityq_mpsc_t *m)
+{
+    priorityq_destroy(&m->q);
+    m->intake = NULL;
+#if PQ_WAIT
+    if (m->notify_fd >= 0)
+    {
+        priorityq_fd_close(m->notify_fd);
+    }
+#endif
+    m->notify_fd = -1;
+}
+
+/**
+ * @brief Tell the consumer the intake went from empty to non-empty.
+ *
+ * The futex is only woken if the consumer is asleep on it, and the
+ * eventfd only written once set up, so otherwise this is two loads.
+ */
+INLINE static void
+priorityq_mpsc_notify(priorityq_mpsc_t *m)
+{
+#if PQ_WAIT
+    // Pairs with the fence in priorityq_mpsc_dequeue_wait; either the
+    // consumer sees the new intake or we see it waiting.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&m->waiting, 0, __ATOMIC_RELAXED))
+    {
+        priorityq_futex_wake(&m->waiting);
+    }
+
+    int fd = __atomic_load_n(&m->notify_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0)
+    {
+        priorityq_fd_signal(fd);
+    }
+#else
+    (void)m;
+#endif
+}
+
+/**
+ * @return The underlying queue; only the consumer thread may use it.
+ */
+PQ_API priorityq_t *
+priorityq_mpsc_queue(priorityq_mpsc_t *m)
+{
+    return &m->q;
+}
+
+/**
+ * @brief Hand a priority to the consumer; safe to call from any thread.
+ * @warn The priority MUST NOT already be in the queue; reprioritization
+ *       is only available to the consumer through the underlying queue.
+ * @param p - The priority to add.
+ *
+ * The priority is pushed onto a lock-free stack linked through the prev
+ * pointer, so it isn't considered active until the consumer collects it.
+ */
+PQ_API void
+priorityq_mpsc_enqueue(priorityq_mpsc_t *m, priority_t *p)
+{
+    struct priorityq_node_s *n = to_node(p);
+    // Added afresh; a cancel from here on is kept.
+    __atomic_store_n(&p->info[PRIORITY_CANCEL], 0, __ATOMIC_RELAXED);
+    struct priorityq_node_s *head = __atomic_load_n(&m->intake, __ATOMIC_RELAXED);
+    do
+    {
+        n->prev = head;
+    } while (!__atomic_compare_exchange_n(&m->intake, &head, n, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!head)
+    {
+        priorityq_mpsc_notify(m);
+    }
+}
+
+/**
+ * @brief Move everything pushed by producers into the queue.
+ *        Consumer thread only.
+ *
+ * The whole stack is swapped out at once and enqueued in the order it was
+ * pushed. Items displaced by the queue's capacity, see priorityq_enqueue,
+ * are kept for priorityq_mpsc_displaced.
+ */
+PQ_API void
+priorityq_mpsc_collect(priorityq_mpsc_t *m)
+{
+    if (!__atomic_load_n(&m->intake, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    struct priorityq_node_s *n = __atomic_exchange_n(&m->intake, NULL, __ATOMIC_ACQUIRE);
+
+    // Reverse the stack to restore the order the items were pushed in.
+    struct priorityq_node_s *fifo = NULL;
+    while (n)
+    {
+        struct priorityq_node_s *prev = n->prev;
+        n->prev = fifo;
+        fifo = n;
+        n = prev;
+    }
+
+    while (fifo)
+    {
+        struct priorityq_node_s *next = fifo->prev;
+        fifo->prev = NULL;
+        priority_t *d = priorityq_admit(&m->q, to_priority(fifo));
+        if (UNLIKELY(d))
+        {
+            list_nq(&m->displaced, to_node(d));
+        }
+        fifo = next;
+    }
+}
+
+/**
+ * @brief Move the items displaced while collecting to a caller-owned list
+ *        in O(1). Consumer thread only.
+ * @param out - A list head set up with priorityq_list_init.
+ *
+ * Take them with priorityq_list_pop; only then may they be reused.
+ */
+PQ_API void
+priorityq_mpsc_displaced(priorityq_mpsc_t *m, struct priorityq_node_s *out)
+{
+    list_append(out, &m->displaced);
+}
+
+/**
+ * @brief Collect from producers then dequeue. Consumer thread only.
+ * @return The next expired priority; NULL if none.
+ */
+PQ_API priority_t *
+priorityq_mpsc_dequeue(priorityq_mpsc_t *m)
+{
+    priorityq_mpsc_collect(m);
+    return priorityq_dequeue(&m->q);
+}
+
+/**
+ * @brief Collect from producers then dequeue a batch. Consumer thread only.
+ * @return The number of priorities written to out; zero if none.
+ */
+PQ_API uint32_t
+priorityq_mpsc_dequeue_batch(priorityq_mpsc_t *m, priority_t **out, uint32_t max)
+{
+    priorityq_mpsc_collect(m);
+    return priorityq_dequeue_batch(&m->q, out, max);
+}
+
+
+/*******************************************************************************
+ * Sharded Pool Functions
+*******************************************************************************/
+
+INLINE static void
+priorityq_lock(uint32_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+INLINE static bool
+priorityq_trylock(uint32_t *lock)
+{
+    return !__atomic_load_n(lock, __ATOMIC_RELAXED) &&
+           !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+INLINE static void
+priorityq_unlock(uint32_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Move the front half of the done queue, or failing that the
+ *        immediate queue, from src to dst.
+ * @return The number of items moved.
+ *
+ * Both lists are FIFO and nothing is ever inserted before their heads,
+ * so the thief receives the items src would have handed out next.
+ */
+INLINE static uint32_t
+priorityq_steal(priorityq_t *dst, priorityq_t *src)
+{
+    uint32_t k;
+
+    if (src->size_done)
+    {
+        k = (src->size_done + 1) >> 1;
+        list_move_front(&dst->done, &src->done, k);
+        src->size_done -= k;
+        dst->size_done += k;
+    }
+    else if (src->size_imed)
+    {
+        k = (src->size_imed + 1) >> 1;
+        list_move_front(&dst->immediate, &src->immediate, k);
+        src->size_imed -= k;
+        dst->size_imed += k;
+    }
+    else
+    {
+        return 0;
+    }
+
+    src->size -= k;
+    dst->size += k;
+
+    return k;
+}
+
+/**
+ * @param shards - Storage for the shards, aligned to PQ_CACHE_LINE.
+ * @param count - The number of shards; MUST NOT be zero.
+ */
+PQ_API void
+priorityq_pool_init(priorityq_pool_t *pool, priorityq_shard_t *shards, uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+    {
+        priorityq_init(&shards[i].q);
+        shards[i].lock = 0;
+    }
+    pool->shards = shards;
+    pool->count = count;
+}
+
+PQ_API void
+priorityq_pool_destroy(priorityq_pool_t *pool)
+{
+    uint32_t i;
+    for (i = 0; i < pool->count; ++i)
+    {
+        priorityq_destroy(&pool->shards[i].q);
+    }
+    (*pool) = (const priorityq_pool_t){ 0 };
+}
+
+/**
+ * @return The number of priorities across all shards at the time each
+ *         shard was visited.
+ */
+PQ_API uint32_t
+priorityq_pool_size(priorityq_pool_t *pool)
+{
+    uint32_t size = 0;
+    uint32_t i;
+    for (i = 0; i < pool->count; ++i)
+    {
+        priorityq_shard_t *shard = pool->shards + i;
+        priorityq_lock(&shard->lock);
+        size += shard->q.size;
+        priorityq_unlock(&shard->lock);
+    }
+    return size;
+}
+
+/**
+ * @brief Add the priority to a shard; safe to call from any thread.
+ * @param index - The shard to add to, usually the caller's own.
+ *
+ * @return What priorityq_enqueue returns for the shard.
+ *
+ * The same rules as priorityq_enqueue apply.
+ * Reprioritizing MUST target the shard the priority is in,
+ * and stolen priorities change shards.
+ */
+PQ_API priority_t *
+priorityq_pool_enqueue(priorityq_pool_t *pool, uint32_t index, priority_t *p)
+{
+    priorityq_shard_t *shard = pool->shards + index;
+    priorityq_lock(&shard->lock);
+    priority_t *d = priorityq_enqueue(&shard->q, p);
+    priorityq_unlock(&shard->lock);
+    return d;
+}
+
+/**
+ * @brief Dequeue from a shard, stealing from the others when it is empty.
+ * @param index - The shard to dequeue from, usually the caller's own.
+ * @return The next expired priority; NULL if none found.
+ *
+ * Victims are visited in order after the empty shard and are never waited
+ * on; a busy victim is skipped.
+ * A victim with nothing ready gives up the single item it would dequeue.
+ */
+PQ_API priority_t *
+priorityq_pool_dequeue(priorityq_pool_t *pool, uint32_t index)
+{
+    priorityq_shard_t *self = pool->shards + index;
+    priority_t *p;
+
+    priorityq_lock(&self->lock);
+    p = priorityq_dequeue(&self->q);
+
+    uint32_t i;
+    for (i = 1; !p && i < pool->count; ++i)
+    {
+        priorityq_shard_t *victim = pool->shards + ((index + i) % pool->count);
+        if (priorityq_trylock(&victim->lock))
+        {
+            if (priorityq_steal(&self->q, &victim->q))
+            {
+                p = priorityq_dequeue(&self->q);
+            }
+            else
+            {
+                p = priorityq_dequeue(&victim->q);
+            }
+            priorityq_unlock(&victim->lock);
+        }
+    }
+
+    priorityq_unlock(&self->lock);
+
+    return p;
+}
+
+
+/*******************************************************************************
+ * Hierarchical Scheduler Functions
+*******************************************************************************/
+
+/**
+ * @param weight - The tenant's share; a tenant is due again 127 / weight
+ *                 steps of the scheduler's counter after being served, so
+ *                 weights of 64 and up are all served as often as possible.
+ *                 Zero is taken as one.
+ *
+ * Heavier tenants are always served more often, but since the counter
+ * skips ahead when nothing is due the shares are only roughly in
+ * proportion to the weights.
+ */
+PQ_API void
+priorityq_tenant_init(priorityq_tenant_t *t, uint8_t weight)
+{
+    uint8_t period = (uint8_t)(PQ_MASK / (weight ? weight : 1));
+    priority_init(&t->p);
+    priority_set(&t->p, t, period ? period : 1);
+    priorityq_init(&t->q);
+}
+
+/**
+ * The tenant MUST NOT be in a scheduler!!!
+ */
+PQ_API void
+priorityq_tenant_destroy(priorityq_tenant_t *t)
+{
+    priorityq_destroy(&t->q);
+    priority_destroy(&t->p);
+}
+
+/**
+ * @return The tenant's own queue.
+ *
+ * Anything but adding items may be done on it directly, e.g. removing,
+ * updating or evicting. Items added directly don't schedule the tenant.
+ */
+PQ_API priorityq_t *
+priorityq_tenant_queue(priorityq_tenant_t *t)
+{
+    return &t->q;
+}
+
+PQ_API void
+priorityq_sched_init(priorityq_sched_t *s)
+{
+    priorityq_init(&s->q);
+}
+
+PQ_API void
+priorityq_sched_destroy(priorityq_sched_t *s)
+{
+    priorityq_destroy(&s->q);
+}
+
+/**
+ * @return The number of tenants waiting to be served.
+ */
+PQ_API uint32_t
+priorityq_sched_tenants(priorityq_sched_t *s)
+{
+    return s->q.size;
+}
+
+/**
+ * @brief Add the priority to the tenant's queue and schedule the tenant.
+ * @return What priorityq_enqueue returns for the tenant's queue.
+ *
+ * The same rules as priorityq_enqueue apply.
+ */
+PQ_API priority_t *
+priorityq_sched_enqueue(priorityq_sched_t *s, priorityq_tenant_t *t, priority_t *p)
+{
+    priority_t *displaced = priorityq_enqueue(&t->q, p);
+    if (!priority_is_active(&t->p) && t->q.size)
+    {
+        priorityq_enqueue(&s->q, &t->p);
+    }
+    return displaced;
+}
+
+/**
+ * @brief Dequeue from the next tenant due, in O(1) amortized.
+ * @return The tenant's next expired priority; NULL if none.
+ *
+ * The tenant is put back, due again after its period, only while it has
+ * items. A tenant emptied behind the scheduler's back, e.g. by removes or
+ * cancels, is dropped when it next comes up.
+ */
+PQ_API priority_t *
+priorityq_sched_dequeue(priorityq_sched_t *s)
+{
+    priority_t *tp;
+    while ((tp = priorityq_dequeue(&s->q)))
+    {
+        priorityq_tenant_t *t = (priorityq_tenant_t *)priority_data(tp);
+        priority_t *p = priorityq_dequeue(&t->q);
+        if (t->q.size)
+        {
+            priorityq_enqueue(&s->q, tp);
+        }
+        if (p)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Timed Priority Queue Functions
+ *
+ * The timer bins by the highest bit where an item's start differs from
+ * now, as the queue does with its counter. Since start is later than now,
+ * that bit is set in start and clear in now. Advancing to a new time only
+ * disturbs the bins at or below the highest bit that changed; their items
+ * are either due or move to a lower bin, so each is re-binned at most
+ * once per bit over its wait.
+*******************************************************************************/
+
+INLINE static priority_timed_t *
+to_timed(struct priorityq_node_s *n)
+{
+    return (priority_timed_t *)to_priority(n);
+}
+
+/**
+ * The start MUST be later than now!!!
+ */
+INLINE static void
+timer_wait(priorityq_timer_t *t, priority_timed_t *pt)
+{
+    int index = get_high_index64(pt->start ^ t->now);
+    list_nq(t->bins + index, &pt->p.node);
+    t->bin_mask |= (uint64_t)1 << index;
+    pt->p.info[PRIORITY_LOC] = PRIORITY_LOC_TIMER;
+}
+
+/**
+ * @brief Unlink a waiting item.
+ *        Clears the bin's bit in the mask if the bin is left empty.
+ */
+INLINE static void
+timer_unlink(priorityq_timer_t *t, priority_timed_t *pt)
+{
+    struct priorityq_node_s *n = &pt->p.node;
+    node_unlink_only(n);
+    if (n->prev == n->next)
+    {
+        t->bin_mask &= ~((uint64_t)1 << (n->prev - t->bins));
+    }
+    node_clear(n);
+    pt->p.info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+}
+
+/**
+ * @brief Queue the item at its own priority, or urgent for this release
+ *        only if its deadline passed.
+ */
+INLINE static priority_t *
+timer_release(priorityq_timer_t *t, priority_timed_t *pt)
+{
+    info_set(pt->p.info, t->now >= pt->deadline ? PRIORITY_URGENT : pt->priority);
+    return priorityq_admit(&t->q, &pt->p);
+}
+
+PQ_API void
+priority_timed_init(priority_timed_t *pt)
+{
+    priority_init(&pt->p);
+    pt->start = 0;
+    pt->deadline = PQ_TIMER_NEVER;
+    pt->priority = 0;
+}
+
+/**
+ * @param start - Not before this time; now or earlier to be ready at once.
+ * @param deadline - Enter the queue as urgent if not released by then;
+ *                   PQ_TIMER_NEVER for none.
+ *
+ * Only change a scheduled item's times right before scheduling it again.
+ * The priority is kept apart from the queue's, so a release past the
+ * deadline doesn't lose it; the next release queues at it again.
+ */
+PQ_API void
+priority_timed_set(priority_timed_t *pt, void *data, uint8_t priority, uint64_t start, uint64_t deadline)
+{
+    priority_set(&pt->p, data, priority);
+    pt->priority = priority;
+    pt->start = start;
+    pt->deadline = deadline;
+}
+
+PQ_API void
+priorityq_timer_init(priorityq_timer_t *t, uint64_t now)
+{
+    priorityq_init(&t->q);
+    t->now = now;
+    t->bin_mask = 0;
+    t->size_waiting = 0;
+    lists_clear(t->bins, PQ_TIMER_BINS);
+}
+
+PQ_API void
+priorityq_timer_destroy(priorityq_timer_t *t)
+{
+    priorityq_destroy(&t->q);
+    (*t) = (const priorityq_timer_t){ 0 };
+}
+
+/**
+ * @return The queue of ready items.
+ *
+ * Anything but adding items may be done on it directly, as long as
+ * everything in it is a priority_timed_t when dequeued through the timer.
+ * Waiting items MUST be removed through priorityq_timer_remove.
+ */
+PQ_API priorityq_t *
+priorityq_timer_queue(priorityq_timer_t *t)
+{
+    return &t->q;
+}
+
+/**
+ * @return The number of items waiting for their start time.
+ */
+PQ_API uint32_t
+priorityq_timer_waiting(priorityq_timer_t *t)
+{
+    return t->size_waiting;
+}
+
+/**
+ * @return A time before which advancing releases nothing; PQ_TIMER_NEVER
+ *         if nothing is waiting. Good for how long to sleep.
+ */
+PQ_API uint64_t
+priorityq_timer_next(priorityq_timer_t *t)
+{
+    if (!t->bin_mask)
+    {
+        return PQ_TIMER_NEVER;
+    }
+    // The lowest bin's items agree with now above its bit and have it set.
+    int index = get_low_index64(t->bin_mask);
+    return ((t->now >> index) | 1) << index;
+}
+
+/**
+ * @brief Add or reschedule the item: it waits if its start is later than
+ *        the timer's time, otherwise it enters the queue right away.
+ * @return What priorityq_enqueue returns if the item entered the queue.
+ *
+ * A queued item that is rescheduled to start later goes back to waiting.
+ * A waiting or queued item keeps its cancel, a new one starts without it.
+ */
+PQ_API priority_t *
+priorityq_timer_schedule(priorityq_timer_t *t, priority_timed_t *pt)
+{
+    if (PRIORITY_LOC_TIMER == pt->p.info[PRIORITY_LOC])
+    {
+        timer_unlink(t, pt);
+        --t->size_waiting;
+    }
+    else
+    {
+        priorityq_fresh(&pt->p);
+    }
+
+    if (pt->start > t->now)
+    {
+        if (priority_is_active(&pt->p))
+        {
+            priorityq_remove(&t->q, &pt->p);
+        }
+        timer_wait(t, pt);
+        ++t->size_waiting;
+        return NULL;
+    }
+
+    return timer_release(t, pt);
+}
+
+/**
+ * @brief Move the timer to now and release the items that are due into
+ *        the queue, earliest bins first.
+ * @param displaced - If not NULL, a list that gets the items displaced by
+ *                    the queue's capacity, see priorityq_list_pop.
+ * @return The number of items released.
+ *
+ * Time doesn't go backwards, an earlier now does nothing.
+ * Due items cancelled while waiting are buried instead of released.
+ */
+PQ_API uint32_t
+priorityq_timer_advance(priorityq_timer_t *t, uint64_t now, struct priorityq_node_s *displaced)
+{
+    if (now <= t->now)
+    {
+        return 0;
+    }
+
+    int top = get_high_index64(now ^ t->now);
+    // Wraps to all ones when the top bit changed.
+    uint64_t affected = t->bin_mask & (((uint64_t)2 << top) - 1);
+    t->bin_mask &= ~affected;
+    t->now = now;
+
+    struct priorityq_node_s pending;
+    list_clear(&pending);
+    while (affected)
+    {
+        list_append(&pending, t->bins + get_low_index64(affected));
+        affected &= affected - 1;
+    }
+
+    uint32_t released = 0;
+    while (list_has(&pending))
+    {
+        struct priorityq_node_s *n = list_dq_quick(&pending);
+        priority_timed_t *pt = to_timed(n);
+        node_clear(n);
+        if (pt->start > now)
+        {
+            timer_wait(t, pt);
+            continue;
+        }
+
+        pt->p.info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        --t->size_waiting;
+        if (priorityq_cancelled(&pt->p))
+        {
+            priorityq_bury(&t->q, n);
+            continue;
+        }
+        ++released;
+        priority_t *d = timer_release(t, pt);
+        if (d && displaced)
+        {
+            list_nq(displaced, &d->node);
+        }
+    }
+
+    return released;
+}
+
+/**
+ * @return The next expired item of the queue; NULL if none.
+ */
+PQ_API priority_timed_t *
+priorityq_timer_dequeue(priorityq_timer_t *t)
+{
+    return (priority_timed_t *)priorityq_dequeue(&t->q);
+}
+
+/**
+ * @brief Stop the item, whether waiting or queued.
+ */
+PQ_API void
+priorityq_timer_remove(priorityq_timer_t *t, priority_timed_t *pt)
+{
+    if (PRIORITY_LOC_TIMER == pt->p.info[PRIORITY_LOC])
+    {
+        timer_unlink(t, pt);
+        --t->size_waiting;
+    }
+    else
+    {
+        priorityq_remove(&t->q, &pt->p);
+    }
+}
+
+
+/*******************************************************************************
+ * Priority Queue Functions (Testing)
+*******************************************************************************/
+
+PQ_API uint8_t
+priorityq_priority_counter(priorityq_t *q)
+{
+    return q->pc;
+}
+
+/**
+ * @return The mask of non-empty bins.
+ */
+PQ_API uint8_t
+priorityq_bin_mask(priorityq_t *q)
+{
+    return q->bin_mask;
 }
 
 /**
@@ -670,7 +3830,7 @@ priorityq_priority_counter(priorityq_t *q)
  * @param index - The index of the bin to count.
  * @return The count of items in the specified bin; zero on invalid bin.
  */
-uint32_t
+PQ_API uint32_t
 priorityq_count_bin(priorityq_t *q, uint32_t index)
 {
     return list_count((q->bins) + ((PQ_BINS - 1) & index));
@@ -679,7 +3839,7 @@ priorityq_count_bin(priorityq_t *q, uint32_t index)
 /**
  * @return The count of all priorities in the datastructure, excluding expired.
  */
-uint32_t
+PQ_API uint32_t
 priorityq_count_all(priorityq_t *q)
 {
     uint32_t count = 0;
@@ -700,7 +3860,7 @@ priorityq_count_all(priorityq_t *q)
 /**
  * @return The count of all items in the immediate list.
  */
-uint32_t
+PQ_API uint32_t
 priorityq_count_immediate(priorityq_t *q)
 {
     return list_count(&q->immediate);
@@ -709,7 +3869,7 @@ priorityq_count_immediate(priorityq_t *q)
 /**
  * @return The count of all items in the done list.
  */
-uint32_t
+PQ_API uint32_t
 priorityq_count_done(priorityq_t *q)
 {
     return list_count(&q->done);
@@ -718,7 +3878,7 @@ priorityq_count_done(priorityq_t *q)
 /**
  * @return The count of all items in the queue.
  */
-uint32_t
+PQ_API uint32_t
 priorityq_count_q(priorityq_t *q)
 {
     uint32_t count = 0;
@@ -734,25 +3894,25 @@ priorityq_count_q(priorityq_t *q)
     return count;
 }
 
-uint32_t
+PQ_API uint32_t
 priorityq_size_immediate(priorityq_t *q)
 {
     return q->size_imed;
 }
 
-uint32_t
+PQ_API uint32_t
 priorityq_size_done(priorityq_t *q)
 {
     return q->size_done;
 }
 
-uint32_t
+PQ_API uint32_t
 priorityq_size_q(priorityq_t *q)
 {
     return q->size_q;
 }
 
-uint32_t
+PQ_API uint32_t
 priorityq_upper_bit(uint8_t n)
 {
     return get_high_index32(n);
@@ -762,7 +3922,7 @@ priorityq_upper_bit(uint8_t n)
 /**
  * Dumps the bin counts to stdout.
  */
-void
+PQ_API void
 priorityq_dump_stats(priorityq_t *q)
 {
     printf("PRIORITY COUNTER: %u\n"
@@ -802,7 +3962,7 @@ priority_loc_str(priority_t *p)
 /**
  * Dumps the priority data to stdout.
  */
-void
+PQ_API void
 priority_dump_stats(priority_t *p)
 {
     printf("PRIORITY: %u\n"
@@ -0,0 +1,171 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file priorityq_bits.h
+ * @author Craig Jacobson
+ * @brief Counter and bin arithmetic template, shared by every queue.
+ *
+ * Included by priorityq.c for the 8-bit queues and by priorityq_wide.h for
+ * each wide one, with PQB_BITS and PQB_FN(name) defined; PQB_BITS bins
+ * follow a PQB_BITS wide counter. These two functions are all of the
+ * algorithm that doesn't depend on how an engine stores its lists.
+ * The casts keep the arithmetic in PQB_BITS when it is narrower than int.
+ * No include guard on purpose.
+ */
+
+#if !defined(PQB_BITS) || !defined(PQB_FN)
+#error "Define PQB_BITS and PQB_FN before including priorityq_bits.h"
+#endif
+
+#define PQB_CAT_(a, b, c) a##b##c
+#define PQB_CAT(a, b, c) PQB_CAT_(a, b, c)
+#define PQB_UINT PQB_CAT(uint, PQB_BITS, _t)
+// All but the leading bit.
+#define PQB_MASK ((PQB_UINT)(((uint32_t)1 << (PQB_BITS - 1)) - 1))
+
+
+/**
+ * @param pc - The priority counter.
+ * @param rp - The relative priority; MUST NOT equal the priority counter.
+ * @return The index of the bin the relative priority belongs in.
+ */
+INLINE static int
+PQB_FN(bin_index)(PQB_UINT pc, PQB_UINT rp)
+{
+    // This block adds overflow detection to better distribute priorities.
+    // Without this the priorities crossing the overflow boundary all
+    // get placed in the last bucket.
+    // While that behavior doesn't hurst overall complexity, it can cause
+    // a bit of a pause when advancing the queue and the urgent and immediate
+    // queues are empty.
+    // WARNING: This only really works in conjunction with the changes
+    // in counter_step below!!!
+    //
+    // pc = priority counter
+    // rp = relative priority of p
+    // nrp = rp less one
+    PQB_UINT nrp = (PQB_UINT)(rp - 1);
+    // The condition is that the upper bit of pc is a '1' and rp is a '0'.
+    // Also, rp CANNOT be zero.
+    // This doesn't work because rp can be zero: !((~PQB_MASK) & (pc & ~rp))
+    int index;
+    if (nrp >= pc)
+    {
+        // Not an overflow situation.
+        // Original code (fall back to just this if this doesn't work).
+        //
+        // HOW THIS WORKS:
+        // Since a priority is greater than the priority counter
+        // we have a know fact that must be true:
+        // the priority's leading differing bit is a '1', and the counter's
+        // in the same position is a '0'.
+        // When the counter flips that bit, we do so precisely.
+        // This means that eventually that bit is the same:
+        // pc = nnnn 1zzz
+        // rp = nnnn 1mmm
+        // So the n's are identical and the bits to the right in the counter
+        // are guaranteed to be zero.
+        // This means that we can just count the '1' bits to the right of
+        // a differing bit of the relative priority to know how many different
+        // bins it will be sorted into over the course of it's life.
+        // If z = m, then we're to be prioritized and sent out of the queue.
+        // If z != m, then the next bin is the next differing bit.
+        // Because of the progression of the counter, we know that it is
+        // less than or equal to any active priority.
+        // This is how we progress priorities up through the queues.
+        index = get_high_index32((uint32_t)(rp ^ pc));
+    }
+    else
+    {
+        // We are wrapping around! This is the overflow situation.
+        //
+        // HOW THIS WORKS:
+        // Preconditions: pc > rp, rp != 0
+        // pc = 1nnn zmmm
+        // rp = 0xxx yyyy
+        // Let z be the FIRST zero somewhere after the leading '1' (or no zeros).
+        // n are the bits to the left of z.
+        // m are bits we don't care about.
+        // y are bits we don't care about to be masked out by zmmm.
+        // By repeated ANDing and bit shifting we turn everything to zeros
+        // after the FIRST zero z.
+        // This gives ones left of z and zeros to the right:
+        // pc = 1111 z000
+        // The bin to place p into is then the highest bit in the x's in rp
+        // that overlaps the ones in pc.
+        // This ONLY WORKS because we don't trigger bins corresponding to bits
+        // flipping from '1' to '0', just bits flipping from '0' to '1'.
+        // With the exception of the leading bit so we can take advantage of
+        // overflow to keep this queue going indefinitely.
+        //
+        // Since rp < pc the x's can only hold ones where pc does, so the
+        // highest bit of rp & pc is that bin without building the mask.
+        // When no bits overlap only the leading bit differs, so wait for
+        // the counter to wrap around in the last bin.
+        PQB_UINT overlap = (PQB_UINT)(rp & pc);
+        index = overlap ? get_high_index32(overlap) : (PQB_BITS - 1);
+    }
+    return index;
+}
+
+/**
+ * @param pc - The priority counter.
+ * @param mask - The mask of non-empty bins.
+ * @param newpc - Receives the advanced priority counter.
+ * @return The mask of bins triggered by the advance.
+ */
+INLINE static PQB_UINT
+PQB_FN(counter_step)(PQB_UINT pc, PQB_UINT mask, PQB_UINT *newpc)
+{
+    // Find the first non-empty bin whose bit is clear in the counter.
+    // The last bin is the fall back and is used even when empty.
+    PQB_UINT ready = (PQB_UINT)(mask & ~pc & PQB_MASK);
+    int index = ready ? get_low_index32(ready) : (PQB_BITS - 1);
+    PQB_UINT msb = (PQB_UINT)((PQB_UINT)1 << index);
+
+    PQB_UINT next = (PQB_UINT)((pc | (PQB_UINT)(msb - 1)) + 1);
+
+    // WARNING: The following line of code are the changes referenced in
+    // bin_index above!!!!
+    // Since relative priorities are always greater than the priority counter,
+    // the leading bit of ANY relative priority is set to 1 and the counter to 0.
+    // The EXCEPTION is when we have wrap around, the leading bit can be a 1
+    // in the counter and a zero in anything else.
+    // Given the bits zxxx xxxx, we can ignore 1 -> 0 transitions in x's
+    // as the counter's progression will NEVER trigger a bin; the z bit is the
+    // exception.
+    // Previous code (also works, just trying to reduce pointer checks):
+    // PQB_UINT bits = (newpc ^ q->pc) >> 1;
+    PQB_UINT bits = (PQB_UINT)((~PQB_MASK & (pc ^ next)) | (PQB_MASK & (~pc & next)));
+
+    // No matter how we advance, the selected bin is getting triggered.
+    *newpc = next;
+    return (PQB_UINT)(bits | msb);
+}
+
+
+#undef PQB_CAT_
+#undef PQB_CAT
+#undef PQB_UINT
+#undef PQB_MASK
+#undef PQB_FN
+#undef PQB_BITS
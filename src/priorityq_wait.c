@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file priorityq_wait.c
+ * @author Craig Jacobson
+ * @brief Blocking waits for the concurrent intake on Linux.
+ *
+ * Kept apart so the futex, eventfd and clock calls get the feature-test
+ * macro they need before any system header, while the rest of the library
+ * stays plain C11. Compiled only when PQ_WAIT is set, see priorityq.h.
+ */
+
+#ifdef PRIORITYQ_HEADER_ONLY
+#   if !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#       error "Define _GNU_SOURCE before any system header for PQ_WAIT header-only."
+#   endif
+#elif !defined(_GNU_SOURCE)
+#   define _GNU_SOURCE
+#endif
+
+#include "priorityq.h"
+
+#if PQ_WAIT
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*******************************************************************************
+ * System Calls
+*******************************************************************************/
+
+PQ_API void
+priorityq_futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+PQ_API void
+priorityq_fd_signal(int fd)
+{
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+}
+
+PQ_API void
+priorityq_fd_close(int fd)
+{
+    close(fd);
+}
+
+
+/*******************************************************************************
+ * Concurrent Intake Waits
+*******************************************************************************/
+
+INLINE static int64_t
+priorityq_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Dequeue, sleeping on a futex while there is nothing to take.
+ *        Consumer thread only.
+ * @param timeout_ns - How long to wait at most; negative waits forever and
+ *                     zero doesn't wait at all.
+ * @return The next expired priority; NULL if nothing came in time.
+ *
+ * Producers only make the wake-up call when the intake goes from empty to
+ * non-empty while the consumer is asleep, so it costs them nothing
+ * otherwise.
+ */
+PQ_API priority_t *
+priorityq_mpsc_dequeue_wait(priorityq_mpsc_t *m, int64_t timeout_ns)
+{
+    priority_t *p = priorityq_mpsc_dequeue(m);
+    if (p || !timeout_ns)
+    {
+        return p;
+    }
+
+    int64_t deadline = timeout_ns > 0 ? priorityq_now_ns() + timeout_ns : 0;
+    for (;;)
+    {
+        struct timespec ts;
+        struct timespec *wait = NULL;
+        if (deadline)
+        {
+            int64_t left = deadline - priorityq_now_ns();
+            if (left <= 0)
+            {
+                return NULL;
+            }
+            ts.tv_sec = left / 1000000000;
+            ts.tv_nsec = left % 1000000000;
+            wait = &ts;
+        }
+
+        __atomic_store_n(&m->waiting, 1, __ATOMIC_RELAXED);
+        // Pairs with the fence in priorityq_mpsc_notify.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&m->intake, __ATOMIC_RELAXED))
+        {
+            // Returns at once if a producer already cleared the flag.
+            syscall(SYS_futex, &m->waiting, FUTEX_WAIT_PRIVATE, 1, wait, NULL, 0);
+        }
+        __atomic_store_n(&m->waiting, 0, __ATOMIC_RELAXED);
+
+        p = priorityq_mpsc_dequeue(m);
+        if (p)
+        {
+            return p;
+        }
+    }
+}
+
+/**
+ * @brief Get a descriptor for epoll or io_uring that becomes readable when
+ *        producers add items. Consumer thread only.
+ * @return An eventfd, created on first use and closed by destroy;
+ *         -1 if it couldn't be created.
+ *
+ * It is written each time the intake goes from empty to non-empty.
+ * After it fires, read it to reset it and dequeue until NULL; items left
+ * behind won't fire it again.
+ */
+PQ_API int
+priorityq_mpsc_notify_fd(priorityq_mpsc_t *m)
+{
+    if (m->notify_fd < 0)
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        __atomic_store_n(&m->notify_fd, fd, __ATOMIC_SEQ_CST);
+        if (fd >= 0 && __atomic_load_n(&m->intake, __ATOMIC_SEQ_CST))
+        {
+            // Items pushed before the descriptor existed.
+            priorityq_fd_signal(fd);
+        }
+    }
+    return m->notify_fd;
+}
+
+#endif
@@ -0,0 +1,416 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file priorityq_wide.h
+ * @author Craig Jacobson
+ * @brief Wide priority queue implementation template.
+ *
+ * Included by priorityq.c once per width with PQW_BITS defined, after the
+ * helpers it shares with priorityq_t.
+ * This is the same algorithm as priorityq_t with a PQW_BITS wide counter
+ * and PQW_BITS bins; bin_index and counter_step come from priorityq_bits.h,
+ * see there for how the counter and bins interact.
+ * No include guard on purpose.
+ */
+
+#ifndef PQW_BITS
+#error "Define PQW_BITS before including priorityq_wide.h"
+#endif
+
+#define PQW_CAT_(a, b, c) a##b##c
+#define PQW_CAT(a, b, c) PQW_CAT_(a, b, c)
+#define PQW_UINT PQW_CAT(uint, PQW_BITS, _t)
+#define PQW_P PQW_CAT(priority, PQW_BITS, _t)
+#define PQW_Q PQW_CAT(priorityq, PQW_BITS, _t)
+#define PQW_PFN(name) PQW_CAT(priority, PQW_BITS, _##name)
+#define PQW_QFN(name) PQW_CAT(priorityq, PQW_BITS, _##name)
+#define PQW_URGENT ((PQW_UINT)PQ_WIDE_CEILING(PQW_BITS))
+
+// The counter and bin arithmetic is generated from the same template as
+// priorityq_t's.
+#define PQB_BITS PQW_BITS
+#define PQB_FN(name) PQW_QFN(name)
+#include "priorityq_bits.h"
+
+
+/*******************************************************************************
+ * Wide Priority Functions
+*******************************************************************************/
+
+INLINE static struct priorityq_node_s *
+PQW_PFN(to_node)(PQW_P *p)
+{
+    return &p->node;
+}
+
+INLINE static PQW_P *
+PQW_PFN(from_node)(struct priorityq_node_s *n)
+{
+    return recover_ptr(n, PQW_P, node);
+}
+
+PQ_API void
+PQW_PFN(init)(PQW_P *p)
+{
+    (*p) = (const PQW_P){ 0 };
+}
+
+PQ_API void
+PQW_PFN(destroy)(PQW_P *p)
+{
+    (*p) = (const PQW_P){ 0 };
+}
+
+PQ_API void
+PQW_PFN(set)(PQW_P *p, void *data, PQW_UINT priority)
+{
+    p->data = data;
+    if (LIKELY(PQW_URGENT != priority))
+    {
+        p->info[PRIORITY_ABS] = priority;
+        p->info[PRIORITY_URG] = 0;
+    }
+    else
+    {
+        p->info[PRIORITY_ABS] = 0;
+        p->info[PRIORITY_URG] = 1;
+    }
+}
+
+PQ_API PQW_UINT
+PQW_PFN(value)(PQW_P *p)
+{
+    return p->info[PRIORITY_ABS];
+}
+
+PQ_API void *
+PQW_PFN(data)(PQW_P *p)
+{
+    return p->data;
+}
+
+PQ_API bool
+PQW_PFN(is_active)(PQW_P *p)
+{
+    return node_in_list(PQW_PFN(to_node)(p));
+}
+
+
+/*******************************************************************************
+ * Wide Priority Queue Functions (Internal)
+*******************************************************************************/
+
+INLINE static void
+PQW_QFN(decrement_queue)(PQW_Q *q, PQW_P *p)
+{
+    int loc = p->info[PRIORITY_LOC];
+    if (PRIORITY_LOC_DONE == loc)
+    {
+        --q->size_done;
+    }
+    else if (PRIORITY_LOC_IMED == loc)
+    {
+        --q->size_imed;
+    }
+    else // PRIORITY_LOC_Q == loc
+    {
+        --q->size_q;
+    }
+}
+
+INLINE static void
+PQW_QFN(nq_only)(PQW_Q *q, PQW_P *p)
+{
+    int index = PQW_QFN(bin_index)(q->pc, p->info[PRIORITY_REL]);
+    list_nq(q->bins + index, PQW_PFN(to_node)(p));
+    q->bin_mask |= (PQW_UINT)((PQW_UINT)1 << index);
+}
+
+INLINE static void
+PQW_QFN(unlink_q)(PQW_Q *q, struct priorityq_node_s *n)
+{
+    node_unlink_only(n);
+
+    struct priorityq_node_s *l = n->prev;
+    if (l == n->next)
+    {
+        uintptr_t offset = (uintptr_t)l - (uintptr_t)q->bins;
+        if (offset < sizeof(q->bins))
+        {
+            q->bin_mask &= (PQW_UINT)~((PQW_UINT)1 << (offset / sizeof(*l)));
+        }
+    }
+}
+
+INLINE static void
+PQW_QFN(advance_priority_counter)(PQW_Q *q)
+{
+    PQW_UINT mask = q->bin_mask;
+    PQW_UINT newpc;
+    PQW_UINT bits = PQW_QFN(counter_step)(q->pc, mask, &newpc);
+
+    PQW_UINT triggered = (PQW_UINT)(bits & mask);
+    while (triggered)
+    {
+        list_append(&q->processing, q->bins + get_low_index32(triggered));
+        triggered &= (PQW_UINT)(triggered - 1);
+    }
+
+    q->bin_mask = (PQW_UINT)(mask & ~bits);
+    q->pc = newpc;
+}
+
+INLINE static void
+PQW_QFN(advance_immediates)(PQW_Q *q)
+{
+    uint32_t count = priorityq_immediate_step(&q->counter_imed, q->size_imed, q->size_done, PQ_RATE_DEFAULT);
+    while (count--)
+    {
+        struct priorityq_node_s *n = list_dq_quick(&q->immediate);
+        PQW_PFN(from_node)(n)->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        list_nq(&q->done, n);
+        --q->size_imed;
+        ++q->size_done;
+    }
+}
+
+INLINE static void
+PQW_QFN(prefetch_processing)(PQW_Q *q)
+{
+    struct priorityq_node_s *n = q->processing.next;
+    PREFETCH(n->next, 0);
+
+    PQW_UINT rp = PQW_PFN(from_node)(n)->info[PRIORITY_REL];
+    if (LIKELY(rp != q->pc))
+    {
+        PREFETCH(q->bins[PQW_QFN(bin_index)(q->pc, rp)].prev, 1);
+    }
+}
+
+INLINE static void
+PQW_QFN(advance_priority_queue)(PQW_Q *q)
+{
+    if (q->size_q)
+    {
+        if (list_has(&q->processing))
+        {
+            uint32_t limit_q = get_high_index32(q->size_q) + 1;
+            bool prefetch = q->size_q >= PQ_PREFETCH_MIN;
+            do
+            {
+                PQW_P *p = PQW_PFN(from_node)(list_dq_quick(&q->processing));
+                if (prefetch && list_has(&q->processing))
+                {
+                    PQW_QFN(prefetch_processing)(q);
+                }
+                if (LIKELY(p->info[PRIORITY_REL] != q->pc))
+                {
+                    PQW_QFN(nq_only)(q, p);
+                }
+                else
+                {
+                    p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+                    --q->size_q;
+                    ++q->size_imed;
+                    list_nq(&q->immediate, PQW_PFN(to_node)(p));
+                }
+            } while (--limit_q && list_has(&q->processing));
+        }
+        else
+        {
+            PQW_QFN(advance_priority_counter)(q);
+        }
+    }
+}
+
+INLINE static void
+PQW_QFN(advance_step)(PQW_Q *q)
+{
+    PQW_QFN(advance_immediates)(q);
+    PQW_QFN(advance_priority_queue)(q);
+}
+
+
+/*******************************************************************************
+ * Wide Priority Queue Functions
+*******************************************************************************/
+
+PQ_API void
+PQW_QFN(init)(PQW_Q *q)
+{
+    (*q) = (const PQW_Q){ 0 };
+    list_clear(&q->done);
+    list_clear(&q->immediate);
+    list_clear(&q->processing);
+    lists_clear(q->bins, PQW_BITS);
+}
+
+PQ_API void
+PQW_QFN(destroy)(PQW_Q *q)
+{
+    (*q) = (const PQW_Q){ 0 };
+}
+
+PQ_API uint32_t
+PQW_QFN(size)(PQW_Q *q)
+{
+    return q->size;
+}
+
+/**
+ * @see priorityq_enqueue
+ */
+PQ_API void
+PQW_QFN(enqueue)(PQW_Q *q, PQW_P *p)
+{
+    struct priorityq_node_s *n = PQW_PFN(to_node)(p);
+
+    if (UNLIKELY(p->info[PRIORITY_LOC] == PRIORITY_LOC_DONE)) { return; }
+
+    if (UNLIKELY(node_in_list(n)))
+    {
+        if (p->info[PRIORITY_URG])
+        {
+            if (PRIORITY_LOC_IMED == p->info[PRIORITY_LOC])
+            {
+                node_unlink_only(n);
+                --q->size_imed;
+            }
+            else
+            {
+                PQW_QFN(unlink_q)(q, n);
+                --q->size_q;
+            }
+            list_nq(&q->done, n);
+            ++q->size_done;
+            p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+            return;
+        }
+        else if (p->info[PRIORITY_LOC] == PRIORITY_LOC_IMED ||
+                 p->info[PRIORITY_ABS] >= (PQW_UINT)(p->info[PRIORITY_REL] - q->pc))
+        {
+            return;
+        }
+        else
+        {
+            PQW_QFN(unlink_q)(q, n);
+            --q->size_q;
+            --q->size;
+        }
+    }
+
+    if (LIKELY(p->info[PRIORITY_ABS]))
+    {
+        p->info[PRIORITY_REL] = (PQW_UINT)(p->info[PRIORITY_ABS] + q->pc);
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_Q;
+        ++q->size_q;
+        PQW_QFN(nq_only)(q, p);
+    }
+    else if (p->info[PRIORITY_URG])
+    {
+        p->info[PRIORITY_REL] = q->pc;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_DONE;
+        ++q->size_done;
+        list_nq(&q->done, n);
+    }
+    else
+    {
+        p->info[PRIORITY_REL] = q->pc;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_IMED;
+        ++q->size_imed;
+        list_nq(&q->immediate, n);
+    }
+    ++q->size;
+}
+
+PQ_API PQW_P *
+PQW_QFN(dequeue)(PQW_Q *q)
+{
+    if (LIKELY(q->size))
+    {
+        struct priorityq_node_s *n;
+        do
+        {
+            PQW_QFN(advance_step)(q);
+            n = list_dq(&q->done);
+        } while (!n);
+        --q->size_done;
+        --q->size;
+        PQW_P *p = PQW_PFN(from_node)(n);
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+        return p;
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+PQ_API PQW_P *
+PQW_QFN(peek)(PQW_Q *q)
+{
+    if (LIKELY(q->size))
+    {
+        while (!q->size_done)
+        {
+            PQW_QFN(advance_step)(q);
+        }
+        return PQW_PFN(from_node)(q->done.next);
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+PQ_API void
+PQW_QFN(remove)(PQW_Q *q, PQW_P *p)
+{
+    struct priorityq_node_s *n = PQW_PFN(to_node)(p);
+
+    if (LIKELY(node_in_list(n)))
+    {
+        if (PRIORITY_LOC_Q == p->info[PRIORITY_LOC])
+        {
+            PQW_QFN(unlink_q)(q, n);
+        }
+        else
+        {
+            node_unlink_only(n);
+        }
+        node_clear(n);
+        PQW_QFN(decrement_queue)(q, p);
+        --q->size;
+        p->info[PRIORITY_LOC] = PRIORITY_LOC_NONE;
+    }
+}
+
+
+#undef PQW_CAT_
+#undef PQW_CAT
+#undef PQW_UINT
+#undef PQW_P
+#undef PQW_Q
+#undef PQW_PFN
+#undef PQW_QFN
+#undef PQW_URGENT
+#undef PQW_BITS
@@ -0,0 +1,1045 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file benchmark.c
+ * @author Craig Jacobson
+ * @brief Per-operation latency of the queue and baselines under several workloads.
+ *
+ * Usage: benchmark [n] [ops] [csv|json]
+ *
+ * Every queue is filled with n items and then runs the same sequence of
+ * ops operations for each workload. Each operation is timed on its own
+ * with the monotonic clock, less the clock's own overhead, and a second
+ * untimed pass gives the throughput.
+ *
+ * The baselines are an indexed binary heap, a pairing heap, and a radix
+ * heap. They order by deadline, the last dequeued deadline plus the
+ * priority, so that they age items like the priorityq does instead of
+ * starving them.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "priorityq.h"
+
+#ifndef FORCESEED
+#define FORCESEED (0)
+#endif
+
+#define NONE (UINT32_MAX)
+
+
+/*******************************************************************************
+ * Timing
+*******************************************************************************/
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "Error getting time: %d, %s\n", errno, strerror(errno));
+        abort();
+    }
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @return The least time measured between two back to back reads.
+ */
+uint64_t
+clock_overhead(void)
+{
+    uint64_t least = UINT64_MAX;
+    int i;
+    for (i = 0; i < 4096; ++i)
+    {
+        uint64_t start = now_ns();
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < least)
+        {
+            least = elapsed;
+        }
+    }
+    return least;
+}
+
+
+/*******************************************************************************
+ * Queue Interface
+ *
+ * Items are identified by index. Enqueueing an item that is already in a
+ * queue reprioritizes it. Removing an item that isn't does nothing.
+*******************************************************************************/
+
+typedef struct
+{
+    const char *name;
+    void *(*create)(uint32_t);
+    void (*destroy)(void *);
+    void (*enqueue)(void *, uint32_t, uint8_t);
+    uint32_t (*dequeue)(void *);
+    void (*remove)(void *, uint32_t);
+} bench_queue_t;
+
+
+/* priorityq_t */
+typedef struct
+{
+    priorityq_t q;
+    priority_t *ps;
+} pq_bench_t;
+
+void *
+pq_create(uint32_t n)
+{
+    pq_bench_t *b = (pq_bench_t *)malloc(sizeof(pq_bench_t));
+    priorityq_init(&b->q);
+    b->ps = (priority_t *)malloc(n * sizeof(priority_t));
+    uint32_t i;
+    for (i = 0; i < n; ++i)
+    {
+        priority_init(b->ps + i);
+    }
+    return b;
+}
+
+void
+pq_destroy(void *ctx)
+{
+    pq_bench_t *b = (pq_bench_t *)ctx;
+    priorityq_destroy(&b->q);
+    free(b->ps);
+    free(b);
+}
+
+void
+pq_enqueue(void *ctx, uint32_t item, uint8_t priority)
+{
+    pq_bench_t *b = (pq_bench_t *)ctx;
+    priority_set(b->ps + item, NULL, priority);
+    priorityq_enqueue(&b->q, b->ps + item);
+}
+
+uint32_t
+pq_dequeue(void *ctx)
+{
+    pq_bench_t *b = (pq_bench_t *)ctx;
+    priority_t *p = priorityq_dequeue(&b->q);
+    return p ? (uint32_t)(p - b->ps) : NONE;
+}
+
+void
+pq_remove(void *ctx, uint32_t item)
+{
+    pq_bench_t *b = (pq_bench_t *)ctx;
+    priorityq_remove(&b->q, b->ps + item);
+}
+
+
+/* priorityq_compact_t */
+typedef struct
+{
+    priorityq_compact_t q;
+    priority_compact_t *arena;
+} compact_bench_t;
+
+void *
+compact_create(uint32_t n)
+{
+    compact_bench_t *b = (compact_bench_t *)malloc(sizeof(compact_bench_t));
+    b->arena = (priority_compact_t *)malloc(PQ_COMPACT_ARENA(n) * sizeof(priority_compact_t));
+    priorityq_compact_init(&b->q, b->arena, n);
+    return b;
+}
+
+void
+compact_destroy(void *ctx)
+{
+    compact_bench_t *b = (compact_bench_t *)ctx;
+    priorityq_compact_destroy(&b->q);
+    free(b->arena);
+    free(b);
+}
+
+void
+compact_enqueue(void *ctx, uint32_t item, uint8_t priority)
+{
+    compact_bench_t *b = (compact_bench_t *)ctx;
+    priority_compact_set(priorityq_compact_node(&b->q, item), priority);
+    priorityq_compact_enqueue(&b->q, item);
+}
+
+uint32_t
+compact_dequeue(void *ctx)
+{
+    compact_bench_t *b = (compact_bench_t *)ctx;
+    return priorityq_compact_dequeue(&b->q);
+}
+
+void
+compact_remove(void *ctx, uint32_t item)
+{
+    compact_bench_t *b = (compact_bench_t *)ctx;
+    priorityq_compact_remove(&b->q, item);
+}
+
+
+/* Indexed binary min heap */
+typedef struct
+{
+    uint32_t size;
+    uint32_t clock;
+    uint32_t *heap;
+    uint32_t *pos;
+    uint32_t *key;
+} binary_bench_t;
+
+void *
+binary_create(uint32_t n)
+{
+    binary_bench_t *b = (binary_bench_t *)malloc(sizeof(binary_bench_t));
+    b->size = 0;
+    b->clock = 0;
+    b->heap = (uint32_t *)malloc(n * sizeof(uint32_t));
+    b->pos = (uint32_t *)malloc(n * sizeof(uint32_t));
+    b->key = (uint32_t *)malloc(n * sizeof(uint32_t));
+    memset(b->pos, 0xff, n * sizeof(uint32_t));
+    return b;
+}
+
+void
+binary_destroy(void *ctx)
+{
+    binary_bench_t *b = (binary_bench_t *)ctx;
+    free(b->heap);
+    free(b->pos);
+    free(b->key);
+    free(b);
+}
+
+static inline void
+binary_place(binary_bench_t *b, uint32_t index, uint32_t item)
+{
+    b->heap[index] = item;
+    b->pos[item] = index;
+}
+
+static void
+binary_sift_up(binary_bench_t *b, uint32_t index)
+{
+    uint32_t item = b->heap[index];
+    uint32_t key = b->key[item];
+    while (index)
+    {
+        uint32_t parent = (index - 1) >> 1;
+        if (b->key[b->heap[parent]] <= key)
+        {
+            break;
+        }
+        binary_place(b, index, b->heap[parent]);
+        index = parent;
+    }
+    binary_place(b, index, item);
+}
+
+static void
+binary_sift_down(binary_bench_t *b, uint32_t index)
+{
+    uint32_t item = b->heap[index];
+    uint32_t key = b->key[item];
+    for (;;)
+    {
+        uint32_t child = (index << 1) + 1;
+        if (child >= b->size)
+        {
+            break;
+        }
+        if (child + 1 < b->size && b->key[b->heap[child + 1]] < b->key[b->heap[child]])
+        {
+            ++child;
+        }
+        if (key <= b->key[b->heap[child]])
+        {
+            break;
+        }
+        binary_place(b, index, b->heap[child]);
+        index = child;
+    }
+    binary_place(b, index, item);
+}
+
+static void
+binary_unlink(binary_bench_t *b, uint32_t item)
+{
+    uint32_t index = b->pos[item];
+    b->pos[item] = NONE;
+    if (index != --b->size)
+    {
+        uint32_t moved = b->heap[b->size];
+        binary_place(b, index, moved);
+        binary_sift_up(b, index);
+        if (b->pos[moved] == index)
+        {
+            binary_sift_down(b, index);
+        }
+    }
+}
+
+void
+binary_enqueue(void *ctx, uint32_t item, uint8_t priority)
+{
+    binary_bench_t *b = (binary_bench_t *)ctx;
+    uint32_t key = b->clock + priority;
+    if (NONE != b->pos[item])
+    {
+        uint32_t old = b->key[item];
+        b->key[item] = key;
+        if (key < old)
+        {
+            binary_sift_up(b, b->pos[item]);
+        }
+        else
+        {
+            binary_sift_down(b, b->pos[item]);
+        }
+    }
+    else
+    {
+        b->key[item] = key;
+        binary_place(b, b->size, item);
+        binary_sift_up(b, b->size++);
+    }
+}
+
+uint32_t
+binary_dequeue(void *ctx)
+{
+    binary_bench_t *b = (binary_bench_t *)ctx;
+    if (!b->size)
+    {
+        return NONE;
+    }
+    uint32_t item = b->heap[0];
+    b->clock = b->key[item];
+    binary_unlink(b, item);
+    return item;
+}
+
+void
+binary_remove(void *ctx, uint32_t item)
+{
+    binary_bench_t *b = (binary_bench_t *)ctx;
+    if (NONE != b->pos[item])
+    {
+        binary_unlink(b, item);
+    }
+}
+
+
+/* Pairing heap (two-pass) */
+typedef struct
+{
+    uint32_t key;
+    uint32_t child;
+    uint32_t sibling;
+    // The parent if this is the leftmost child, else the left sibling.
+    uint32_t prev;
+    bool active;
+} pairing_node_t;
+
+typedef struct
+{
+    uint32_t root;
+    uint32_t clock;
+    pairing_node_t *nodes;
+    uint32_t *stack;
+} pairing_bench_t;
+
+void *
+pairing_create(uint32_t n)
+{
+    pairing_bench_t *b = (pairing_bench_t *)malloc(sizeof(pairing_bench_t));
+    b->root = NONE;
+    b->clock = 0;
+    b->nodes = (pairing_node_t *)malloc(n * sizeof(pairing_node_t));
+    b->stack = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t i;
+    for (i = 0; i < n; ++i)
+    {
+        b->nodes[i] = (pairing_node_t){ 0, NONE, NONE, NONE, false };
+    }
+    return b;
+}
+
+void
+pairing_destroy(void *ctx)
+{
+    pairing_bench_t *b = (pairing_bench_t *)ctx;
+    free(b->nodes);
+    free(b->stack);
+    free(b);
+}
+
+/**
+ * @brief Meld two roots; either may be NONE.
+ */
+static uint32_t
+pairing_meld(pairing_bench_t *b, uint32_t x, uint32_t y)
+{
+    if (NONE == x) { return y; }
+    if (NONE == y) { return x; }
+    if (b->nodes[y].key < b->nodes[x].key)
+    {
+        uint32_t t = x;
+        x = y;
+        y = t;
+    }
+    pairing_node_t *px = b->nodes + x;
+    pairing_node_t *py = b->nodes + y;
+    py->sibling = px->child;
+    if (NONE != px->child)
+    {
+        b->nodes[px->child].prev = y;
+    }
+    py->prev = x;
+    px->child = y;
+    return x;
+}
+
+static uint32_t
+pairing_merge_pairs(pairing_bench_t *b, uint32_t first)
+{
+    uint32_t count = 0;
+    while (NONE != first)
+    {
+        uint32_t x = first;
+        uint32_t y = b->nodes[x].sibling;
+        first = NONE != y ? b->nodes[y].sibling : NONE;
+        b->nodes[x].sibling = NONE;
+        b->nodes[x].prev = NONE;
+        if (NONE != y)
+        {
+            b->nodes[y].sibling = NONE;
+            b->nodes[y].prev = NONE;
+        }
+        b->stack[count++] = pairing_meld(b, x, y);
+    }
+
+    uint32_t root = NONE;
+    while (count)
+    {
+        root = pairing_meld(b, b->stack[--count], root);
+    }
+    return root;
+}
+
+static void
+pairing_unlink(pairing_bench_t *b, uint32_t item)
+{
+    pairing_node_t *x = b->nodes + item;
+    uint32_t rest = pairing_merge_pairs(b, x->child);
+    if (item == b->root)
+    {
+        b->root = rest;
+    }
+    else
+    {
+        pairing_node_t *prev = b->nodes + x->prev;
+        if (prev->child == item)
+        {
+            prev->child = x->sibling;
+        }
+        else
+        {
+            prev->sibling = x->sibling;
+        }
+        if (NONE != x->sibling)
+        {
+            b->nodes[x->sibling].prev = x->prev;
+        }
+        b->root = pairing_meld(b, b->root, rest);
+    }
+    x->child = NONE;
+    x->sibling = NONE;
+    x->prev = NONE;
+    x->active = false;
+}
+
+void
+pairing_enqueue(void *ctx, uint32_t item, uint8_t priority)
+{
+    pairing_bench_t *b = (pairing_bench_t *)ctx;
+    if (b->nodes[item].active)
+    {
+        pairing_unlink(b, item);
+    }
+    b->nodes[item].key = b->clock + priority;
+    b->nodes[item].active = true;
+    b->root = pairing_meld(b, b->root, item);
+}
+
+uint32_t
+pairing_dequeue(void *ctx)
+{
+    pairing_bench_t *b = (pairing_bench_t *)ctx;
+    uint32_t item = b->root;
+    if (NONE != item)
+    {
+        b->clock = b->nodes[item].key;
+        pairing_unlink(b, item);
+    }
+    return item;
+}
+
+void
+pairing_remove(void *ctx, uint32_t item)
+{
+    pairing_bench_t *b = (pairing_bench_t *)ctx;
+    if (b->nodes[item].active)
+    {
+        pairing_unlink(b, item);
+    }
+}
+
+
+/* Radix heap (monotone, keys never fall below the last dequeued) */
+#define RADIX_BUCKETS (33)
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t cap;
+    uint32_t *items;
+} radix_bucket_t;
+
+typedef struct
+{
+    uint32_t last;
+    radix_bucket_t buckets[RADIX_BUCKETS];
+    uint32_t *key;
+    // Bucket and slot of each item; bucket NONE when not queued.
+    uint32_t *bucket;
+    uint32_t *slot;
+} radix_bench_t;
+
+void *
+radix_create(uint32_t n)
+{
+    radix_bench_t *b = (radix_bench_t *)calloc(1, sizeof(radix_bench_t));
+    b->key = (uint32_t *)malloc(n * sizeof(uint32_t));
+    b->bucket = (uint32_t *)malloc(n * sizeof(uint32_t));
+    b->slot = (uint32_t *)malloc(n * sizeof(uint32_t));
+    memset(b->bucket, 0xff, n * sizeof(uint32_t));
+    return b;
+}
+
+void
+radix_destroy(void *ctx)
+{
+    radix_bench_t *b = (radix_bench_t *)ctx;
+    int i;
+    for (i = 0; i < RADIX_BUCKETS; ++i)
+    {
+        free(b->buckets[i].items);
+    }
+    free(b->key);
+    free(b->bucket);
+    free(b->slot);
+    free(b);
+}
+
+static inline uint32_t
+radix_index(radix_bench_t *b, uint32_t key)
+{
+    return key == b->last ? 0 : 32 - __builtin_clz(key ^ b->last);
+}
+
+static void
+radix_push(radix_bench_t *b, uint32_t item)
+{
+    uint32_t index = radix_index(b, b->key[item]);
+    radix_bucket_t *bucket = b->buckets + index;
+    if (bucket->size == bucket->cap)
+    {
+        bucket->cap = bucket->cap ? bucket->cap * 2 : 64;
+        bucket->items = (uint32_t *)realloc(bucket->items, bucket->cap * sizeof(uint32_t));
+    }
+    b->bucket[item] = index;
+    b->slot[item] = bucket->size;
+    bucket->items[bucket->size++] = item;
+}
+
+static void
+radix_unlink(radix_bench_t *b, uint32_t item)
+{
+    radix_bucket_t *bucket = b->buckets + b->bucket[item];
+    uint32_t moved = bucket->items[--bucket->size];
+    bucket->items[b->slot[item]] = moved;
+    b->slot[moved] = b->slot[item];
+    b->bucket[item] = NONE;
+}
+
+void
+radix_enqueue(void *ctx, uint32_t item, uint8_t priority)
+{
+    radix_bench_t *b = (radix_bench_t *)ctx;
+    if (NONE != b->bucket[item])
+    {
+        radix_unlink(b, item);
+    }
+    b->key[item] = b->last + priority;
+    radix_push(b, item);
+}
+
+uint32_t
+radix_dequeue(void *ctx)
+{
+    radix_bench_t *b = (radix_bench_t *)ctx;
+    if (!b->buckets[0].size)
+    {
+        int i = 1;
+        while (i < RADIX_BUCKETS && !b->buckets[i].size)
+        {
+            ++i;
+        }
+        if (RADIX_BUCKETS == i)
+        {
+            return NONE;
+        }
+
+        // Take the bucket and spread it over the lower buckets.
+        radix_bucket_t *bucket = b->buckets + i;
+        uint32_t least = UINT32_MAX;
+        uint32_t j;
+        for (j = 0; j < bucket->size; ++j)
+        {
+            if (b->key[bucket->items[j]] < least)
+            {
+                least = b->key[bucket->items[j]];
+            }
+        }
+        b->last = least;
+        uint32_t size = bucket->size;
+        bucket->size = 0;
+        for (j = 0; j < size; ++j)
+        {
+            radix_push(b, bucket->items[j]);
+        }
+    }
+
+    radix_bucket_t *bucket = b->buckets;
+    uint32_t item = bucket->items[bucket->size - 1];
+    --bucket->size;
+    b->bucket[item] = NONE;
+    return item;
+}
+
+void
+radix_remove(void *ctx, uint32_t item)
+{
+    radix_bench_t *b = (radix_bench_t *)ctx;
+    if (NONE != b->bucket[item])
+    {
+        radix_unlink(b, item);
+    }
+}
+
+
+static const bench_queue_t queues[] =
+{
+    { "priorityq", pq_create, pq_destroy, pq_enqueue, pq_dequeue, pq_remove },
+    { "compact_q", compact_create, compact_destroy, compact_enqueue, compact_dequeue, compact_remove },
+    { "binary_heap", binary_create, binary_destroy, binary_enqueue, binary_dequeue, binary_remove },
+    { "pairing_heap", pairing_create, pairing_destroy, pairing_enqueue, pairing_dequeue, pairing_remove },
+    { "radix_heap", radix_create, radix_destroy, radix_enqueue, radix_dequeue, radix_remove },
+};
+
+
+/*******************************************************************************
+ * Workloads
+*******************************************************************************/
+
+enum OP_ENUM
+{
+    OP_ENQUEUE = 0,
+    OP_DEQUEUE = 1,
+    OP_REMOVE = 2,
+    OP_REPRIORITIZE = 3,
+    OP_COUNT = 4,
+};
+
+static const char *op_names[OP_COUNT] = { "enqueue", "dequeue", "remove", "reprioritize" };
+
+typedef struct
+{
+    uint32_t item;
+    uint8_t type;
+    uint8_t priority;
+} op_t;
+
+uint8_t
+priority_uniform(void)
+{
+    return (uint8_t)(random() % (PQ_CEILING + 1));
+}
+
+uint8_t
+priority_skewed(void)
+{
+    // Most items are close to immediate.
+    return (uint8_t)(random() % (1 + random() % PQ_CEILING));
+}
+
+uint8_t
+priority_bimodal(void)
+{
+    return (random() % 10) ? (uint8_t)(random() % 8) : (uint8_t)(PQ_CEILING - 8 + random() % 8);
+}
+
+typedef struct
+{
+    const char *name;
+    // Weights of each operation, out of their sum.
+    int weights[OP_COUNT];
+    uint8_t (*priority)(void);
+    // Alternate runs of this many enqueues and dequeues instead.
+    bool bursty;
+} workload_t;
+
+static const workload_t workloads[] =
+{
+    { "steady", { 1, 1, 0, 0 }, priority_uniform, false },
+    { "remove_heavy", { 2, 1, 1, 0 }, priority_uniform, false },
+    { "reprioritize_heavy", { 1, 1, 0, 2 }, priority_uniform, false },
+    { "bursty", { 0 }, priority_uniform, true },
+    { "skewed", { 1, 1, 0, 0 }, priority_skewed, false },
+    { "bimodal", { 1, 1, 0, 0 }, priority_bimodal, false },
+};
+
+/**
+ * @brief Generate the operations for a workload.
+ * @param items - The number of item indices available, at least 4n.
+ *
+ * New items are taken round robin so they are unlikely to still be queued.
+ * Removes and reprioritizations pick among the last n items enqueued, which
+ * are likely, but not certain, to still be queued in every queue.
+ */
+void
+generate(const workload_t *w, op_t *ops, uint32_t count, uint32_t n, uint32_t items)
+{
+    uint32_t *recent = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t next = n;
+    uint32_t i;
+    for (i = 0; i < n; ++i)
+    {
+        recent[i] = i;
+    }
+
+    int total = 0;
+    int t;
+    for (t = 0; t < OP_COUNT; ++t)
+    {
+        total += w->weights[t];
+    }
+
+    uint32_t burst = n / 2 ? n / 2 : 1;
+    for (i = 0; i < count; ++i)
+    {
+        uint8_t type;
+        if (w->bursty)
+        {
+            type = (i / burst) & 1 ? OP_DEQUEUE : OP_ENQUEUE;
+        }
+        else
+        {
+            int pick = (int)(random() % total);
+            for (type = 0; pick >= w->weights[type]; ++type)
+            {
+                pick -= w->weights[type];
+            }
+        }
+
+        op_t *op = ops + i;
+        op->type = type;
+        op->priority = w->priority();
+        if (OP_ENQUEUE == type)
+        {
+            op->item = next % items;
+            recent[next % n] = op->item;
+            ++next;
+        }
+        else
+        {
+            op->item = recent[random() % n];
+        }
+    }
+
+    free(recent);
+}
+
+
+/*******************************************************************************
+ * Running and Reporting
+*******************************************************************************/
+
+typedef struct
+{
+    const char *workload;
+    const char *queue;
+    const char *op;
+    uint32_t count;
+    double mean;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+    uint32_t max;
+} row_t;
+
+static inline void
+run_op(const bench_queue_t *bq, void *ctx, const op_t *op)
+{
+    switch (op->type)
+    {
+        case OP_ENQUEUE:
+        case OP_REPRIORITIZE:
+            bq->enqueue(ctx, op->item, op->priority);
+            break;
+        case OP_DEQUEUE:
+            bq->dequeue(ctx);
+            break;
+        default:
+            bq->remove(ctx, op->item);
+            break;
+    }
+}
+
+void *
+prefill(const bench_queue_t *bq, uint32_t items, uint32_t n, uint8_t (*priority)(void))
+{
+    void *ctx = bq->create(items);
+    uint32_t i;
+    for (i = 0; i < n; ++i)
+    {
+        bq->enqueue(ctx, i, priority());
+    }
+    return ctx;
+}
+
+int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Sort the samples and summarize them into the row.
+ */
+void
+summarize(row_t *row, uint32_t *samples, uint32_t count)
+{
+    row->count = count;
+    if (!count)
+    {
+        return;
+    }
+
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+    double sum = 0;
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+    {
+        sum += samples[i];
+    }
+    row->mean = sum / count;
+    row->p50 = samples[(uint32_t)(count * 0.5)];
+    row->p99 = samples[(uint32_t)(count * 0.99)];
+    row->p999 = samples[(uint32_t)(count * 0.999)];
+    row->max = samples[count - 1];
+}
+
+/**
+ * @brief Time one queue on one workload.
+ * @return The number of rows written, one per operation type seen plus
+ *         an overall row with the untimed throughput as its mean.
+ */
+int
+measure(row_t *rows, const workload_t *w, const bench_queue_t *bq, const op_t *ops,
+        uint32_t count, uint32_t n, uint32_t items, unsigned int seed, uint64_t overhead)
+{
+    uint32_t *samples = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *sorted = (uint32_t *)malloc(count * sizeof(uint32_t));
+    int written = 0;
+
+    // Timed pass; the seed makes every prefill the same.
+    srandom(seed);
+    void *ctx = prefill(bq, items, n, w->priority);
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+    {
+        uint64_t start = now_ns();
+        run_op(bq, ctx, ops + i);
+        uint64_t elapsed = now_ns() - start;
+        elapsed = elapsed > overhead ? elapsed - overhead : 0;
+        samples[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    }
+    bq->destroy(ctx);
+
+    int t;
+    for (t = 0; t < OP_COUNT; ++t)
+    {
+        uint32_t k = 0;
+        for (i = 0; i < count; ++i)
+        {
+            if (ops[i].type == t)
+            {
+                sorted[k++] = samples[i];
+            }
+        }
+        if (k)
+        {
+            row_t *row = rows + written++;
+            (*row) = (row_t){ w->name, bq->name, op_names[t], 0, 0, 0, 0, 0, 0 };
+            summarize(row, sorted, k);
+        }
+    }
+
+    // Untimed pass for throughput, from the same starting state.
+    srandom(seed);
+    ctx = prefill(bq, items, n, w->priority);
+    uint64_t start = now_ns();
+    for (i = 0; i < count; ++i)
+    {
+        run_op(bq, ctx, ops + i);
+    }
+    uint64_t elapsed = now_ns() - start;
+    bq->destroy(ctx);
+
+    row_t *row = rows + written++;
+    (*row) = (row_t){ w->name, bq->name, "all", 0, 0, 0, 0, 0, 0 };
+    summarize(row, samples, count);
+    row->mean = (double)elapsed / count;
+
+    free(sorted);
+    free(samples);
+    return written;
+}
+
+void
+print_csv(const row_t *rows, int count)
+{
+    printf("workload,queue,operation,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        const row_t *r = rows + i;
+        printf("%s,%s,%s,%u,%.1f,%u,%u,%u,%u\n",
+               r->workload, r->queue, r->op, r->count, r->mean,
+               r->p50, r->p99, r->p999, r->max);
+    }
+}
+
+void
+print_json(const row_t *rows, int count)
+{
+    printf("[\n");
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        const row_t *r = rows + i;
+        printf("  {\"workload\": \"%s\", \"queue\": \"%s\", \"operation\": \"%s\", "
+               "\"count\": %u, \"mean_ns\": %.1f, \"p50_ns\": %u, \"p99_ns\": %u, "
+               "\"p999_ns\": %u, \"max_ns\": %u}%s\n",
+               r->workload, r->queue, r->op, r->count, r->mean,
+               r->p50, r->p99, r->p999, r->max, i + 1 < count ? "," : "");
+    }
+    printf("]\n");
+}
+
+int
+random_seed(void)
+{
+    int seed = FORCESEED;
+    if (!seed)
+    {
+        seed = (int)time(0);
+    }
+    srandom(seed);
+    return seed;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    uint32_t n = argc >= 2 ? (uint32_t)atoi(argv[1]) : 1u << 16;
+    uint32_t count = argc >= 3 ? (uint32_t)atoi(argv[2]) : 1u << 20;
+    bool json = argc >= 4 && !strcmp(argv[3], "json");
+    if (!n || !count)
+    {
+        fprintf(stderr, "Usage: %s [n] [ops] [csv|json]\n", argv[0]);
+        return 1;
+    }
+
+    int seed = random_seed();
+    fprintf(stderr, "Seed: %d\n", seed);
+
+    uint32_t items = 4 * n;
+    uint64_t overhead = clock_overhead();
+    const int nqueues = sizeof(queues) / sizeof(queues[0]);
+    const int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+    row_t *rows = (row_t *)malloc(nqueues * nworkloads * (OP_COUNT + 1) * sizeof(row_t));
+    op_t *ops = (op_t *)malloc(count * sizeof(op_t));
+    int written = 0;
+
+    int w, b;
+    for (w = 0; w < nworkloads; ++w)
+    {
+        generate(workloads + w, ops, count, n, items);
+        unsigned int fill = (unsigned int)random();
+        for (b = 0; b < nqueues; ++b)
+        {
+            written += measure(rows + written, workloads + w, queues + b, ops,
+                               count, n, items, fill, overhead);
+        }
+    }
+
+    if (json)
+    {
+        print_json(rows, written);
+    }
+    else
+    {
+        print_csv(rows, written);
+    }
+
+    free(ops);
+    free(rows);
+    return 0;
+}
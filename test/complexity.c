@@ -56,7 +56,7 @@ stopwatch_reset(stopwatch_t *sw)
 void
 stopwatch_start(stopwatch_t *sw)
 {
-    if (clock_gettime(CLOCK_REALTIME, &sw->start))
+    if (clock_gettime(CLOCK_MONOTONIC, &sw->start))
     {
         printf("Error getting start time: %d, %s\n", errno, strerror(errno));
         abort();
@@ -66,7 +66,7 @@ stopwatch_start(stopwatch_t *sw)
 void
 stopwatch_stop(stopwatch_t *sw)
 {
-    if (clock_gettime(CLOCK_REALTIME, &sw->end))
+    if (clock_gettime(CLOCK_MONOTONIC, &sw->end))
     {
         printf("Error getting end time: %d, %s\n", errno, strerror(errno));
         abort();
@@ -323,6 +323,35 @@ time_priorityq(priorityq_t *q, int iterations, int n, priority_t *ps)
     return stopwatch_elapsed(&sw);
 }
 
+double
+time_compact(priorityq_compact_t *c, int iterations, int n, priority_t *ps)
+{
+    int index;
+    for (index = 0; index < n; ++index)
+    {
+        priority_compact_set(priorityq_compact_node(c, index), priority_value(ps + index));
+    }
+
+    stopwatch_t sw;
+    stopwatch_start(&sw);
+    int iter;
+    for (iter = 0; iter < iterations; ++iter)
+    {
+        for (index = 0; index < n; ++index)
+        {
+            priorityq_compact_enqueue(c, index);
+        }
+
+        for (index = 0; index < n; ++index)
+        {
+            priorityq_compact_dequeue(c);
+        }
+    }
+    stopwatch_stop(&sw);
+
+    return stopwatch_elapsed(&sw);
+}
+
 void
 print_results(const char *name, double rawtime, double overhead, int iterations, int n)
 {
@@ -372,6 +401,8 @@ main(int argc, const char *argv[])
     minheap_t *h = &_heap;
     priorityq_t _q;
     priorityq_t *q = &_q;
+    priorityq_compact_t _c;
+    priorityq_compact_t *c = &_c;
 
     int seed = random_seed();
     printf("Seed: %d\n", seed);
@@ -382,16 +413,22 @@ main(int argc, const char *argv[])
     minheap_init(h, n);
     minheap_precache(h);
     priorityq_init(q);
+    priority_compact_t *arena = (priority_compact_t *)malloc(PQ_COMPACT_ARENA(n) * sizeof(priority_compact_t));
+    priorityq_compact_init(c, arena, n);
 
     priority_t *ps = random_priorities(n);
 
     double tloop = time_loop(iterations, n);
     double theap = time_min_heap(h, iterations, n, ps);
     double tq = time_priorityq(q, iterations, n, ps);
+    double tc = time_compact(c, iterations, n, ps);
 
     print_results("min__heap", theap, tloop, iterations, n);
     print_results("priorityq", tq, tloop, iterations, n);
+    print_results("compact_q", tc, tloop, iterations, n);
 
+    priorityq_compact_destroy(c);
+    free(arena);
     priorityq_destroy(q);
     minheap_destroy(h);
     free(ps);
@@ -0,0 +1,345 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file contention.c
+ * @author Craig Jacobson
+ * @brief Throughput and latency of the concurrent front-ends as threads grow.
+ *
+ * Usage: contention [max_threads] [items_per_producer]
+ *
+ * For thread counts 1, 2, 4, ... up to max_threads, runs that many producers
+ * and consumers, each pinned to its own core where possible, over:
+ * - a priorityq_t behind a mutex;
+ * - priorityq_mpsc_t, which always has a single consumer;
+ * - priorityq_pool_t with one shard per consumer, producer i feeding
+ *   shard i modulo the consumers.
+ *
+ * Every item is stamped when enqueued, and the consumer that dequeues it
+ * records the delay. The steal rate is the fraction of pool items
+ * dequeued by a consumer other than the owner of their shard.
+ * Results are printed as CSV.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "priorityq.h"
+
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "Error getting time: %d, %s\n", errno, strerror(errno));
+        abort();
+    }
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+pin(int core)
+{
+#ifdef __linux__
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % (cores > 0 ? cores : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)core;
+#endif
+}
+
+
+/*******************************************************************************
+ * Variants
+*******************************************************************************/
+
+typedef struct
+{
+    priority_t p;
+    uint64_t enqueued;
+    uint32_t shard;
+} item_t;
+
+enum VARIANT_ENUM
+{
+    VARIANT_MUTEX = 0,
+    VARIANT_MPSC = 1,
+    VARIANT_POOL = 2,
+    VARIANT_COUNT = 3,
+};
+
+static const char *variant_names[VARIANT_COUNT] = { "mutex", "mpsc", "pool" };
+
+typedef struct
+{
+    int variant;
+    int producers;
+    int consumers;
+    int per_producer;
+    pthread_barrier_t start;
+
+    pthread_mutex_t mutex;
+    priorityq_t q;
+    priorityq_mpsc_t mpsc;
+    priorityq_pool_t pool;
+    priorityq_shard_t *shards;
+
+    item_t *items;
+    int received;
+} bench_t;
+
+typedef struct
+{
+    bench_t *bench;
+    int index;
+    // Consumers only.
+    uint32_t *latencies;
+    uint32_t count;
+    uint32_t stolen;
+} thread_t;
+
+static void
+produce(bench_t *b, int index)
+{
+    item_t *items = b->items + (size_t)index * b->per_producer;
+    uint32_t shard = (uint32_t)(index % b->consumers);
+    int i;
+    for (i = 0; i < b->per_producer; ++i)
+    {
+        item_t *item = items + i;
+        item->shard = shard;
+        item->enqueued = now_ns();
+        switch (b->variant)
+        {
+            case VARIANT_MUTEX:
+                pthread_mutex_lock(&b->mutex);
+                priorityq_enqueue(&b->q, &item->p);
+                pthread_mutex_unlock(&b->mutex);
+                break;
+            case VARIANT_MPSC:
+                priorityq_mpsc_enqueue(&b->mpsc, &item->p);
+                break;
+            default:
+                priorityq_pool_enqueue(&b->pool, shard, &item->p);
+                break;
+        }
+    }
+}
+
+static priority_t *
+consume_one(bench_t *b, int index)
+{
+    priority_t *p;
+    switch (b->variant)
+    {
+        case VARIANT_MUTEX:
+            pthread_mutex_lock(&b->mutex);
+            p = priorityq_dequeue(&b->q);
+            pthread_mutex_unlock(&b->mutex);
+            return p;
+        case VARIANT_MPSC:
+            return priorityq_mpsc_dequeue(&b->mpsc);
+        default:
+            return priorityq_pool_dequeue(&b->pool, (uint32_t)index);
+    }
+}
+
+static void
+consume(bench_t *b, thread_t *t)
+{
+    const int total = b->producers * b->per_producer;
+    while (__atomic_load_n(&b->received, __ATOMIC_RELAXED) < total)
+    {
+        priority_t *p = consume_one(b, t->index);
+        if (p)
+        {
+            item_t *item = (item_t *)p;
+            uint64_t delay = now_ns() - item->enqueued;
+            t->latencies[t->count++] = delay > UINT32_MAX ? UINT32_MAX : (uint32_t)delay;
+            t->stolen += item->shard != (uint32_t)t->index;
+            __atomic_fetch_add(&b->received, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *
+producer_run(void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+    pin(t->index);
+    pthread_barrier_wait(&t->bench->start);
+    produce(t->bench, t->index);
+    return NULL;
+}
+
+static void *
+consumer_run(void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+    pin(t->bench->producers + t->index);
+    pthread_barrier_wait(&t->bench->start);
+    consume(t->bench, t);
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Running and Reporting
+*******************************************************************************/
+
+static int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+run(int variant, int producers, int consumers, int per_producer)
+{
+    bench_t b;
+    memset(&b, 0, sizeof(b));
+    b.variant = variant;
+    b.producers = producers;
+    b.consumers = consumers;
+    b.per_producer = per_producer;
+
+    const int total = producers * per_producer;
+    b.items = (item_t *)malloc((size_t)total * sizeof(item_t));
+    int i;
+    for (i = 0; i < total; ++i)
+    {
+        priority_init(&b.items[i].p);
+        priority_set(&b.items[i].p, NULL, (uint8_t)(random() % (PQ_CEILING + 1)));
+    }
+
+    pthread_mutex_init(&b.mutex, NULL);
+    priorityq_init(&b.q);
+    priorityq_mpsc_init(&b.mpsc);
+    b.shards = (priorityq_shard_t *)priorityq_alloc(consumers * sizeof(priorityq_shard_t));
+    priorityq_pool_init(&b.pool, b.shards, (uint32_t)consumers);
+    pthread_barrier_init(&b.start, NULL, (unsigned)(producers + consumers + 1));
+
+    pthread_t *threads = (pthread_t *)malloc((producers + consumers) * sizeof(pthread_t));
+    thread_t *args = (thread_t *)calloc(producers + consumers, sizeof(thread_t));
+    for (i = 0; i < producers + consumers; ++i)
+    {
+        thread_t *t = args + i;
+        t->bench = &b;
+        if (i < producers)
+        {
+            t->index = i;
+            pthread_create(threads + i, NULL, producer_run, t);
+        }
+        else
+        {
+            t->index = i - producers;
+            t->latencies = (uint32_t *)malloc((size_t)total * sizeof(uint32_t));
+            pthread_create(threads + i, NULL, consumer_run, t);
+        }
+    }
+
+    pthread_barrier_wait(&b.start);
+    uint64_t start = now_ns();
+    for (i = 0; i < producers + consumers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    // Merge the consumers' delays.
+    uint32_t *latencies = (uint32_t *)malloc((size_t)total * sizeof(uint32_t));
+    uint32_t count = 0;
+    uint32_t stolen = 0;
+    for (i = producers; i < producers + consumers; ++i)
+    {
+        memcpy(latencies + count, args[i].latencies, args[i].count * sizeof(uint32_t));
+        count += args[i].count;
+        stolen += args[i].stolen;
+        free(args[i].latencies);
+    }
+    qsort(latencies, count, sizeof(uint32_t), compare_u32);
+
+    printf("%s,%d,%d,%d,%.6f,%.0f,%u,%u,%u,%u,%.4f\n",
+           variant_names[variant], producers, consumers, total, seconds,
+           total / seconds,
+           latencies[(uint32_t)(count * 0.5)],
+           latencies[(uint32_t)(count * 0.99)],
+           latencies[(uint32_t)(count * 0.999)],
+           latencies[count - 1],
+           VARIANT_POOL == variant ? (double)stolen / count : 0.0);
+    fflush(stdout);
+
+    free(latencies);
+    free(args);
+    free(threads);
+    pthread_barrier_destroy(&b.start);
+    priorityq_pool_destroy(&b.pool);
+    priorityq_free(b.shards);
+    priorityq_mpsc_destroy(&b.mpsc);
+    priorityq_destroy(&b.q);
+    pthread_mutex_destroy(&b.mutex);
+    free(b.items);
+}
+
+int
+main(int argc, const char *argv[])
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc >= 2 ? atoi(argv[1]) : (int)(cores > 1 ? cores / 2 : 1);
+    int per_producer = argc >= 3 ? atoi(argv[2]) : 1 << 18;
+    if (max_threads < 1 || per_producer < 1)
+    {
+        fprintf(stderr, "Usage: %s [max_threads] [items_per_producer]\n", argv[0]);
+        return 1;
+    }
+
+    srandom((unsigned)time(0));
+    printf("variant,producers,consumers,items,seconds,items_per_sec,"
+           "p50_ns,p99_ns,p999_ns,max_ns,steal_rate\n");
+
+    int threads;
+    for (threads = 1; threads <= max_threads; threads <<= 1)
+    {
+        run(VARIANT_MUTEX, threads, threads, per_producer);
+        run(VARIANT_MPSC, threads, 1, per_producer);
+        run(VARIANT_POOL, threads, threads, per_producer);
+    }
+
+    return 0;
+}
@@ -27,10 +27,16 @@
 #include "bdd.h"
 #include "priorityq.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 
 priority_t *
@@ -55,6 +61,87 @@ free_priority(priority_t *u)
     free(u);
 }
 
+#define PRODUCERS (4)
+#define PRODUCED (4096)
+
+typedef struct
+{
+    priorityq_mpsc_t *m;
+    priority_t *ps;
+} producer_t;
+
+void *
+producer_run(void *arg)
+{
+    producer_t *producer = (producer_t *)arg;
+    int i;
+    for (i = 0; i < PRODUCED; ++i)
+    {
+        priorityq_mpsc_enqueue(producer->m, producer->ps + i);
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    priorityq_mpsc_t *m;
+    priority_t *p;
+} delayed_t;
+
+void *
+delayed_run(void *arg)
+{
+    delayed_t *delayed = (delayed_t *)arg;
+    struct timespec ts = { 0, 20 * 1000 * 1000 };
+    nanosleep(&ts, NULL);
+    priorityq_mpsc_enqueue(delayed->m, delayed->p);
+    return NULL;
+}
+
+#define WORKERS (4)
+
+typedef struct
+{
+    priorityq_pool_t *pool;
+    uint32_t index;
+    int *received;
+    int total;
+} worker_t;
+
+void *
+worker_run(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    while (__atomic_load_n(worker->received, __ATOMIC_RELAXED) < worker->total)
+    {
+        if (priorityq_pool_dequeue(worker->pool, worker->index))
+        {
+            __atomic_fetch_add(worker->received, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+#define CANCELLED (4096)
+
+void *
+canceller_run(void *arg)
+{
+    priority_t *ps = (priority_t *)arg;
+    int i;
+    for (i = 1; i < CANCELLED; i += 2)
+    {
+        priority_cancel(ps + i);
+    }
+    return NULL;
+}
+
+uint32_t
+snapshot_id(priority_t *p, void *base)
+{
+    return (uint32_t)(p - (priority_t *)base);
+}
+
 // Avoid having to allocate a priority queue for the tests. Makes them easier.
 static priorityq_t _q;
 static priorityq_t *q = &_q;
@@ -74,6 +161,20 @@ spec("priorityq library")
             check(NULL == priorityq_dequeue(q));
             priorityq_destroy(q);
         }
+
+        it("should allocate queues on cache lines")
+        {
+            priorityq_t *h = (priorityq_t *)priorityq_alloc(sizeof(priorityq_t));
+            check(0 == (uintptr_t)h % PQ_CACHE_LINE);
+#ifdef PQ_ALIGN_QUEUES
+            check(0 == sizeof(priorityq_t) % PQ_CACHE_LINE);
+            check(0 == offsetof(priorityq_t, processing) % PQ_CACHE_LINE);
+#endif
+            priorityq_init(h);
+            check(NULL == priorityq_dequeue(h));
+            priorityq_destroy(h);
+            priorityq_free(h);
+        }
     }
 
     describe("priority_t basics")
@@ -395,6 +496,2582 @@ spec("priorityq library")
         }
     }
 
+    describe("batch dequeue")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should get nothing from an empty queue")
+        {
+            priority_t *out[4];
+            check(0 == priorityq_dequeue_batch(q, out, 4));
+            priority_set(p, NULL, 5);
+            priorityq_enqueue(q, p);
+            check(0 == priorityq_dequeue_batch(q, out, 0));
+            check(1 == priorityq_size(q));
+            priorityq_remove(q, p);
+        }
+
+        it("should dequeue in priority order and respect the maximum")
+        {
+            priority_t ps[PQ_CEILING];
+            priority_t *out[PQ_CEILING + 1];
+
+            int i = PQ_CEILING;
+            while (i--)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)i);
+                priorityq_enqueue(q, ps + i);
+            }
+
+            priority_set(p, NULL, PRIORITY_URGENT);
+            priorityq_enqueue(q, p);
+
+            uint32_t total = 0;
+            uint32_t count;
+            while ((count = priorityq_dequeue_batch(q, out + total, 7)))
+            {
+                check(count <= 7);
+                total += count;
+            }
+
+            check((PQ_CEILING + 1) == total, "%u vs %u", PQ_CEILING + 1, total);
+            check(p == out[0]);
+            for (i = 0; i < PQ_CEILING; ++i)
+            {
+                check((ps + i) == out[i + 1], "index(%d)", i);
+                check(!priority_is_active(out[i + 1]));
+            }
+
+            check(0 == priorityq_size(q));
+            check(0 == priorityq_count_all(q));
+            check(0 == priorityq_size_done(q));
+            check(NULL == priorityq_dequeue(q));
+        }
+
+        it("should keep the order of the done queue")
+        {
+            priority_t ps[16];
+            priority_t *out[16];
+
+            int i;
+            for (i = 0; i < 16; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, PRIORITY_URGENT);
+                priorityq_enqueue(q, ps + i);
+            }
+
+            check(16 == priorityq_dequeue_batch(q, out, 16));
+            for (i = 0; i < 16; ++i)
+            {
+                check((ps + i) == out[i]);
+            }
+            check(0 == priorityq_count_done(q));
+            check(0 == priorityq_size(q));
+        }
+    }
+
+    describe("peek and advance")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should peek nothing when empty and not remove when peeking")
+        {
+            check(NULL == priorityq_peek(q));
+            check(!priorityq_advance(q, 100));
+
+            priority_set(p, NULL, 127);
+            priorityq_enqueue(q, p);
+            check(p == priorityq_peek(q));
+            check(p == priorityq_peek(q));
+            check(1 == priorityq_size(q));
+            check(priority_is_active(p));
+            check(p == priorityq_dequeue(q));
+            check(NULL == priorityq_peek(q));
+        }
+
+        it("should peek what dequeue returns next")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+
+            srand(1296);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                priorityq_enqueue(q, ps + i);
+            }
+
+            for (i = 0; i < n; ++i)
+            {
+                priority_t *next = priorityq_peek(q);
+                if (i % 3 == 0)
+                {
+                    // Urgent items go behind anything already ready.
+                    priority_set(p, NULL, PRIORITY_URGENT);
+                    priorityq_enqueue(q, p);
+                    check(next == priorityq_peek(q));
+                    priorityq_remove(q, p);
+                }
+                check(next == priorityq_dequeue(q), "index(%d)", i);
+            }
+            check(NULL == priorityq_peek(q));
+
+            free(ps);
+        }
+
+        it("should do bounded work and report when an item is ready")
+        {
+            priority_set(p, NULL, 127);
+            priorityq_enqueue(q, p);
+
+            check(!priorityq_advance(q, 0));
+            check(!priorityq_advance(q, 1));
+            check(0 == priorityq_size_done(q));
+
+            int steps = 1;
+            while (!priorityq_advance(q, 1))
+            {
+                ++steps;
+                check(steps < 1000);
+            }
+            check(1 == priorityq_size_done(q));
+            check(priorityq_advance(q, 1000));
+            check(p == priorityq_dequeue(q));
+        }
+    }
+
+    describe("bounded dequeue")
+    {
+        before_each()
+        {
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should take the closest item once the step limit runs out")
+        {
+            priorityq_init_bounded(q, 1);
+            priority_set(p, NULL, 127);
+            priorityq_enqueue(q, p);
+            check(p == priorityq_peek(q));
+            check(0 != priorityq_priority_counter(q));
+            check(p == priorityq_dequeue(q));
+            check(!priority_is_active(p));
+            check(0 == priorityq_size(q));
+            check(0 == priorityq_bin_mask(q));
+            check(0 == priorityq_count_all(q));
+            check(NULL == priorityq_dequeue(q));
+        }
+
+        it("should take exactly the step limit before falling back")
+        {
+            priorityq_t _r;
+            priorityq_t *r = &_r;
+            priority_t ps[4];
+            priority_t *out[1];
+            uint32_t limit;
+            int call;
+            for (limit = 1; limit <= 2; ++limit)
+            {
+                for (call = 0; call < 3; ++call)
+                {
+                    // The same items, then the reference takes the steps by hand.
+                    priorityq_init_bounded(q, limit);
+                    priorityq_init(r);
+                    int i;
+                    for (i = 0; i < 2; ++i)
+                    {
+                        priority_init(ps + i);
+                        priority_set(ps + i, NULL, 127);
+                        priorityq_enqueue(q, ps + i);
+                        priority_init(ps + 2 + i);
+                        priority_set(ps + 2 + i, NULL, 127);
+                        priorityq_enqueue(r, ps + 2 + i);
+                    }
+
+                    if (0 == call)
+                    {
+                        check(NULL != priorityq_peek(q));
+                    }
+                    else if (1 == call)
+                    {
+                        check(NULL != priorityq_dequeue(q));
+                    }
+                    else
+                    {
+                        check(1 == priorityq_dequeue_batch(q, out, 1));
+                    }
+                    check(!priorityq_advance(r, limit));
+                    check(priorityq_priority_counter(r) == priorityq_priority_counter(q),
+                          "limit(%u) call(%d)", limit, call);
+                    check(priorityq_bin_mask(r) == priorityq_bin_mask(q),
+                          "limit(%u) call(%d)", limit, call);
+                    priorityq_destroy(r);
+                }
+            }
+        }
+
+        it("should hand back every item once with a tight limit")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t *out[8];
+
+            priorityq_init_bounded(q, 2);
+            srand(1296);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                priorityq_enqueue(q, ps + i);
+            }
+
+            int taken = 0;
+            while (priorityq_size(q))
+            {
+                uint32_t count;
+                if (taken % 3)
+                {
+                    priority_t *next = priorityq_peek(q);
+                    check(next == priorityq_dequeue(q), "taken(%d)", taken);
+                    out[0] = next;
+                    count = 1;
+                }
+                else
+                {
+                    count = priorityq_dequeue_batch(q, out, 8);
+                    check(count, "taken(%d)", taken);
+                }
+
+                uint32_t j;
+                for (j = 0; j < count; ++j)
+                {
+                    check(!priority_is_active(out[j]));
+                    check(priority_value(out[j]) != 255);
+                    // Mark as seen.
+                    priority_set(out[j], NULL, 255);
+                }
+                taken += count;
+                check(priorityq_count_all(q) == priorityq_size(q));
+            }
+            check(n == taken);
+
+            free(ps);
+        }
+
+        it("should match the unbounded queue with a generous limit")
+        {
+            const int n = 512;
+            priorityq_t _q2;
+            priorityq_t *q2 = &_q2;
+            priority_t *ps = (priority_t *)malloc(2 * n * sizeof(priority_t));
+
+            priorityq_init_bounded(q, 1 << 16);
+            priorityq_init(q2);
+            srand(8196);
+
+            int i;
+            for (i = 0; i < 2 * n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 16 * n; ++step)
+            {
+                int index = rand() % n;
+                if (rand() % 3)
+                {
+                    uint8_t priority = (uint8_t)(rand() % (PQ_CEILING + 1));
+                    priority_set(ps + index, NULL, priority);
+                    priorityq_enqueue(q, ps + index);
+                    priority_set(ps + n + index, NULL, priority);
+                    priorityq_enqueue(q2, ps + n + index);
+                }
+                else
+                {
+                    priority_t *expected = priorityq_dequeue(q2);
+                    priority_t *actual = priorityq_dequeue(q);
+                    check((expected ? expected - n : NULL) == actual, "step(%d)", step);
+                }
+            }
+
+            priorityq_destroy(q2);
+            free(ps);
+        }
+    }
+
+    describe("batch enqueue")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should keep single-call order when reprioritizing mid-batch")
+        {
+            priority_t ps[4];
+            priority_t *batch[4] = { ps + 0, ps + 1, ps + 2, ps + 3 };
+            int i;
+            for (i = 0; i < 4; ++i)
+            {
+                priority_init(ps + i);
+            }
+            priority_set(ps + 1, NULL, 60);
+            priority_set(ps + 3, NULL, 20);
+            priorityq_enqueue(q, ps + 1);
+            priorityq_enqueue(q, ps + 3);
+
+            // New urgents around queued items moved to urgent and immediate.
+            priority_set(ps + 0, NULL, PRIORITY_URGENT);
+            priority_set(ps + 1, NULL, PRIORITY_URGENT);
+            priority_set(ps + 2, NULL, PRIORITY_URGENT);
+            priority_set(ps + 3, NULL, 0);
+            check(0 == priorityq_enqueue_batch(q, batch, 4));
+            check(4 == priorityq_size(q));
+            check(priorityq_count_all(q) == priorityq_size(q));
+            for (i = 0; i < 4; ++i)
+            {
+                check(ps + i == priorityq_dequeue(q), "i(%d)", i);
+            }
+        }
+
+        it("should match enqueueing one at a time")
+        {
+            const int n = 1024;
+            priorityq_t _q2;
+            priorityq_t *q2 = &_q2;
+            priority_t *as = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t *bs = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t **batch = (priority_t **)malloc(n * sizeof(priority_t *));
+
+            priorityq_init(q2);
+            srand(8196);
+
+            // Move the counter along so the batch isn't relative to zero.
+            priority_set(p, NULL, 100);
+            priorityq_enqueue(q, p);
+            check(p == priorityq_dequeue(q));
+            priorityq_enqueue(q2, p);
+            check(p == priorityq_dequeue(q2));
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                uint8_t priority = (uint8_t)(rand() % (PQ_CEILING + 1));
+                priority_init(as + i);
+                priority_init(bs + i);
+                priority_set(as + i, as + i, priority);
+                priority_set(bs + i, as + i, priority);
+                batch[i] = bs + i;
+                priorityq_enqueue(q, as + i);
+            }
+
+            priorityq_enqueue_batch(q2, batch, n);
+
+            check(priorityq_size(q) == priorityq_size(q2));
+            check(priorityq_size_done(q) == priorityq_size_done(q2));
+            check(priorityq_size_immediate(q) == priorityq_size_immediate(q2));
+            check(priorityq_size_q(q) == priorityq_size_q(q2));
+            check(priorityq_count_all(q2) == priorityq_size(q2));
+            for (i = 0; i < PQ_BINS; ++i)
+            {
+                check(priorityq_count_bin(q, i) == priorityq_count_bin(q2, i));
+            }
+
+            for (i = 0; i < n; ++i)
+            {
+                priority_t *a = priorityq_dequeue(q);
+                priority_t *b = priorityq_dequeue(q2);
+                check(priority_data(a) == priority_data(b), "index(%d)", i);
+            }
+            check(NULL == priorityq_dequeue(q2));
+
+            priorityq_destroy(q2);
+            free(batch);
+            free(bs);
+            free(as);
+        }
+
+        it("should reprioritize items already in the queue")
+        {
+            priority_t _a;
+            priority_t *a = &_a;
+            priority_t *batch[2] = { a, p };
+
+            priority_init(a);
+            priority_set(a, NULL, 64);
+            priority_set(p, NULL, 32);
+            priorityq_enqueue(q, p);
+
+            priority_set(p, NULL, PRIORITY_URGENT);
+            priorityq_enqueue_batch(q, batch, 2);
+            check(2 == priorityq_size(q));
+            check(2 == priorityq_count_all(q));
+            check(1 == priorityq_size_done(q));
+            check(p == priorityq_dequeue(q));
+            check(a == priorityq_dequeue(q));
+            check(NULL == priorityq_dequeue(q));
+
+            priority_destroy(a);
+        }
+    }
+
+    describe("aging rates")
+    {
+        it("should bring waiting items up sooner the faster they age")
+        {
+            const int filler = 8192;
+            priority_t *fs = (priority_t *)malloc(filler * sizeof(priority_t));
+            int waited[3];
+            int presets[3] = { PQ_AGING_FAIRNESS, PQ_AGING_BALANCED, PQ_AGING_THROUGHPUT };
+
+            int k;
+            for (k = 0; k < 3; ++k)
+            {
+                priorityq_init(q);
+                priorityq_set_aging(q, presets[k]);
+                int n;
+                for (n = 0; n < 2000; ++n)
+                {
+                    priority_init(fs + n);
+                    priority_set(fs + n, NULL, (uint8_t)(1 + n % 8));
+                    priorityq_enqueue(q, fs + n);
+                }
+                priority_init(p);
+                priority_set(p, NULL, 127);
+                priorityq_enqueue(q, p);
+
+                // Keep the queue full of pressing work until p comes out.
+                waited[k] = 1;
+                while (p != priorityq_dequeue(q) && n < filler)
+                {
+                    priority_init(fs + n);
+                    priority_set(fs + n, NULL, (uint8_t)(1 + n % 8));
+                    priorityq_enqueue(q, fs + n);
+                    ++n;
+                    ++waited[k];
+                }
+                check(n < filler);
+                priorityq_destroy(q);
+            }
+            check(waited[0] < waited[1], "fairness(%d) balanced(%d)", waited[0], waited[1]);
+            check(waited[1] < waited[2], "balanced(%d) throughput(%d)", waited[1], waited[2]);
+
+            free(fs);
+        }
+
+        it("should take zero as the default rate")
+        {
+            priorityq_init(q);
+            check(PQ_RATE_DEFAULT == q->aging);
+            check(PQ_RATE_DEFAULT == q->promotion);
+            priorityq_set_rates(q, 1, 0);
+            check(1 == q->aging);
+            check(PQ_RATE_DEFAULT == q->promotion);
+            priorityq_set_aging(q, PQ_AGING_BALANCED);
+            check(PQ_RATE_DEFAULT == q->aging);
+            priorityq_destroy(q);
+        }
+    }
+
+    describe("update")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should promote and demote")
+        {
+            priority_t _o;
+            priority_t *o = &_o;
+            priority_init(o);
+
+            priority_set(p, NULL, 10);
+            priority_set(o, NULL, 20);
+            priorityq_enqueue(q, p);
+            priorityq_enqueue(q, o);
+            priorityq_update(q, p, 30);
+            check(30 == priority_value(p));
+            check(o == priorityq_dequeue(q));
+            check(p == priorityq_dequeue(q));
+
+            priorityq_update(q, p, 10);
+            check(priority_is_active(p));
+            priority_set(o, NULL, 0);
+            priorityq_enqueue(q, o);
+            priorityq_update(q, o, 50);
+            priorityq_update(q, p, PRIORITY_URGENT);
+            check(p == priorityq_dequeue(q));
+            check(o == priorityq_dequeue(q));
+            check(0 == priorityq_size(q));
+            check(priorityq_count_all(q) == 0);
+
+            priority_destroy(o);
+        }
+
+        it("should credit the time already waited")
+        {
+            priority_t _o;
+            priority_t *o = &_o;
+            priority_init(o);
+
+            priority_set(p, NULL, 100);
+            priorityq_enqueue(q, p);
+            while (priorityq_priority_counter(q) < 60)
+            {
+                priority_set(o, NULL, 1);
+                priorityq_enqueue(q, o);
+                check(o == priorityq_dequeue(q));
+            }
+            uint8_t age = priorityq_priority_counter(q);
+            check(age < 100);
+
+            // Still has some way to go.
+            priorityq_update(q, p, age + 1);
+            check(1 == priorityq_size_q(q));
+            check(0 == priorityq_size_immediate(q));
+
+            // Has already waited long enough.
+            priorityq_update(q, p, age - 1);
+            check(0 == priorityq_size_q(q));
+            check(1 == priorityq_size_immediate(q));
+            check(p == priorityq_dequeue(q));
+
+            priority_destroy(o);
+        }
+
+        it("should enqueue a buried item as a new one")
+        {
+            struct priorityq_node_s reclaimed;
+            priorityq_list_init(&reclaimed);
+
+            priority_set(p, NULL, 0);
+            priorityq_enqueue(q, p);
+            priority_cancel(p);
+            check(NULL == priorityq_dequeue(q));
+            check(0 == priorityq_size(q));
+
+            check(NULL == priorityq_update(q, p, 5));
+            check(!priority_is_cancelled(p));
+            check(5 == priority_value(p));
+            check(1 == priorityq_size(q));
+            check(1 == priorityq_size_q(q));
+            check(p == priorityq_dequeue(q));
+            check(0 == priorityq_size(q));
+            priorityq_reclaim(q, &reclaimed);
+            check(NULL == priorityq_list_pop(&reclaimed));
+        }
+
+        it("should leave an item waiting in a timer there")
+        {
+            priorityq_timer_t _t;
+            priorityq_timer_t *t = &_t;
+            priority_timed_t ps[2];
+            priority_timed_init(ps + 0);
+            priority_timed_init(ps + 1);
+            priorityq_timer_init(t, 0);
+
+            priority_timed_set(ps + 0, NULL, 0, 0, PQ_TIMER_NEVER);
+            priority_timed_set(ps + 1, NULL, 100, 10, PQ_TIMER_NEVER);
+            priorityq_timer_schedule(t, ps + 0);
+            priorityq_timer_schedule(t, ps + 1);
+
+            priorityq_t *tq = priorityq_timer_queue(t);
+            check(NULL == priorityq_update(tq, &ps[1].p, PRIORITY_URGENT));
+            check(1 == priorityq_timer_waiting(t));
+            check(1 == priorityq_size(tq));
+
+            // Released with the new priority, ahead of the immediate one.
+            check(1 == priorityq_timer_advance(t, 10, NULL));
+            check(ps + 1 == priorityq_timer_dequeue(t));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+            check(NULL == priorityq_timer_dequeue(t));
+
+            priorityq_timer_destroy(t);
+        }
+
+        it("should not starve an item that keeps being demoted")
+        {
+            priority_t _o;
+            priority_t *o = &_o;
+            priority_init(o);
+
+            priority_set(p, NULL, 127);
+            priorityq_enqueue(q, p);
+
+            int i;
+            for (i = 0; i < 1000 && priority_is_active(p); ++i)
+            {
+                priorityq_update(q, p, 127);
+                priority_set(o, NULL, 1);
+                priorityq_enqueue(q, o);
+                priorityq_dequeue(q);
+            }
+            check(i < 1000);
+
+            priorityq_remove(q, o);
+            priority_destroy(o);
+        }
+
+        it("should keep the queue consistent under random updates")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+
+            srand(8196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 16 * n; ++step)
+            {
+                int index = rand() % n;
+                switch (rand() % 4)
+                {
+                    case 0:
+                        priorityq_dequeue(q);
+                        break;
+                    case 1:
+                        priorityq_remove(q, ps + index);
+                        break;
+                    default:
+                        priorityq_update(q, ps + index, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                        break;
+                }
+                check(priorityq_size_q(q) == priorityq_count_q(q), "step(%d)", step);
+                check(priorityq_size_immediate(q) == priorityq_count_immediate(q), "step(%d)", step);
+                check(priorityq_size_done(q) == priorityq_count_done(q), "step(%d)", step);
+            }
+
+            uint32_t size = priorityq_size(q);
+            while (priorityq_dequeue(q))
+            {
+                --size;
+            }
+            check(0 == size);
+
+            free(ps);
+        }
+    }
+
+    describe("eviction")
+    {
+        priority_t ps[8];
+
+        before_each()
+        {
+            priorityq_init(q);
+            int i;
+            for (i = 0; i < 8; ++i)
+            {
+                priority_init(ps + i);
+            }
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should evict the farthest out first and never done items")
+        {
+            priority_t *out[8];
+
+            priority_set(ps + 0, NULL, 1);
+            priority_set(ps + 1, NULL, 100);
+            priority_set(ps + 2, NULL, PRIORITY_URGENT);
+            priority_set(ps + 3, NULL, 0);
+            priority_set(ps + 4, NULL, 20);
+            int i;
+            for (i = 0; i < 5; ++i)
+            {
+                priorityq_enqueue(q, ps + i);
+            }
+
+            check(1 == priorityq_evict(q, 1, out));
+            check(ps + 1 == out[0]);
+            check(!priority_is_active(ps + 1));
+            check(3 == priorityq_evict(q, 8, out));
+            check(ps + 4 == out[0]);
+            check(ps + 0 == out[1]);
+            check(ps + 3 == out[2]);
+            check(0 == priorityq_evict(q, 8, out));
+            check(1 == priorityq_size(q));
+            check(ps + 2 == priorityq_dequeue(q));
+        }
+
+        it("should reject new items at capacity")
+        {
+            priorityq_set_capacity(q, 2, PQ_OVERFLOW_REJECT);
+
+            priority_set(ps + 0, NULL, 10);
+            priority_set(ps + 1, NULL, 20);
+            priority_set(ps + 2, NULL, 5);
+            check(NULL == priorityq_enqueue(q, ps + 0));
+            check(NULL == priorityq_enqueue(q, ps + 1));
+            check(ps + 2 == priorityq_enqueue(q, ps + 2));
+            check(!priority_is_active(ps + 2));
+            check(2 == priorityq_size(q));
+
+            // Reprioritizing isn't a new item.
+            priority_set(ps + 1, NULL, 1);
+            check(NULL == priorityq_enqueue(q, ps + 1));
+            check(ps + 1 == priorityq_dequeue(q));
+            check(NULL == priorityq_enqueue(q, ps + 2));
+        }
+
+        it("should evict the least urgent item at capacity")
+        {
+            priorityq_set_capacity(q, 2, PQ_OVERFLOW_EVICT);
+
+            priority_set(ps + 0, NULL, 10);
+            priority_set(ps + 1, NULL, 100);
+            priority_set(ps + 2, NULL, 5);
+            priority_set(ps + 3, NULL, 120);
+            priorityq_enqueue(q, ps + 0);
+            priorityq_enqueue(q, ps + 1);
+            check(ps + 1 == priorityq_enqueue(q, ps + 2));
+            check(ps + 3 == priorityq_enqueue(q, ps + 3));
+            check(2 == priorityq_size(q));
+
+            priority_t *batch[4] = { ps + 4, ps + 5, ps + 6, ps + 7 };
+            int i;
+            for (i = 0; i < 4; ++i)
+            {
+                priority_set(batch[i], NULL, (uint8_t)(30 + i));
+            }
+            check(4 == priorityq_enqueue_batch(q, batch, 4));
+            check(2 == priorityq_size(q));
+            check(ps + 2 == priorityq_dequeue(q));
+            check(ps + 0 == priorityq_dequeue(q));
+        }
+    }
+
+    describe("cancellation")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should skip and reclaim cancelled items wherever they are")
+        {
+            priority_t ps[8];
+            struct priorityq_node_s reclaimed;
+            priorityq_list_init(&reclaimed);
+
+            uint8_t priorities[8] = { PRIORITY_URGENT, 0, 1, 5, 40, 90, 127, 3 };
+            int i;
+            for (i = 0; i < 8; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, priorities[i]);
+                priorityq_enqueue(q, ps + i);
+            }
+            for (i = 0; i < 8; i += 2)
+            {
+                priority_cancel(ps + i);
+                check(priority_is_cancelled(ps + i));
+            }
+            check(!priority_is_cancelled(ps + 1));
+
+            int dequeued = 0;
+            priority_t *d;
+            while ((d = priorityq_dequeue(q)))
+            {
+                check(!priority_is_cancelled(d));
+                ++dequeued;
+            }
+            check(4 == dequeued);
+            check(0 == priorityq_size(q));
+
+            priorityq_reclaim(q, &reclaimed);
+            int count = 0;
+            while ((d = priorityq_list_pop(&reclaimed)))
+            {
+                check(priority_is_cancelled(d));
+                check(!priority_is_active(d));
+                ++count;
+            }
+            check(4 == count);
+
+            // Setting the priority again keeps the mark, adding it afresh clears it.
+            priority_set(ps + 0, NULL, 7);
+            check(priority_is_cancelled(ps + 0));
+            priorityq_enqueue(q, ps + 0);
+            check(!priority_is_cancelled(ps + 0));
+            check(ps + 0 == priorityq_dequeue(q));
+        }
+
+        it("should keep a cancel when an active item is reprioritized")
+        {
+            priority_t ps[2];
+            struct priorityq_node_s reclaimed;
+            priorityq_list_init(&reclaimed);
+            int i;
+            for (i = 0; i < 2; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, 10);
+                priorityq_enqueue(q, ps + i);
+            }
+
+            priority_cancel(ps + 0);
+            priority_set(ps + 0, NULL, PRIORITY_URGENT);
+            priorityq_enqueue(q, ps + 0);
+            check(priority_is_cancelled(ps + 0));
+            check(ps + 1 == priorityq_dequeue(q));
+            check(NULL == priorityq_dequeue(q));
+
+            priorityq_reclaim(q, &reclaimed);
+            check(ps + 0 == priorityq_list_pop(&reclaimed));
+            check(NULL == priorityq_list_pop(&reclaimed));
+        }
+
+        it("should skip cancelled items in peek and batches and remove buried ones")
+        {
+            priority_t ps[4];
+            priority_t *out[4];
+            int i;
+            for (i = 0; i < 4; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, 0);
+                priorityq_enqueue(q, ps + i);
+            }
+
+            priority_cancel(ps + 0);
+            check(ps + 1 == priorityq_peek(q));
+            check(3 == priorityq_size(q));
+            check(priority_is_active(ps + 0));
+            priorityq_remove(q, ps + 0);
+            check(!priority_is_active(ps + 0));
+            check(3 == priorityq_size(q));
+
+            priority_cancel(ps + 2);
+            check(2 == priorityq_dequeue_batch(q, out, 4));
+            check(ps + 1 == out[0]);
+            check(ps + 3 == out[1]);
+            check(0 == priorityq_size(q));
+
+            priorityq_enqueue(q, ps + 1);
+            priority_cancel(ps + 1);
+            check(NULL == priorityq_peek(q));
+            check(NULL == priorityq_dequeue(q));
+        }
+
+        it("should empty out when every remaining item is cancelled in processing")
+        {
+            priority_t ps[4];
+            priority_t *out[4];
+            struct priorityq_node_s reclaimed;
+            int round;
+            for (round = 0; round < 3; ++round)
+            {
+                priorityq_list_init(&reclaimed);
+                if (round)
+                {
+                    priorityq_init_bounded(q, (uint32_t)round);
+                }
+                int i;
+                for (i = 0; i < 4; ++i)
+                {
+                    priority_init(ps + i);
+                    priority_set(ps + i, NULL, (uint8_t)(20 + i));
+                    priorityq_enqueue(q, ps + i);
+                }
+                check(!priorityq_advance(q, 1));
+                check(4 == priorityq_size_q(q));
+                for (i = 0; i < 4; ++i)
+                {
+                    priority_cancel(ps + i);
+                }
+
+                if (1 == round)
+                {
+                    check(0 == priorityq_dequeue_batch(q, out, 4), "round(%d)", round);
+                }
+                else
+                {
+                    check(NULL == priorityq_dequeue(q), "round(%d)", round);
+                }
+                check(0 == priorityq_size(q), "round(%d)", round);
+                check(NULL == priorityq_peek(q));
+
+                priorityq_reclaim(q, &reclaimed);
+                int count = 0;
+                while (priorityq_list_pop(&reclaimed))
+                {
+                    ++count;
+                }
+                check(4 == count, "round(%d)", round);
+            }
+        }
+
+        it("should take a buried item back as a new one")
+        {
+            priority_t ps[10];
+            uint8_t again[3] = { PRIORITY_URGENT, 5, 0 };
+            int round;
+            for (round = 0; round < 3; ++round)
+            {
+                int i;
+                for (i = 0; i < 10; ++i)
+                {
+                    priority_init(ps + i);
+                    priority_set(ps + i, NULL, 0);
+                    priorityq_enqueue(q, ps + i);
+                }
+                priority_cancel(ps + 0);
+                check(ps + 1 == priorityq_dequeue(q));
+                check(priority_is_active(ps + 0));
+                check(8 == priorityq_size(q));
+
+                if (2 == round)
+                {
+                    priorityq_set_capacity(q, 8, PQ_OVERFLOW_REJECT);
+                }
+                priority_set(ps + 0, NULL, again[round]);
+                priority_t *displaced = priorityq_enqueue(q, ps + 0);
+                if (2 == round)
+                {
+                    check(ps + 0 == displaced);
+                    check(!priority_is_active(ps + 0));
+                    check(8 == priorityq_size(q));
+                    priorityq_set_capacity(q, 0, PQ_OVERFLOW_REJECT);
+                }
+                else
+                {
+                    check(NULL == displaced);
+                    check(9 == priorityq_size(q));
+                }
+                check(priorityq_count_all(q) == priorityq_size(q), "round(%d)", round);
+
+                int dequeued = 0;
+                bool seen = false;
+                priority_t *d;
+                while ((d = priorityq_dequeue(q)))
+                {
+                    seen |= ps + 0 == d;
+                    ++dequeued;
+                }
+                check(seen == (2 != round), "round(%d)", round);
+                check((2 == round ? 8 : 9) == dequeued, "round(%d)", round);
+                check(0 == priorityq_count_all(q));
+                check(!priority_is_active(ps + 0));
+            }
+        }
+
+        it("should take cancels from another thread")
+        {
+            priority_t *ps = (priority_t *)malloc(CANCELLED * sizeof(priority_t));
+            struct priorityq_node_s reclaimed;
+            priorityq_list_init(&reclaimed);
+
+            int i;
+            for (i = 0; i < CANCELLED; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(i % PQ_CEILING));
+                priorityq_enqueue(q, ps + i);
+            }
+
+            pthread_t thread;
+            check(0 == pthread_create(&thread, NULL, canceller_run, ps));
+            int dequeued = 0;
+            while (priorityq_dequeue(q))
+            {
+                ++dequeued;
+            }
+            pthread_join(thread, NULL);
+
+            priorityq_reclaim(q, &reclaimed);
+            int count = 0;
+            while (priorityq_list_pop(&reclaimed))
+            {
+                ++count;
+            }
+            check(CANCELLED == dequeued + count);
+            check(count <= CANCELLED / 2);
+
+            free(ps);
+        }
+    }
+
+    describe("merge")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should keep the order of ready items and take everything")
+        {
+            priorityq_t _q2;
+            priorityq_t *q2 = &_q2;
+            priority_t ps[8];
+
+            priorityq_init(q2);
+            int i;
+            for (i = 0; i < 8; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, PRIORITY_URGENT);
+                priorityq_enqueue(i < 4 ? q : q2, ps + i);
+            }
+
+            priorityq_merge(q, q2);
+            check(0 == priorityq_size(q2));
+            check(0 == priorityq_count_all(q2));
+            check(NULL == priorityq_dequeue(q2));
+            check(8 == priorityq_size(q));
+            for (i = 0; i < 8; ++i)
+            {
+                check(ps + i == priorityq_dequeue(q));
+            }
+
+            priorityq_destroy(q2);
+        }
+
+        it("should merge queues whose counters agree or disagree")
+        {
+            const int n = 256;
+            priorityq_t _q2;
+            priorityq_t *q2 = &_q2;
+            priority_t *ps = (priority_t *)malloc(2 * n * sizeof(priority_t));
+            int *seen = (int *)calloc(2 * n, sizeof(int));
+
+            srand(8196);
+
+            int round;
+            for (round = 0; round < 16; ++round)
+            {
+                priorityq_init(q);
+                priorityq_init(q2);
+
+                int i;
+                for (i = 0; i < 2 * n; ++i)
+                {
+                    priority_init(ps + i);
+                    priority_set(ps + i, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                    priorityq_enqueue(i < n ? q : q2, ps + i);
+                    seen[i] = 0;
+                }
+                // Odd rounds move the counters apart.
+                int drop = round & 1 ? rand() % n : 0;
+                for (i = 0; i < drop; ++i)
+                {
+                    seen[priorityq_dequeue(q2) - ps] = 1;
+                }
+                uint32_t size = priorityq_size(q) + priorityq_size(q2);
+
+                priorityq_merge(q, q2);
+                check(0 == priorityq_size(q2));
+                check(size == priorityq_size(q));
+                check(size == priorityq_count_all(q), "round(%d)", round);
+                check(priorityq_size_q(q) == priorityq_count_q(q), "round(%d)", round);
+                check(priorityq_size_immediate(q) == priorityq_count_immediate(q));
+                for (i = 0; i < PQ_BINS; ++i)
+                {
+                    check(!!priorityq_count_bin(q, i) == !!(priorityq_bin_mask(q) & (1 << i)));
+                }
+                priorityq_depths_t depths;
+                priorityq_depths(q, &depths);
+                uint32_t bins = 0;
+                for (i = 0; i < PQ_BINS; ++i)
+                {
+                    check(priorityq_count_bin(q, i) == depths.bins[i], "round(%d)", round);
+                    bins += depths.bins[i];
+                }
+                check(priorityq_count_q(q) - bins == depths.processing, "round(%d)", round);
+
+                priority_t *p;
+                while ((p = priorityq_dequeue(q)))
+                {
+                    check(!seen[p - ps]);
+                    seen[p - ps] = 1;
+                }
+                for (i = 0; i < 2 * n; ++i)
+                {
+                    check(seen[i]);
+                }
+                priorityq_destroy(q2);
+            }
+
+            free(seen);
+            free(ps);
+        }
+    }
+
+    describe("drain and clear")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should drain every item into a list and reset them as they are popped")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            int *seen = (int *)calloc(n, sizeof(int));
+            struct priorityq_node_s out;
+
+            srand(1296);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                priorityq_enqueue(q, ps + i);
+                if (i % 4 == 0)
+                {
+                    priorityq_dequeue(q);
+                }
+            }
+            uint32_t size = priorityq_size(q);
+
+            priorityq_list_init(&out);
+            check(NULL == priorityq_list_pop(&out));
+            priorityq_drain(q, &out);
+            check(0 == priorityq_size(q));
+            check(0 == priorityq_bin_mask(q));
+            check(0 == priorityq_count_all(q));
+            check(NULL == priorityq_dequeue(q));
+
+            uint32_t count = 0;
+            priority_t *p;
+            while ((p = priorityq_list_pop(&out)))
+            {
+                check(!seen[p - ps]);
+                check(!priority_is_active(p));
+                seen[p - ps] = 1;
+                ++count;
+            }
+            check(size == count);
+
+            // Popped items can go straight back in.
+            for (i = 0; i < n; ++i)
+            {
+                if (seen[i])
+                {
+                    priorityq_enqueue(q, ps + i);
+                }
+            }
+            check(size == priorityq_size(q));
+            check(size == priorityq_count_all(q));
+            while (priorityq_dequeue(q)) {}
+
+            free(seen);
+            free(ps);
+        }
+
+        it("should clear and reset the items")
+        {
+            const int n = 64;
+            priority_t ps[64];
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)i);
+                priorityq_enqueue(q, ps + i);
+            }
+            // One buried, one done and one cancelled in a bin.
+            priority_cancel(ps + 0);
+            check(ps + 1 == priorityq_peek(q));
+            priorityq_update(q, ps + 2, PRIORITY_URGENT);
+            priority_cancel(ps + 40);
+
+            priorityq_clear(q);
+            check(0 == priorityq_size(q));
+            check(0 == priorityq_count_all(q));
+            check(NULL == priorityq_dequeue(q));
+            for (i = 0; i < n; ++i)
+            {
+                check(!priority_is_active(ps + i));
+            }
+
+            // Enqueued again as they are, without priority_init.
+            for (i = 0; i < n; ++i)
+            {
+                priority_set(ps + i, NULL, (uint8_t)i);
+                priorityq_enqueue(q, ps + i);
+            }
+            check(n == (int)priorityq_size(q));
+            check(n == (int)priorityq_count_all(q));
+            for (i = 0; i < n; ++i)
+            {
+                check(ps + i == priorityq_dequeue(q));
+            }
+        }
+    }
+
+    describe("snapshot and restore")
+    {
+        it("should restore a queue that dequeues identically")
+        {
+            const int n = 4096;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t *rs = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t **nodes = (priority_t **)malloc(n * sizeof(priority_t *));
+            priorityq_t _r;
+            priorityq_t *r = &_r;
+
+            srand(196);
+            priorityq_init_bounded(q, 64);
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                priorityq_enqueue(q, ps + i);
+                if (0 == i % 3)
+                {
+                    priorityq_dequeue(q);
+                }
+            }
+            // Leave some items part way through processing.
+            priorityq_advance(q, 3);
+
+            void *buf = malloc(priorityq_snapshot_size(q));
+            size_t size = priorityq_snapshot(q, buf, snapshot_id, ps);
+            check(size == priorityq_snapshot_size(q));
+
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(rs + i);
+                nodes[i] = rs + i;
+            }
+            check(priorityq_restore(r, buf, size, nodes, n));
+            check(priorityq_size(q) == priorityq_size(r));
+            check(priorityq_bin_mask(q) == priorityq_bin_mask(r));
+            check(priorityq_count_all(r) == priorityq_size(r));
+
+            priority_t *a;
+            while ((a = priorityq_dequeue(q)))
+            {
+                priority_t *b = priorityq_dequeue(r);
+                check(b && (a - ps) == (b - rs));
+            }
+            check(NULL == priorityq_dequeue(r));
+
+            free(buf);
+            free(nodes);
+            free(rs);
+            free(ps);
+            priorityq_destroy(q);
+        }
+
+        it("should reject buffers that aren't snapshots for the nodes")
+        {
+            priority_t *nodes[1] = { p };
+            priorityq_t _r;
+            priorityq_t *r = &_r;
+
+            priorityq_init(q);
+            priority_init(p);
+            priority_set(p, NULL, 5);
+            priorityq_enqueue(q, p);
+
+            uint32_t buf[64];
+            size_t size = priorityq_snapshot(q, buf, snapshot_id, p);
+            priorityq_remove(q, p);
+
+            check(!priorityq_restore(r, buf, size - 1, nodes, 1));
+            check(!priorityq_restore(r, buf, size, nodes, 0));
+            check(0 == priorityq_size(r));
+            check(priorityq_restore(r, buf, size, nodes, 1));
+            check(p == priorityq_dequeue(r));
+
+            ((uint8_t *)buf)[0] ^= 1;
+            check(!priorityq_restore(r, buf, size, nodes, 1));
+
+            priorityq_destroy(q);
+        }
+
+        it("should reject duplicate ids and mislabeled records untouched")
+        {
+            priority_t ps[2];
+            priority_t *nodes[2] = { ps + 0, ps + 1 };
+            priorityq_t _r;
+            priorityq_t *r = &_r;
+
+            priorityq_init(q);
+            priority_init(ps + 0);
+            priority_init(ps + 1);
+            priority_set(ps + 0, NULL, 5);
+            priority_set(ps + 1, NULL, 0);
+            priorityq_enqueue(q, ps + 0);
+            priorityq_enqueue(q, ps + 1);
+
+            uint32_t buf[64];
+            size_t size = priorityq_snapshot(q, buf, snapshot_id, ps);
+            priorityq_remove(q, ps + 0);
+            priorityq_remove(q, ps + 1);
+            // Two 12 byte records of id, info and list; the immediate one first.
+            uint8_t *records = (uint8_t *)buf + size - 24;
+            uint32_t *first = (uint32_t *)records;
+            uint32_t *second = (uint32_t *)(records + 12);
+            uint8_t *second_loc = records + 12 + 4 + 2;
+            check(1 == *first);
+            check(0 == *second);
+
+            *second = 1;
+            check(!priorityq_restore(r, buf, size, nodes, 2));
+            check(0 == priorityq_size(r));
+            check(!priority_is_active(ps + 0));
+            check(!priority_is_active(ps + 1));
+            *second = 0;
+
+            uint8_t loc = *second_loc;
+            *second_loc = loc + 1;
+            check(!priorityq_restore(r, buf, size, nodes, 2));
+            check(!priority_is_active(ps + 0));
+            check(!priority_is_active(ps + 1));
+            *second_loc = loc;
+
+            check(priorityq_restore(r, buf, size, nodes, 2));
+            check(ps + 1 == priorityq_dequeue(r));
+            check(ps + 0 == priorityq_dequeue(r));
+
+            priorityq_destroy(q);
+        }
+    }
+
+    describe("bin mask")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should track exactly which bins are non-empty")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+
+            check(0 == priorityq_bin_mask(q));
+            srand(196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 8 * n; ++step)
+            {
+                priority_t *r = ps + (rand() % n);
+                switch (rand() % 4)
+                {
+                    case 0:
+                        priorityq_remove(q, r);
+                        break;
+                    case 1:
+                        priorityq_dequeue(q);
+                        break;
+                    default:
+                        priority_set(r, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                        priorityq_enqueue(q, r);
+                        break;
+                }
+
+                uint8_t expected = 0;
+                for (i = 0; i < PQ_BINS; ++i)
+                {
+                    if (priorityq_count_bin(q, i))
+                    {
+                        expected |= (uint8_t)(1 << i);
+                    }
+                }
+                check(expected == priorityq_bin_mask(q), "step(%d) %u vs %u",
+                      step, (uint32_t)expected, (uint32_t)priorityq_bin_mask(q));
+                check(priorityq_count_done(q) == priorityq_size_done(q), "step(%d)", step);
+                check(priorityq_count_immediate(q) == priorityq_size_immediate(q), "step(%d)", step);
+            }
+
+            while (priorityq_dequeue(q)) {}
+            check(0 == priorityq_bin_mask(q));
+            free(ps);
+        }
+    }
+
+    describe("depths")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should keep every depth exact under random operations")
+        {
+            const int n = 512;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            priority_t *out[4];
+            priorityq_depths_t depths;
+
+            srand(8196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 16 * n; ++step)
+            {
+                int index = rand() % n;
+                switch (rand() % 6)
+                {
+                    case 0:
+                        priorityq_remove(q, ps + index);
+                        break;
+                    case 1:
+                        priorityq_dequeue(q);
+                        break;
+                    case 2:
+                        priorityq_dequeue_batch(q, out, 4);
+                        break;
+                    case 3:
+                        priorityq_evict(q, 1, out);
+                        break;
+                    default:
+                        priority_set(ps + index, NULL, (uint8_t)(rand() % (PQ_CEILING + 1)));
+                        priorityq_enqueue(q, ps + index);
+                        break;
+                }
+
+                priorityq_depths(q, &depths);
+                uint32_t bins = 0;
+                for (i = 0; i < PQ_BINS; ++i)
+                {
+                    check(priorityq_count_bin(q, i) == depths.bins[i], "step(%d) bin(%d)", step, i);
+                    bins += depths.bins[i];
+                }
+                check(priorityq_count_q(q) - bins == depths.processing, "step(%d)", step);
+                check(priorityq_count_done(q) == depths.done, "step(%d)", step);
+                check(priorityq_count_immediate(q) == depths.immediate, "step(%d)", step);
+            }
+
+            free(ps);
+        }
+    }
+
+#ifdef PQ_STATS
+    describe("statistics")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+            priority_init(p);
+        }
+
+        after_each()
+        {
+            priority_destroy(p);
+            priorityq_destroy(q);
+        }
+
+        it("should count advances, reprioritizations, and dequeue steps")
+        {
+            priorityq_stats_t stats;
+
+            priority_set(p, NULL, 127);
+            priorityq_enqueue(q, p);
+            check(p == priorityq_dequeue(q));
+            priorityq_stats(q, &stats);
+            check(stats.counter_advances > 0);
+            check(stats.rebinned > 0);
+            check(stats.rebinned_max == 1);
+            check(stats.dequeue_steps_max > 1);
+
+            uint64_t calls = 0;
+            int i;
+            for (i = 0; i < PQ_STATS_HISTOGRAM; ++i)
+            {
+                calls += stats.dequeue_steps[i];
+            }
+            check(1 == calls);
+
+            priority_set(p, NULL, 10);
+            priorityq_enqueue(q, p);
+            priority_set(p, NULL, 20);
+            priorityq_enqueue(q, p);
+            priority_set(p, NULL, 5);
+            priorityq_enqueue(q, p);
+            priority_set(p, NULL, PRIORITY_URGENT);
+            priorityq_enqueue(q, p);
+            priorityq_enqueue(q, p);
+            priorityq_stats(q, &stats);
+            check(2 == stats.reprioritized);
+            check(2 == stats.reprioritize_ignored);
+            check(p == priorityq_dequeue(q));
+        }
+    }
+#endif
+
+    describe("slab allocator")
+    {
+        it("should hand out aligned, adjacent priorities and recycle them")
+        {
+            priorityq_slab_t _slab;
+            priorityq_slab_t *slab = &_slab;
+            priority_t *ps[100];
+
+            priorityq_slab_init(slab, 10);
+            check(0 == priorityq_slab_used(slab));
+
+            int i;
+            for (i = 0; i < 100; ++i)
+            {
+                ps[i] = priorityq_slab_alloc(slab);
+                check(NULL != ps[i]);
+                check(!priority_is_active(ps[i]));
+                check(0 == priority_value(ps[i]));
+            }
+            check(100 == priorityq_slab_used(slab));
+            check(0 == ((uintptr_t)ps[0] % PQ_CACHE_LINE));
+            check((ps[0] + 1) == ps[1]);
+
+            for (i = 0; i < 100; ++i)
+            {
+                priority_set(ps[i], NULL, (uint8_t)(i % PQ_CEILING));
+                priorityq_init(q);
+                priorityq_enqueue(q, ps[i]);
+                check(ps[i] == priorityq_dequeue(q));
+                priorityq_slab_free(slab, ps[i]);
+            }
+            check(0 == priorityq_slab_used(slab));
+
+            // Most recently freed is handed out first.
+            check(ps[99] == priorityq_slab_alloc(slab));
+            check(ps[98] == priorityq_slab_alloc(slab));
+            check(2 == priorityq_slab_used(slab));
+
+            priorityq_slab_destroy(slab);
+        }
+    }
+
+    describe("compact priority queue")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should init, size is zero, get nothing, and destroy")
+        {
+            priorityq_compact_t _c;
+            priorityq_compact_t *c = &_c;
+            priority_compact_t arena[PQ_COMPACT_ARENA(4)];
+
+            check(12 == sizeof(priority_compact_t));
+            priorityq_compact_init(c, arena, 4);
+            check(0 == priorityq_compact_size(c));
+            check(PQ_COMPACT_NONE == priorityq_compact_dequeue(c));
+            check(!priority_compact_is_active(priorityq_compact_node(c, 3)));
+
+            priority_compact_set(priorityq_compact_node(c, 3), 7);
+            check(7 == priority_compact_value(priorityq_compact_node(c, 3)));
+            priorityq_compact_enqueue(c, 3);
+            check(1 == priorityq_compact_size(c));
+            check(priority_compact_is_active(priorityq_compact_node(c, 3)));
+            priorityq_compact_remove(c, 3);
+            check(0 == priorityq_compact_size(c));
+            priorityq_compact_remove(c, 3);
+            check(0 == priorityq_compact_size(c));
+            check(!priority_compact_is_active(priorityq_compact_node(c, 3)));
+
+            priorityq_compact_destroy(c);
+        }
+
+        it("should behave exactly like the pointer based queue")
+        {
+            const int n = 512;
+            priorityq_compact_t _c;
+            priorityq_compact_t *c = &_c;
+            priority_compact_t *arena = (priority_compact_t *)malloc(PQ_COMPACT_ARENA(n) * sizeof(priority_compact_t));
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+
+            priorityq_compact_init(c, arena, n);
+            srand(8196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 16 * n; ++step)
+            {
+                int index = rand() % n;
+                switch (rand() % 4)
+                {
+                    case 0:
+                        priorityq_remove(q, ps + index);
+                        priorityq_compact_remove(c, index);
+                        break;
+                    case 1:
+                    {
+                        priority_t *expected = priorityq_dequeue(q);
+                        uint32_t actual = priorityq_compact_dequeue(c);
+                        if (expected)
+                        {
+                            check((uint32_t)(expected - ps) == actual, "step(%d)", step);
+                        }
+                        else
+                        {
+                            check(PQ_COMPACT_NONE == actual, "step(%d)", step);
+                        }
+                        break;
+                    }
+                    default:
+                    {
+                        uint8_t priority = (uint8_t)(rand() % (PQ_CEILING + 1));
+                        priority_set(ps + index, NULL, priority);
+                        priorityq_enqueue(q, ps + index);
+                        priority_compact_set(priorityq_compact_node(c, index), priority);
+                        priorityq_compact_enqueue(c, index);
+                        break;
+                    }
+                }
+                check(priorityq_size(q) == priorityq_compact_size(c), "step(%d)", step);
+            }
+
+            priority_t *expected;
+            while ((expected = priorityq_dequeue(q)))
+            {
+                check((uint32_t)(expected - ps) == priorityq_compact_dequeue(c));
+            }
+            check(PQ_COMPACT_NONE == priorityq_compact_dequeue(c));
+
+            priorityq_compact_destroy(c);
+            free(ps);
+            free(arena);
+        }
+    }
+
+    describe("segmented priority queue")
+    {
+        before_each()
+        {
+            priorityq_init(q);
+        }
+
+        after_each()
+        {
+            priorityq_destroy(q);
+        }
+
+        it("should init, size is zero, get nothing, and destroy")
+        {
+            priorityq_seg_t _c;
+            priorityq_seg_t *c = &_c;
+            priority_seg_t arena[4];
+
+            check(16 == sizeof(priority_seg_t));
+            priorityq_seg_init(c, arena, 4);
+            check(0 == priorityq_seg_size(c));
+            check(PQ_SEG_NONE == priorityq_seg_dequeue(c));
+            check(!priority_seg_is_active(priorityq_seg_node(c, 3)));
+
+            priority_seg_set(priorityq_seg_node(c, 3), 7);
+            check(7 == priority_seg_value(priorityq_seg_node(c, 3)));
+            check(priorityq_seg_enqueue(c, 3));
+            check(1 == priorityq_seg_size(c));
+            check(priority_seg_is_active(priorityq_seg_node(c, 3)));
+            priorityq_seg_remove(c, 3);
+            check(0 == priorityq_seg_size(c));
+            priorityq_seg_remove(c, 3);
+            check(0 == priorityq_seg_size(c));
+            check(!priority_seg_is_active(priorityq_seg_node(c, 3)));
+
+            priorityq_seg_destroy(c);
+        }
+
+        it("should behave exactly like the linked queue")
+        {
+            const int n = 2048;
+            priorityq_seg_t _c;
+            priorityq_seg_t *c = &_c;
+            priority_seg_t *arena = (priority_seg_t *)malloc(n * sizeof(priority_seg_t));
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+
+            priorityq_seg_init(c, arena, n);
+            srand(8196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 16 * n; ++step)
+            {
+                int index = rand() % n;
+                switch (rand() % 4)
+                {
+                    case 0:
+                        priorityq_remove(q, ps + index);
+                        priorityq_seg_remove(c, index);
+                        break;
+                    case 1:
+                    {
+                        priority_t *expected = priorityq_dequeue(q);
+                        uint32_t actual = priorityq_seg_dequeue(c);
+                        if (expected)
+                        {
+                            check((uint32_t)(expected - ps) == actual, "step(%d)", step);
+                        }
+                        else
+                        {
+                            check(PQ_SEG_NONE == actual, "step(%d)", step);
+                        }
+                        break;
+                    }
+                    default:
+                    {
+                        uint8_t priority = (uint8_t)(rand() % (PQ_CEILING + 1));
+                        priority_set(ps + index, NULL, priority);
+                        priorityq_enqueue(q, ps + index);
+                        priority_seg_set(priorityq_seg_node(c, index), priority);
+                        check(priorityq_seg_enqueue(c, index));
+                        break;
+                    }
+                }
+                check(priorityq_size(q) == priorityq_seg_size(c), "step(%d)", step);
+            }
+
+            priority_t *expected;
+            while ((expected = priorityq_dequeue(q)))
+            {
+                check((uint32_t)(expected - ps) == priorityq_seg_dequeue(c));
+            }
+            check(PQ_SEG_NONE == priorityq_seg_dequeue(c));
+
+            priorityq_seg_destroy(c);
+            free(ps);
+            free(arena);
+        }
+    }
+
+    describe("wide priority queues")
+    {
+        it("should process priorities in order when added out of order")
+        {
+            const int n = 1024;
+            priorityq16_t _q16;
+            priorityq16_t *q16 = &_q16;
+            priority16_t *p16 = (priority16_t *)malloc((n + 1) * sizeof(priority16_t));
+            priorityq32_t _q32;
+            priorityq32_t *q32 = &_q32;
+            priority32_t *p32 = (priority32_t *)malloc((n + 1) * sizeof(priority32_t));
+
+            priorityq16_init(q16);
+            priorityq32_init(q32);
+
+            int i = n;
+            while (i--)
+            {
+                priority16_init(p16 + i);
+                priority16_set(p16 + i, NULL, (uint16_t)(i * (PQ16_CEILING / n)));
+                priorityq16_enqueue(q16, p16 + i);
+                priority32_init(p32 + i);
+                priority32_set(p32 + i, NULL, (uint32_t)i * (PQ32_CEILING / n));
+                priorityq32_enqueue(q32, p32 + i);
+            }
+            priority16_init(p16 + n);
+            priority16_set(p16 + n, NULL, PRIORITY16_URGENT);
+            priorityq16_enqueue(q16, p16 + n);
+            priority32_init(p32 + n);
+            priority32_set(p32 + n, NULL, PRIORITY32_URGENT);
+            priorityq32_enqueue(q32, p32 + n);
+            check((uint32_t)n + 1 == priorityq16_size(q16));
+            check((uint32_t)n + 1 == priorityq32_size(q32));
+
+            check(p16 + n == priorityq16_peek(q16));
+            check(p16 + n == priorityq16_dequeue(q16));
+            check(p32 + n == priorityq32_dequeue(q32));
+            for (i = 0; i < n; ++i)
+            {
+                check(p16 + i == priorityq16_dequeue(q16), "index(%d)", i);
+                check(p32 + i == priorityq32_dequeue(q32), "index(%d)", i);
+            }
+            check(NULL == priorityq16_dequeue(q16));
+            check(NULL == priorityq32_dequeue(q32));
+
+            priorityq16_destroy(q16);
+            priorityq32_destroy(q32);
+            free(p16);
+            free(p32);
+        }
+
+        it("should return a lone item from any counter position, across overflow")
+        {
+            priorityq16_t _q16;
+            priorityq16_t *q16 = &_q16;
+            priority16_t _p16;
+            priority16_t *p16 = &_p16;
+            priorityq32_t _q32;
+            priorityq32_t *q32 = &_q32;
+            priority32_t _p32;
+            priority32_t *p32 = &_p32;
+            int wraps = 0;
+
+            priorityq16_init(q16);
+            priority16_init(p16);
+            priorityq32_init(q32);
+            priority32_init(p32);
+            srand(8196);
+
+            int step;
+            for (step = 0; step < 1 << 14; ++step)
+            {
+                uint16_t pc = q16->pc;
+                priority16_set(p16, NULL, (uint16_t)(rand() % (PQ16_CEILING + 1)));
+                priorityq16_enqueue(q16, p16);
+                check(p16 == priorityq16_dequeue(q16), "step(%d)", step);
+                check(NULL == priorityq16_dequeue(q16));
+                wraps += q16->pc < pc;
+
+                priority32_set(p32, NULL, (uint32_t)rand());
+                priorityq32_enqueue(q32, p32);
+                check(p32 == priorityq32_dequeue(q32), "step(%d)", step);
+                check(NULL == priorityq32_dequeue(q32));
+            }
+            check(wraps > 0);
+
+            priority16_destroy(p16);
+            priorityq16_destroy(q16);
+            priority32_destroy(p32);
+            priorityq32_destroy(q32);
+        }
+
+        it("should hand back every item exactly once under random operations")
+        {
+            const int n = 512;
+            priorityq16_t _q16;
+            priorityq16_t *q16 = &_q16;
+            priority16_t *ps = (priority16_t *)malloc(n * sizeof(priority16_t));
+            int *active = (int *)calloc(n, sizeof(int));
+            uint32_t size = 0;
+
+            priorityq16_init(q16);
+            srand(8196);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority16_init(ps + i);
+            }
+
+            int step;
+            for (step = 0; step < 64 * n; ++step)
+            {
+                int index = rand() % n;
+                switch (rand() % 4)
+                {
+                    case 0:
+                        priorityq16_remove(q16, ps + index);
+                        size -= active[index];
+                        active[index] = 0;
+                        break;
+                    case 1:
+                    {
+                        priority16_t *out = priorityq16_dequeue(q16);
+                        if (out)
+                        {
+                            check(active[out - ps], "step(%d)", step);
+                            check(!priority16_is_active(out));
+                            active[out - ps] = 0;
+                            --size;
+                        }
+                        else
+                        {
+                            check(0 == size, "step(%d)", step);
+                        }
+                        break;
+                    }
+                    default:
+                        priority16_set(ps + index, NULL, (uint16_t)(rand() % (PQ16_CEILING + 1)));
+                        priorityq16_enqueue(q16, ps + index);
+                        size += !active[index];
+                        active[index] = 1;
+                        break;
+                }
+                check(size == priorityq16_size(q16), "step(%d)", step);
+            }
+
+            priority16_t *out;
+            while ((out = priorityq16_dequeue(q16)))
+            {
+                check(active[out - ps]);
+                active[out - ps] = 0;
+                --size;
+            }
+            check(0 == size);
+
+            priorityq16_destroy(q16);
+            free(active);
+            free(ps);
+        }
+    }
+
+    describe("concurrent intake")
+    {
+        it("should collect items in the order they were pushed")
+        {
+            priorityq_mpsc_t _m;
+            priorityq_mpsc_t *m = &_m;
+            priority_t ps[8];
+
+            priorityq_mpsc_init(m);
+            check(NULL == priorityq_mpsc_dequeue(m));
+
+            int i;
+            for (i = 0; i < 8; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, PRIORITY_URGENT);
+                priorityq_mpsc_enqueue(m, ps + i);
+                check(!priority_is_active(ps + i));
+            }
+
+            check(0 == priorityq_size(priorityq_mpsc_queue(m)));
+            priorityq_mpsc_collect(m);
+            check(8 == priorityq_size(priorityq_mpsc_queue(m)));
+            for (i = 0; i < 8; ++i)
+            {
+                check(priority_is_active(ps + i));
+                check((ps + i) == priorityq_mpsc_dequeue(m));
+            }
+            check(NULL == priorityq_mpsc_dequeue(m));
+
+            priorityq_mpsc_destroy(m);
+        }
+
+        it("should keep the items its capacity displaces for the consumer")
+        {
+            priorityq_mpsc_t _m;
+            priorityq_mpsc_t *m = &_m;
+            priority_t ps[4];
+            struct priorityq_node_s displaced;
+            priorityq_list_init(&displaced);
+
+            priorityq_mpsc_init(m);
+            priorityq_set_capacity(priorityq_mpsc_queue(m), 2, PQ_OVERFLOW_REJECT);
+            int i;
+            for (i = 0; i < 4; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, PRIORITY_URGENT);
+                priorityq_mpsc_enqueue(m, ps + i);
+            }
+
+            check(ps + 0 == priorityq_mpsc_dequeue(m));
+            check(ps + 1 == priorityq_mpsc_dequeue(m));
+            check(NULL == priorityq_mpsc_dequeue(m));
+
+            priorityq_mpsc_displaced(m, &displaced);
+            check(ps + 2 == priorityq_list_pop(&displaced));
+            check(ps + 3 == priorityq_list_pop(&displaced));
+            check(NULL == priorityq_list_pop(&displaced));
+            check(!priority_is_active(ps + 2));
+            check(!priority_is_active(ps + 3));
+
+            // Evicting hands back the least urgent item instead.
+            priorityq_set_capacity(priorityq_mpsc_queue(m), 1, PQ_OVERFLOW_EVICT);
+            priority_set(ps + 0, NULL, 50);
+            priority_set(ps + 1, NULL, PRIORITY_URGENT);
+            priorityq_mpsc_enqueue(m, ps + 0);
+            priorityq_mpsc_enqueue(m, ps + 1);
+            check(ps + 1 == priorityq_mpsc_dequeue(m));
+            priorityq_mpsc_displaced(m, &displaced);
+            check(ps + 0 == priorityq_list_pop(&displaced));
+            check(NULL == priorityq_list_pop(&displaced));
+
+            priorityq_mpsc_destroy(m);
+        }
+
+        it("should receive every item from many producers")
+        {
+            priorityq_mpsc_t _m;
+            priorityq_mpsc_t *m = &_m;
+            pthread_t threads[PRODUCERS];
+            producer_t producers[PRODUCERS];
+            priority_t *ps = (priority_t *)malloc(PRODUCERS * PRODUCED * sizeof(priority_t));
+
+            priorityq_mpsc_init(m);
+
+            int i;
+            for (i = 0; i < PRODUCERS * PRODUCED; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(i % (PQ_CEILING + 1)));
+            }
+
+            for (i = 0; i < PRODUCERS; ++i)
+            {
+                producers[i].m = m;
+                producers[i].ps = ps + i * PRODUCED;
+                check(0 == pthread_create(threads + i, NULL, producer_run, producers + i));
+            }
+
+            int received = 0;
+            priority_t *out[64];
+            while (received < PRODUCERS * PRODUCED)
+            {
+                received += priorityq_mpsc_dequeue_batch(m, out, 64);
+            }
+
+            for (i = 0; i < PRODUCERS; ++i)
+            {
+                pthread_join(threads[i], NULL);
+            }
+
+            check(NULL == priorityq_mpsc_dequeue(m));
+            check(0 == priorityq_size(priorityq_mpsc_queue(m)));
+            for (i = 0; i < PRODUCERS * PRODUCED; ++i)
+            {
+                check(!priority_is_active(ps + i));
+            }
+
+            priorityq_mpsc_destroy(m);
+            free(ps);
+        }
+
+#if PQ_WAIT
+        it("should sleep until a producer adds an item")
+        {
+            priorityq_mpsc_t _m;
+            priorityq_mpsc_t *m = &_m;
+            pthread_t thread;
+            delayed_t delayed = { m, p };
+
+            priorityq_mpsc_init(m);
+            priority_init(p);
+            priority_set(p, NULL, 9);
+
+            check(NULL == priorityq_mpsc_dequeue_wait(m, 0));
+            check(NULL == priorityq_mpsc_dequeue_wait(m, 1000 * 1000));
+
+            check(0 == pthread_create(&thread, NULL, delayed_run, &delayed));
+            check(p == priorityq_mpsc_dequeue_wait(m, -1));
+            pthread_join(thread, NULL);
+            check(0 == m->waiting);
+
+            priorityq_mpsc_destroy(m);
+        }
+
+        it("should signal an eventfd when the intake fills")
+        {
+            priorityq_mpsc_t _m;
+            priorityq_mpsc_t *m = &_m;
+            pthread_t thread;
+            delayed_t delayed = { m, p };
+
+            priorityq_mpsc_init(m);
+            priority_init(p);
+            priority_set(p, NULL, 9);
+
+            int fd = priorityq_mpsc_notify_fd(m);
+            check(fd >= 0);
+            check(fd == priorityq_mpsc_notify_fd(m));
+
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            check(0 == poll(&pfd, 1, 0));
+            check(0 == pthread_create(&thread, NULL, delayed_run, &delayed));
+            check(1 == poll(&pfd, 1, 5000));
+            pthread_join(thread, NULL);
+
+            uint64_t count = 0;
+            check(sizeof(count) == read(fd, &count, sizeof(count)));
+            check(1 == count);
+            check(p == priorityq_mpsc_dequeue(m));
+            check(0 == poll(&pfd, 1, 0));
+
+            priorityq_mpsc_destroy(m);
+        }
+#endif
+    }
+
+    describe("sharded pool")
+    {
+        it("should steal the front half of a neighbor's ready items")
+        {
+            static priorityq_shard_t shards[2];
+            priorityq_pool_t _pool;
+            priorityq_pool_t *pool = &_pool;
+            priority_t ps[8];
+
+            priorityq_pool_init(pool, shards, 2);
+            check(NULL == priorityq_pool_dequeue(pool, 1));
+
+            int i;
+            for (i = 0; i < 8; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, PRIORITY_URGENT);
+                priorityq_pool_enqueue(pool, 0, ps + i);
+            }
+            check(8 == priorityq_pool_size(pool));
+
+            check(ps == priorityq_pool_dequeue(pool, 1));
+            check(3 == priorityq_size(&shards[1].q));
+            check(4 == priorityq_size(&shards[0].q));
+            check(4 == priorityq_count_done(&shards[0].q));
+            check(3 == priorityq_count_done(&shards[1].q));
+            check((ps + 4) == priorityq_pool_dequeue(pool, 0));
+            for (i = 1; i < 4; ++i)
+            {
+                check((ps + i) == priorityq_pool_dequeue(pool, 1));
+            }
+            check(3 == priorityq_pool_size(pool));
+
+            priorityq_pool_destroy(pool);
+        }
+
+        it("should hand back what a shard at capacity turns away")
+        {
+            static priorityq_shard_t shards[2];
+            priorityq_pool_t _pool;
+            priorityq_pool_t *pool = &_pool;
+            priority_t ps[2];
+
+            priorityq_pool_init(pool, shards, 2);
+            priorityq_set_capacity(&shards[0].q, 1, PQ_OVERFLOW_REJECT);
+            priority_init(ps + 0);
+            priority_init(ps + 1);
+            priority_set(ps + 0, NULL, 3);
+            priority_set(ps + 1, NULL, 3);
+            check(NULL == priorityq_pool_enqueue(pool, 0, ps + 0));
+            check(ps + 1 == priorityq_pool_enqueue(pool, 0, ps + 1));
+            check(!priority_is_active(ps + 1));
+            check(NULL == priorityq_pool_enqueue(pool, 1, ps + 1));
+            check(2 == priorityq_pool_size(pool));
+
+            priorityq_pool_destroy(pool);
+        }
+
+        it("should take from a neighbor that has nothing ready")
+        {
+            static priorityq_shard_t shards[3];
+            priorityq_pool_t _pool;
+            priorityq_pool_t *pool = &_pool;
+
+            priorityq_pool_init(pool, shards, 3);
+            priority_init(p);
+            priority_set(p, NULL, 100);
+            priorityq_pool_enqueue(pool, 1, p);
+            check(p == priorityq_pool_dequeue(pool, 2));
+            check(0 == priorityq_pool_size(pool));
+            priorityq_pool_destroy(pool);
+        }
+
+        it("should drain an unbalanced pool from many workers")
+        {
+            static priorityq_shard_t shards[WORKERS];
+            priorityq_pool_t _pool;
+            priorityq_pool_t *pool = &_pool;
+            pthread_t threads[WORKERS];
+            worker_t workers[WORKERS];
+            const int n = 1 << 14;
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            int received = 0;
+
+            priorityq_pool_init(pool, shards, WORKERS);
+
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(i % (PQ_CEILING + 1)));
+                priorityq_pool_enqueue(pool, 0, ps + i);
+            }
+
+            for (i = 0; i < WORKERS; ++i)
+            {
+                workers[i].pool = pool;
+                workers[i].index = i;
+                workers[i].received = &received;
+                workers[i].total = n;
+                check(0 == pthread_create(threads + i, NULL, worker_run, workers + i));
+            }
+
+            for (i = 0; i < WORKERS; ++i)
+            {
+                pthread_join(threads[i], NULL);
+            }
+
+            check(n == received);
+            check(0 == priorityq_pool_size(pool));
+
+            priorityq_pool_destroy(pool);
+            free(ps);
+        }
+    }
+
+    describe("hierarchical scheduler")
+    {
+        it("should serve tenants more often the heavier they are")
+        {
+            const int per = 2000;
+            uint8_t weights[4] = { 127, 32, 8, 1 };
+            priorityq_tenant_t tenants[4];
+            priorityq_sched_t _s;
+            priorityq_sched_t *s = &_s;
+            priority_t *ps = (priority_t *)malloc(4 * per * sizeof(priority_t));
+
+            priorityq_sched_init(s);
+            int i;
+            int j;
+            for (i = 0; i < 4; ++i)
+            {
+                priorityq_tenant_init(tenants + i, weights[i]);
+                for (j = 0; j < per; ++j)
+                {
+                    priority_t *e = ps + i * per + j;
+                    priority_init(e);
+                    priority_set(e, tenants + i, 0);
+                    check(NULL == priorityq_sched_enqueue(s, tenants + i, e));
+                }
+            }
+            check(4 == priorityq_sched_tenants(s));
+
+            int served[4] = { 0 };
+            for (j = 0; j < per; ++j)
+            {
+                priority_t *e = priorityq_sched_dequeue(s);
+                priorityq_tenant_t *t = (priorityq_tenant_t *)priority_data(e);
+                ++served[t - tenants];
+            }
+            for (i = 1; i < 4; ++i)
+            {
+                check(served[i - 1] > served[i], "tenant(%d)", i);
+            }
+            check(served[3] > 0);
+
+            // Everything else still comes out, and drained tenants leave.
+            while (priorityq_sched_dequeue(s))
+            {
+                ++j;
+            }
+            check(4 * per == j);
+            check(0 == priorityq_sched_tenants(s));
+
+            for (i = 0; i < 4; ++i)
+            {
+                priorityq_tenant_destroy(tenants + i);
+            }
+            priorityq_sched_destroy(s);
+            free(ps);
+        }
+
+        it("should drop tenants emptied behind its back")
+        {
+            const int n = 1000;
+            priorityq_tenant_t *tenants = (priorityq_tenant_t *)priorityq_alloc(n * sizeof(priorityq_tenant_t));
+            priority_t *ps = (priority_t *)malloc(n * sizeof(priority_t));
+            priorityq_sched_t _s;
+            priorityq_sched_t *s = &_s;
+
+            priorityq_sched_init(s);
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priorityq_tenant_init(tenants + i, (uint8_t)(i % 128));
+                priority_init(ps + i);
+                priority_set(ps + i, NULL, (uint8_t)(i % PQ_CEILING));
+                priorityq_sched_enqueue(s, tenants + i, ps + i);
+            }
+            check(n == (int)priorityq_sched_tenants(s));
+
+            for (i = 0; i < n; i += 2)
+            {
+                priorityq_remove(priorityq_tenant_queue(tenants + i), ps + i);
+            }
+
+            int count = 0;
+            priority_t *e;
+            while ((e = priorityq_sched_dequeue(s)))
+            {
+                check(1 == (e - ps) % 2);
+                ++count;
+            }
+            check(n / 2 == count);
+            check(0 == priorityq_sched_tenants(s));
+
+            for (i = 0; i < n; ++i)
+            {
+                priorityq_tenant_destroy(tenants + i);
+            }
+            priorityq_sched_destroy(s);
+            free(ps);
+            priorityq_free(tenants);
+        }
+    }
+
+    describe("timed priority queue")
+    {
+        it("should hold items until their start and promote missed deadlines")
+        {
+            priorityq_timer_t _t;
+            priorityq_timer_t *t = &_t;
+            priority_timed_t ps[4];
+            int i;
+            for (i = 0; i < 4; ++i)
+            {
+                priority_timed_init(ps + i);
+            }
+
+            priorityq_timer_init(t, 10);
+            check(PQ_TIMER_NEVER == priorityq_timer_next(t));
+
+            priority_timed_set(ps + 0, NULL, 5, 0, PQ_TIMER_NEVER);
+            priority_timed_set(ps + 1, NULL, 1, 100, PQ_TIMER_NEVER);
+            priority_timed_set(ps + 2, NULL, 100, 50, 40);
+            priority_timed_set(ps + 3, NULL, 1, 1000, PQ_TIMER_NEVER);
+            for (i = 0; i < 4; ++i)
+            {
+                check(NULL == priorityq_timer_schedule(t, ps + i));
+                check(priority_is_active(&ps[i].p));
+            }
+            check(3 == priorityq_timer_waiting(t));
+            check(1 == priorityq_size(priorityq_timer_queue(t)));
+            check(priorityq_timer_next(t) <= 50);
+
+            check(0 == priorityq_timer_advance(t, 49, NULL));
+            check(0 == priorityq_timer_advance(t, 20, NULL));
+            check(2 == priorityq_timer_advance(t, 100, NULL));
+            check(1 == priorityq_timer_waiting(t));
+
+            // Past its deadline when released, so it goes first.
+            check(ps + 2 == priorityq_timer_dequeue(t));
+
+            priorityq_timer_remove(t, ps + 3);
+            check(0 == priorityq_timer_waiting(t));
+            check(!priority_is_active(&ps[3].p));
+            check(PQ_TIMER_NEVER == priorityq_timer_next(t));
+
+            // A queued item rescheduled later waits again.
+            ps[1].start = 200;
+            check(NULL == priorityq_timer_schedule(t, ps + 1));
+            check(1 == priorityq_timer_waiting(t));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+            check(NULL == priorityq_timer_dequeue(t));
+            check(1 == priorityq_timer_advance(t, 300, NULL));
+            check(ps + 1 == priorityq_timer_dequeue(t));
+
+            // Cancelled while waiting, it is buried rather than released.
+            struct priorityq_node_s reclaimed;
+            priorityq_list_init(&reclaimed);
+            ps[1].start = 400;
+            check(NULL == priorityq_timer_schedule(t, ps + 1));
+            priority_cancel(&ps[1].p);
+            check(0 == priorityq_timer_advance(t, 500, NULL));
+            check(0 == priorityq_timer_waiting(t));
+            check(NULL == priorityq_timer_dequeue(t));
+            priorityq_reclaim(priorityq_timer_queue(t), &reclaimed);
+            check(&ps[1].p == priorityq_list_pop(&reclaimed));
+
+            priorityq_timer_destroy(t);
+        }
+
+        it("should re-arm a promoted item at its own priority")
+        {
+            priorityq_timer_t _t;
+            priorityq_timer_t *t = &_t;
+            priority_timed_t ps[2];
+            priority_timed_init(ps + 0);
+            priority_timed_init(ps + 1);
+            priorityq_timer_init(t, 0);
+
+            priority_timed_set(ps + 0, NULL, 40, 10, 5);
+            check(NULL == priorityq_timer_schedule(t, ps + 0));
+            check(1 == priorityq_timer_advance(t, 10, NULL));
+            check(1 == priorityq_size_done(priorityq_timer_queue(t)));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+
+            // Re-armed without a deadline, it starts from 40 again.
+            ps[0].start = 20;
+            ps[0].deadline = PQ_TIMER_NEVER;
+            check(NULL == priorityq_timer_schedule(t, ps + 0));
+            check(1 == priorityq_timer_advance(t, 20, NULL));
+            check(40 == priority_value(&ps[0].p));
+
+            // Behind an item queued at a lower priority.
+            priority_timed_set(ps + 1, NULL, 0, 0, PQ_TIMER_NEVER);
+            check(NULL == priorityq_timer_schedule(t, ps + 1));
+            check(ps + 1 == priorityq_timer_dequeue(t));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+
+            // An update while waiting is what the next release uses.
+            ps[0].start = 30;
+            ps[0].deadline = 25;
+            check(NULL == priorityq_timer_schedule(t, ps + 0));
+            priorityq_update(priorityq_timer_queue(t), &ps[0].p, 7);
+            check(1 == priorityq_timer_advance(t, 30, NULL));
+            check(1 == priorityq_size_done(priorityq_timer_queue(t)));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+            ps[0].start = 40;
+            check(NULL == priorityq_timer_schedule(t, ps + 0));
+            ps[0].deadline = PQ_TIMER_NEVER;
+            check(1 == priorityq_timer_advance(t, 40, NULL));
+            check(7 == priority_value(&ps[0].p));
+            check(ps + 0 == priorityq_timer_dequeue(t));
+
+            priorityq_timer_destroy(t);
+        }
+
+        it("should release every item exactly when its start passes")
+        {
+            const int n = 2000;
+            priorityq_timer_t _t;
+            priorityq_timer_t *t = &_t;
+            priority_timed_t *ps = (priority_timed_t *)malloc(n * sizeof(priority_timed_t));
+            uint64_t base = ((uint64_t)1 << 63) - ((uint64_t)1 << 20);
+
+            srand(8196);
+            priorityq_timer_init(t, base);
+            int i;
+            for (i = 0; i < n; ++i)
+            {
+                priority_timed_init(ps + i);
+                uint64_t start = base + (uint64_t)(rand() % (1 << 21));
+                priority_timed_set(ps + i, NULL, (uint8_t)(rand() % PQ_CEILING), start, PQ_TIMER_NEVER);
+                priorityq_timer_schedule(t, ps + i);
+            }
+
+            uint64_t now = base;
+            int released = 0;
+            while (priorityq_timer_waiting(t))
+            {
+                uint64_t next = priorityq_timer_next(t);
+                uint64_t earliest = PQ_TIMER_NEVER;
+                for (i = 0; i < n; ++i)
+                {
+                    if (PQ_TIMER_NEVER != ps[i].start && ps[i].start < earliest)
+                    {
+                        earliest = ps[i].start;
+                    }
+                }
+                check(next <= earliest, "next(%llu) earliest(%llu)",
+                      (unsigned long long)next, (unsigned long long)earliest);
+
+                now += 1 + (uint64_t)(rand() % 4096);
+                int due = 0;
+                for (i = 0; i < n; ++i)
+                {
+                    due += ps[i].start <= now;
+                }
+                check(due == (int)priorityq_timer_advance(t, now, NULL));
+                released += due;
+
+                priority_timed_t *pt;
+                while ((pt = priorityq_timer_dequeue(t)))
+                {
+                    check(pt->start <= now);
+                    pt->start = PQ_TIMER_NEVER;
+                }
+            }
+            check(n == released);
+
+            priorityq_timer_destroy(t);
+            free(ps);
+        }
+    }
+
     describe("brute force test")
     {
         before_each()
@@ -0,0 +1,159 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file prove.cpp
+ * @author Craig Jacobson
+ * @brief Demonstrate the C++ interface.
+ *
+ * bdd.h is C only, so this keeps to a plain check macro.
+ */
+#include "priorityq.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+static int failures = 0;
+
+#define check(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+
+struct job
+{
+    int id;
+    priority_t hook{};
+};
+
+struct wide_job
+{
+    priority16_t hook{};
+    int id;
+};
+
+static void
+test_order()
+{
+    sfpq::queue<job, &job::hook> q;
+    std::vector<job> jobs(4);
+    uint8_t priorities[4] = { 40, sfpq::queue<job, &job::hook>::urgent, 0, 3 };
+    int expected[4] = { 1, 2, 3, 0 };
+
+    int i;
+    for (i = 0; i < 4; ++i)
+    {
+        jobs[i].id = i;
+        q.push(jobs[i], priorities[i]);
+        check(q.contains(jobs[i]));
+    }
+    check(4 == q.size());
+    check(&jobs[1] == q.peek());
+    for (i = 0; i < 4; ++i)
+    {
+        job *j = q.pop();
+        check(j && expected[i] == j->id);
+        check(j && !q.contains(*j));
+    }
+    check(q.empty());
+    check(nullptr == q.pop());
+}
+
+// No default constructor, and the hook behind other members.
+struct owned_job
+{
+    explicit owned_job(int i) : id(i) {}
+    double weight = 0;
+    int id;
+    priority32_t hook{};
+};
+
+static void
+test_owner()
+{
+    sfpq::queue<owned_job, &owned_job::hook> q;
+    owned_job a(7);
+    owned_job b(8);
+    q.push(a, 5);
+    q.push(b, 0);
+    check(&b == q.pop());
+    owned_job *j = q.pop();
+    check(j == &a && 7 == j->id);
+    check(q.empty());
+}
+
+static void
+test_capacity()
+{
+    sfpq::queue<job, &job::hook> q;
+    job a;
+    job b;
+    priorityq_set_capacity(q.native(), 1, PQ_OVERFLOW_EVICT);
+    check(nullptr == q.push(a, 3));
+    // The least urgent item is evicted, here the one already queued.
+    check(&a == q.push(b, 1));
+    check(!q.contains(a));
+    check(&b == q.pop());
+    check(q.empty());
+}
+
+static void
+test_width()
+{
+    typedef sfpq::queue<wide_job, &wide_job::hook> wide_queue;
+    static_assert(16 == wide_queue::bins, "16 bit hooks use 16 bins");
+
+    wide_queue q;
+    wide_job a;
+    wide_job b;
+    a.id = 1;
+    b.id = 2;
+    q.push(a, 20000);
+    q.push(b, 10);
+    check(20000 == wide_queue::priority(a));
+    check(&b == q.pop());
+    q.erase(a);
+    check(q.empty());
+    check(0 == priorityq16_size(q.native()));
+}
+
+int
+main()
+{
+    test_order();
+    test_capacity();
+    test_owner();
+    test_width();
+    if (failures)
+    {
+        return 1;
+    }
+    printf("C++ interface (OK)\n");
+    return 0;
+}
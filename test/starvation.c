@@ -0,0 +1,388 @@
+/*******************************************************************************
+ * Copyright (c) 2025 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file starvation.c
+ * @author Craig Jacobson
+ * @brief Wait time of each priority level from enqueue to dequeue.
+ *
+ * Usage: starvation [n] [dequeues] [csv|json]
+ *
+ * The queue is filled with n items and kept at that size: every tick
+ * dequeues one item and enqueues it again with a priority drawn from the
+ * workload. After n ticks of warm up, the wait of every dequeued item is
+ * recorded in ticks (dequeues) and in nanoseconds, and the distribution
+ * is reported per level, 0 through PQ_CEILING plus urgent.
+ *
+ * Each workload runs under every aging preset. The floods are adversarial:
+ * most items come back urgent or immediate, and the rest are spread over
+ * every level to see how long they wait behind the flood.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "priorityq.h"
+
+#ifndef FORCESEED
+#define FORCESEED (0)
+#endif
+
+// Urgent items are reported in the level after the ceiling.
+#define LEVEL_URGENT (PQ_CEILING + 1)
+#define LEVELS (PQ_CEILING + 2)
+
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "Error getting time: %d, %s\n", errno, strerror(errno));
+        abort();
+    }
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+/*******************************************************************************
+ * Workloads
+*******************************************************************************/
+
+uint8_t
+level_uniform(void)
+{
+    return (uint8_t)(random() % LEVELS);
+}
+
+uint8_t
+level_urgent_flood(void)
+{
+    return (random() % 10) ? LEVEL_URGENT : level_uniform();
+}
+
+uint8_t
+level_immediate_flood(void)
+{
+    return (random() % 10) ? 0 : level_uniform();
+}
+
+uint8_t
+level_low_flood(void)
+{
+    // Short waits keep overtaking everything above them.
+    return (random() % 10) ? (uint8_t)(1 + random() % 4) : level_uniform();
+}
+
+typedef struct
+{
+    const char *name;
+    uint8_t (*level)(void);
+} workload_t;
+
+static const workload_t workloads[] =
+{
+    { "steady", level_uniform },
+    { "urgent_flood", level_urgent_flood },
+    { "immediate_flood", level_immediate_flood },
+    { "low_flood", level_low_flood },
+};
+
+typedef struct
+{
+    const char *name;
+    int preset;
+} aging_t;
+
+static const aging_t agings[] =
+{
+    { "balanced", PQ_AGING_BALANCED },
+    { "throughput", PQ_AGING_THROUGHPUT },
+    { "fairness", PQ_AGING_FAIRNESS },
+};
+
+
+/*******************************************************************************
+ * Running and Reporting
+*******************************************************************************/
+
+typedef struct
+{
+    priority_t p;
+    uint64_t tick;
+    uint64_t ns;
+    uint8_t level;
+} item_t;
+
+typedef struct
+{
+    const char *workload;
+    const char *aging;
+    int level;
+    uint32_t count;
+    double ticks_mean;
+    uint32_t ticks_p50;
+    uint32_t ticks_p99;
+    uint32_t ticks_p999;
+    uint32_t ticks_max;
+    uint32_t ns_p50;
+    uint32_t ns_p99;
+    uint32_t ns_p999;
+    uint32_t ns_max;
+} row_t;
+
+static inline void
+push(priorityq_t *q, item_t *item, uint8_t level, uint64_t tick)
+{
+    item->level = level;
+    item->tick = tick;
+    item->ns = now_ns();
+    priority_set(&item->p, item, LEVEL_URGENT == level ? PRIORITY_URGENT : level);
+    priorityq_enqueue(q, &item->p);
+}
+
+static inline uint32_t
+clamp_u32(uint64_t v)
+{
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Run one workload under one preset.
+ * @return The number of rows written, one per level seen.
+ */
+int
+measure(row_t *rows, const workload_t *w, const aging_t *a, uint32_t n, uint32_t count)
+{
+    priorityq_t *q = (priorityq_t *)priorityq_alloc(sizeof(priorityq_t));
+    item_t *items = (item_t *)malloc(n * sizeof(item_t));
+    uint8_t *levels = (uint8_t *)malloc(count);
+    uint32_t *ticks = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *ns = (uint32_t *)malloc(count * sizeof(uint32_t));
+
+    priorityq_init(q);
+    priorityq_set_aging(q, a->preset);
+
+    uint64_t tick = 0;
+    uint32_t i;
+    for (i = 0; i < n; ++i)
+    {
+        priority_init(&items[i].p);
+        push(q, items + i, w->level(), tick);
+    }
+
+    uint32_t recorded = 0;
+    while (recorded < count)
+    {
+        item_t *item = (item_t *)priorityq_dequeue(q)->data;
+        uint64_t done = now_ns();
+        if (tick >= n)
+        {
+            levels[recorded] = item->level;
+            ticks[recorded] = clamp_u32(tick - item->tick);
+            ns[recorded] = clamp_u32(done - item->ns);
+            ++recorded;
+        }
+        push(q, item, w->level(), ++tick);
+    }
+
+    // Group the samples by level, then sort each group.
+    uint32_t offsets[LEVELS + 1] = { 0 };
+    for (i = 0; i < count; ++i)
+    {
+        ++offsets[levels[i] + 1];
+    }
+    int l;
+    for (l = 0; l < LEVELS; ++l)
+    {
+        offsets[l + 1] += offsets[l];
+    }
+    uint32_t *by_ticks = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *by_ns = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t fill[LEVELS];
+    memcpy(fill, offsets, sizeof(fill));
+    for (i = 0; i < count; ++i)
+    {
+        uint32_t k = fill[levels[i]]++;
+        by_ticks[k] = ticks[i];
+        by_ns[k] = ns[i];
+    }
+
+    int written = 0;
+    for (l = 0; l < LEVELS; ++l)
+    {
+        uint32_t k = offsets[l + 1] - offsets[l];
+        if (!k)
+        {
+            continue;
+        }
+        uint32_t *t = by_ticks + offsets[l];
+        uint32_t *d = by_ns + offsets[l];
+        qsort(t, k, sizeof(uint32_t), compare_u32);
+        qsort(d, k, sizeof(uint32_t), compare_u32);
+
+        double sum = 0;
+        for (i = 0; i < k; ++i)
+        {
+            sum += t[i];
+        }
+
+        row_t *row = rows + written++;
+        row->workload = w->name;
+        row->aging = a->name;
+        row->level = l;
+        row->count = k;
+        row->ticks_mean = sum / k;
+        row->ticks_p50 = t[(uint32_t)(k * 0.5)];
+        row->ticks_p99 = t[(uint32_t)(k * 0.99)];
+        row->ticks_p999 = t[(uint32_t)(k * 0.999)];
+        row->ticks_max = t[k - 1];
+        row->ns_p50 = d[(uint32_t)(k * 0.5)];
+        row->ns_p99 = d[(uint32_t)(k * 0.99)];
+        row->ns_p999 = d[(uint32_t)(k * 0.999)];
+        row->ns_max = d[k - 1];
+    }
+
+    free(by_ns);
+    free(by_ticks);
+    free(ns);
+    free(ticks);
+    free(levels);
+    priorityq_destroy(q);
+    priorityq_free(q);
+    free(items);
+    return written;
+}
+
+static const char *
+level_name(int level, char *buf)
+{
+    if (LEVEL_URGENT == level)
+    {
+        return "urgent";
+    }
+    sprintf(buf, "%d", level);
+    return buf;
+}
+
+void
+print_csv(const row_t *rows, int count)
+{
+    printf("workload,aging,level,count,ticks_mean,ticks_p50,ticks_p99,ticks_p999,ticks_max,"
+           "ns_p50,ns_p99,ns_p999,ns_max\n");
+    char buf[8];
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        const row_t *r = rows + i;
+        printf("%s,%s,%s,%u,%.1f,%u,%u,%u,%u,%u,%u,%u,%u\n",
+               r->workload, r->aging, level_name(r->level, buf), r->count, r->ticks_mean,
+               r->ticks_p50, r->ticks_p99, r->ticks_p999, r->ticks_max,
+               r->ns_p50, r->ns_p99, r->ns_p999, r->ns_max);
+    }
+}
+
+void
+print_json(const row_t *rows, int count)
+{
+    printf("[\n");
+    char buf[8];
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        const row_t *r = rows + i;
+        printf("  {\"workload\": \"%s\", \"aging\": \"%s\", \"level\": \"%s\", \"count\": %u, "
+               "\"ticks_mean\": %.1f, \"ticks_p50\": %u, \"ticks_p99\": %u, \"ticks_p999\": %u, "
+               "\"ticks_max\": %u, \"ns_p50\": %u, \"ns_p99\": %u, \"ns_p999\": %u, "
+               "\"ns_max\": %u}%s\n",
+               r->workload, r->aging, level_name(r->level, buf), r->count, r->ticks_mean,
+               r->ticks_p50, r->ticks_p99, r->ticks_p999, r->ticks_max,
+               r->ns_p50, r->ns_p99, r->ns_p999, r->ns_max, i + 1 < count ? "," : "");
+    }
+    printf("]\n");
+}
+
+int
+random_seed(void)
+{
+    int seed = FORCESEED;
+    if (!seed)
+    {
+        seed = (int)time(0);
+    }
+    srandom(seed);
+    return seed;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    uint32_t n = argc >= 2 ? (uint32_t)atoi(argv[1]) : 1u << 16;
+    uint32_t count = argc >= 3 ? (uint32_t)atoi(argv[2]) : 1u << 20;
+    bool json = argc >= 4 && !strcmp(argv[3], "json");
+    if (!n || !count)
+    {
+        fprintf(stderr, "Usage: %s [n] [dequeues] [csv|json]\n", argv[0]);
+        return 1;
+    }
+
+    int seed = random_seed();
+    fprintf(stderr, "Seed: %d\n", seed);
+
+    const int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+    const int nagings = sizeof(agings) / sizeof(agings[0]);
+    row_t *rows = (row_t *)malloc(nworkloads * nagings * LEVELS * sizeof(row_t));
+    int written = 0;
+
+    int w, a;
+    for (w = 0; w < nworkloads; ++w)
+    {
+        for (a = 0; a < nagings; ++a)
+        {
+            written += measure(rows + written, workloads + w, agings + a, n, count);
+        }
+    }
+
+    if (json)
+    {
+        print_json(rows, written);
+    }
+    else
+    {
+        print_csv(rows, written);
+    }
+
+    free(rows);
+    return 0;
+}